@@ -7,6 +7,7 @@
 #include <motioncam/ImageProcessor.h>
 #include <motioncam/RawBufferManager.h>
 #include <motioncam/RawImageBuffer.h>
+#include <motioncam/HalideAllocator.h>
 #include <json11/json11.hpp>
 
 #include "NativeCameraBridgeListener.h"
@@ -38,6 +39,14 @@ namespace {
     static std::string gLastError;
 }
 
+extern "C" JNIEXPORT
+jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
+    // Pool the Halide scratch memory, installed once before any pipeline runs
+    HalideAllocator::install();
+
+    return JNI_VERSION_1_6;
+}
+
 extern "C" JNIEXPORT
 jboolean JNICALL Java_com_motioncam_camera_NativeCamera_Create(
         JNIEnv* env, jobject instance) {
@@ -0,0 +1,1123 @@
+//
+// Benchmarks the generated Halide pipelines in isolation on synthetic bayer data. Each pipeline is run for every
+// combination of resolution, thread count, pixel format and sensor arrangement it depends on. The median time,
+// throughput in sensor megapixels per second and peak scratch memory of each case are written as CSV or JSON.
+//
+// Usage: generator_benchmark [options]
+//
+//   --resolutions=2016x1512,4032x3024   Sensor resolutions
+//   --threads=1,8                       Halide thread counts, defaults to 1 and all cores
+//   --formats=raw10,raw12,raw16         Pixel formats
+//   --arrangements=rggb,grbg,gbrg,bggr  Sensor arrangements
+//   --iterations=5                      Timed iterations per case
+//   --warmup=1                          Untimed iterations per case
+//   --filter=fuse,postprocess           Only run benchmarks whose name contains one of these
+//   --format=csv|json                   Output format
+//   --output=path                       Output file, defaults to generator_benchmark.csv or .json
+//   --check=tiled_fuse                  Instead of benchmarking, fuse a synthetic burst with and without tiles and
+//                                       fail when the results differ by more than the tolerance
+//
+// The library logs to stdout so results are always written to a file.
+//
+
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/BurstFuser.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/HalideAllocator.h"
+#include "motioncam/Settings.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Types.h"
+#include "motioncam/Util.h"
+
+// Halide
+#include "build_bayer.h"
+#include "build_bayer2.h"
+#include "forward_transform.h"
+#include "inverse_transform.h"
+#include "fuse_denoise_3x3.h"
+#include "fuse_denoise_5x5.h"
+#include "fuse_denoise_7x7.h"
+#include "fuse_denoise_tiles_3x3.h"
+#include "fuse_denoise_tiles_5x5.h"
+#include "fuse_denoise_tiles_7x7.h"
+#include "tile_align.h"
+
+#include "camera_preview2_raw10.h"
+#include "camera_preview3_raw10.h"
+#include "camera_preview4_raw10.h"
+#include "camera_preview2_raw12.h"
+#include "camera_preview3_raw12.h"
+#include "camera_preview4_raw12.h"
+#include "camera_preview2_raw16.h"
+#include "camera_preview3_raw16.h"
+#include "camera_preview4_raw16.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <tuple>
+#include <cmath>
+#include <cstdio>
+
+#include <HalideRuntime.h>
+#include <json11/json11.hpp>
+#include <opencv2/core.hpp>
+
+using namespace motioncam;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+    typedef int (*CameraPreviewFunc)(struct halide_buffer_t*, int, float, float, float, float, float, float,
+                                     struct halide_buffer_t*, bool, int, int, float, float, float, float, float,
+                                     struct halide_buffer_t*, struct halide_buffer_t*, struct halide_buffer_t*,
+                                     struct halide_buffer_t*, int, float, float, float, float, float, float, float,
+                                     struct halide_buffer_t*);
+
+    // Tile size the tile_align and fuse_denoise_tiles generators are built with
+    const int ALIGN_TILE_SIZE = 16;
+
+    // Noise threshold of the fuse benchmarks, a typical value for a well exposed frame
+    const float FUSE_NOISE_THRESHOLD = 0.01f;
+
+    // Burst fused by the tiled fuse check and the tile size it uses
+    const int TILED_FUSE_FRAMES = 4;
+    const int TILED_FUSE_TILE_SIZE = 256;
+
+    // Tiles are aligned and denoised separately so the results differ slightly near their edges. Errors are
+    // relative to the range of the fused output.
+    const double TILED_FUSE_MEAN_TOLERANCE = 0.002;
+    const double TILED_FUSE_MAX_TOLERANCE = 0.05;
+
+    struct BenchmarkConfig {
+        std::vector<cv::Size> resolutions;
+        std::vector<int> threads;
+        std::vector<PixelFormat> pixelFormats;
+        std::vector<ColorFilterArrangment> arrangements;
+        std::vector<std::string> filters;
+        int iterations;
+        int warmup;
+        std::string format;
+        std::string outputPath;
+        std::string check;
+
+        BenchmarkConfig() :
+            resolutions({ cv::Size(2016, 1512), cv::Size(4032, 3024) }),
+            pixelFormats({ PixelFormat::RAW10, PixelFormat::RAW12, PixelFormat::RAW16 }),
+            arrangements({ ColorFilterArrangment::RGGB,
+                           ColorFilterArrangment::GRBG,
+                           ColorFilterArrangment::GBRG,
+                           ColorFilterArrangment::BGGR }),
+            iterations(5),
+            warmup(1),
+            format("csv")
+        {
+            const int cores = (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+            threads.push_back(1);
+            if(cores > 1)
+                threads.push_back(cores);
+        }
+    };
+
+    struct BenchmarkResult {
+        std::string name;
+        std::string pixelFormat;
+        std::string sensorArrangement;
+        int width;
+        int height;
+        int threads;
+        int iterations;
+        double medianMs;
+        double minMs;
+        double maxMs;
+        double megapixelsPerSecond;
+        size_t peakScratchBytes;
+    };
+
+    //
+    // Synthetic input
+    //
+
+    struct RawInput {
+        std::shared_ptr<RawImageBuffer> rawImage;
+        RawCameraMetadata cameraMetadata;
+    };
+
+    // Pair of deinterleaved frames used by the benchmarks that run after the raw data has been loaded
+    struct PlanarInput {
+        std::shared_ptr<RawData> reference;
+        std::shared_ptr<RawData> current;
+        int offsetX;
+        int offsetY;
+    };
+
+    static void getLevels(PixelFormat pixelFormat, int& outBlackLevel, int& outWhiteLevel) {
+        switch(pixelFormat) {
+            case PixelFormat::RAW12:
+                outBlackLevel = 256;
+                outWhiteLevel = 4095;
+                break;
+
+            case PixelFormat::RAW16:
+                outBlackLevel = 1024;
+                outWhiteLevel = 16383;
+                break;
+
+            default:
+            case PixelFormat::RAW10:
+                outBlackLevel = 64;
+                outWhiteLevel = 1023;
+                break;
+        }
+    }
+
+    static int getRowStride(PixelFormat pixelFormat, int width) {
+        switch(pixelFormat) {
+            case PixelFormat::RAW10:
+                return width * 10 / 8;
+
+            case PixelFormat::RAW12:
+                return width * 12 / 8;
+
+            default:
+            case PixelFormat::RAW16:
+                return width * 2;
+        }
+    }
+
+    //
+    // A gradient with noise on top so the tonemap and denoise pipelines see some structure. Values are packed the
+    // way the camera delivers them: RAW10 as four pixels in five bytes, RAW12 as two pixels in three bytes with
+    // the low bits in the last byte and RAW16 as little endian words.
+    //
+
+    static std::shared_ptr<RawImageBuffer> createRawImage(const cv::Size& size, PixelFormat pixelFormat, uint32_t seed) {
+        int blackLevel, whiteLevel;
+        getLevels(pixelFormat, blackLevel, whiteLevel);
+
+        const int width = size.width;
+        const int height = size.height;
+        const int rowStride = getRowStride(pixelFormat, width);
+        const int range = whiteLevel - blackLevel;
+
+        auto rawImage = std::make_shared<RawImageBuffer>(
+            std::unique_ptr<NativeBuffer>(new NativeHostBuffer(static_cast<size_t>(rowStride) * height)));
+
+        rawImage->pixelFormat       = pixelFormat;
+        rawImage->width             = width;
+        rawImage->height            = height;
+        rawImage->originalWidth     = width;
+        rawImage->originalHeight    = height;
+        rawImage->rowStride         = rowStride;
+
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> noise(-range / 32, range / 32);
+
+        std::vector<uint16_t> row(width);
+        uint8_t* data = rawImage->data->lock(true);
+
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x++) {
+                const int gradient = static_cast<int>(0.8 * range * (x + y) / (width + height));
+                row[x] = static_cast<uint16_t>((std::min)(whiteLevel, (std::max)(0, blackLevel + gradient + noise(rng))));
+            }
+
+            uint8_t* out = data + static_cast<size_t>(y) * rowStride;
+
+            if(pixelFormat == PixelFormat::RAW10) {
+                for(int x = 0; x < width; x += 4) {
+                    out[0] = static_cast<uint8_t>(row[x]     >> 2);
+                    out[1] = static_cast<uint8_t>(row[x + 1] >> 2);
+                    out[2] = static_cast<uint8_t>(row[x + 2] >> 2);
+                    out[3] = static_cast<uint8_t>(row[x + 3] >> 2);
+                    out[4] = static_cast<uint8_t>( (row[x] & 0x03)
+                                                 | ((row[x + 1] & 0x03) << 2)
+                                                 | ((row[x + 2] & 0x03) << 4)
+                                                 | ((row[x + 3] & 0x03) << 6));
+                    out += 5;
+                }
+            }
+            else if(pixelFormat == PixelFormat::RAW12) {
+                for(int x = 0; x < width; x += 2) {
+                    out[0] = static_cast<uint8_t>(row[x]     >> 4);
+                    out[1] = static_cast<uint8_t>(row[x + 1] >> 4);
+                    out[2] = static_cast<uint8_t>((row[x] & 0x0F) | ((row[x + 1] & 0x0F) << 4));
+                    out += 3;
+                }
+            }
+            else {
+                for(int x = 0; x < width; x++) {
+                    out[0] = static_cast<uint8_t>(row[x] & 0xFF);
+                    out[1] = static_cast<uint8_t>(row[x] >> 8);
+                    out += 2;
+                }
+            }
+        }
+
+        rawImage->data->unlock();
+
+        // Flat shading map and a neutral white balance
+        std::vector<cv::Mat> shadingMap;
+        for(int c = 0; c < 4; c++)
+            shadingMap.push_back(cv::Mat(13, 17, CV_32F, cv::Scalar(1.0f)));
+
+        rawImage->metadata.updateShadingMap(shadingMap);
+        rawImage->metadata.asShot = cv::Vec3f(0.5f, 1.0f, 0.6f);
+        rawImage->metadata.iso = 100;
+        rawImage->metadata.exposureTime = 10 * 1000 * 1000;
+        rawImage->metadata.screenOrientation = ScreenOrientation::LANDSCAPE;
+
+        return rawImage;
+    }
+
+    static RawInput createRawInput(const cv::Size& size, PixelFormat pixelFormat, uint32_t seed) {
+        int blackLevel, whiteLevel;
+        getLevels(pixelFormat, blackLevel, whiteLevel);
+
+        RawInput input;
+
+        input.rawImage = createRawImage(size, pixelFormat, seed);
+        input.cameraMetadata.updateBayerOffsets(std::vector<float>(4, static_cast<float>(blackLevel)), static_cast<float>(whiteLevel));
+
+        return input;
+    }
+
+    static PlanarInput createPlanarInput(const cv::Size& size) {
+        RawInput reference = createRawInput(size, PixelFormat::RAW16, 1);
+        RawInput current = createRawInput(size, PixelFormat::RAW16, 2);
+
+        PlanarInput input;
+
+        input.reference = ImageProcessor::loadRawImage(*reference.rawImage, reference.cameraMetadata);
+        input.current = ImageProcessor::loadRawImage(*current.rawImage, current.cameraMetadata);
+
+        // Same padding as the edges added when loading
+        const int T = pow(2, EXTEND_EDGE_AMOUNT);
+        const int rawWidth = size.width / 2;
+        const int rawHeight = size.height / 2;
+
+        input.offsetX = static_cast<int>(T * ceil(rawWidth / (double) T) - rawWidth);
+        input.offsetY = static_cast<int>(T * ceil(rawHeight / (double) T) - rawHeight);
+
+        return input;
+    }
+
+    static std::vector<Halide::Runtime::Buffer<float>> createShadingMapBuffers(const RawImageMetadata& metadata) {
+        std::vector<Halide::Runtime::Buffer<float>> buffers;
+
+        for(auto& m : metadata.shadingMap())
+            buffers.push_back(Halide::Runtime::Buffer<float>((float*) m.data, m.cols, m.rows).copy());
+
+        return buffers;
+    }
+
+    static Halide::Runtime::Buffer<float> createCameraToSrgbBuffer(const RawInput& input) {
+        cv::Mat cameraToPcs;
+        cv::Mat pcsToSrgb;
+        cv::Vec3f cameraWhite;
+
+        ImageProcessor::createSrgbMatrix(
+            input.cameraMetadata, input.rawImage->metadata, input.rawImage->metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
+
+        cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
+        cameraToSrgb.convertTo(cameraToSrgb, CV_32F);
+
+        return Halide::Runtime::Buffer<float>((float*) cameraToSrgb.data, cameraToSrgb.cols, cameraToSrgb.rows).copy();
+    }
+
+    static Halide::Runtime::Buffer<uint8_t> getInputBuffer(const RawInput& input) {
+        NativeBuffer& data = *input.rawImage->data;
+
+        Halide::Runtime::Buffer<uint8_t> buffer(data.lock(false), static_cast<int>(data.len()));
+        data.unlock();
+
+        return buffer;
+    }
+
+    static void checkResult(int result, const std::string& name) {
+        if(result != 0)
+            throw InvalidState(name + " failed with error " + std::to_string(result));
+    }
+
+    //
+    // Benchmarks
+    //
+
+    typedef std::function<std::function<void()>(RawInput&)> RawBenchmarkSetup;
+    typedef std::function<std::function<void()>(RawInput&, PlanarInput&)> PlanarBenchmarkSetup;
+
+    struct Benchmark {
+        std::string name;
+
+        // Benchmarks that read the raw sensor data run for every pixel format, the others on deinterleaved data
+        bool usesPixelFormat;
+        bool usesSensorArrangement;
+
+        RawBenchmarkSetup setupRaw;
+        PlanarBenchmarkSetup setupPlanar;
+    };
+
+    static Benchmark rawBenchmark(const std::string& name, const RawBenchmarkSetup& setup) {
+        return Benchmark { name, true, true, setup, PlanarBenchmarkSetup() };
+    }
+
+    static Benchmark planarBenchmark(const std::string& name, bool usesSensorArrangement, const PlanarBenchmarkSetup& setup) {
+        return Benchmark { name, false, usesSensorArrangement, RawBenchmarkSetup(), setup };
+    }
+
+    static CameraPreviewFunc getCameraPreview(PixelFormat pixelFormat, int downscaleFactor) {
+        switch(pixelFormat) {
+            case PixelFormat::RAW10:
+                return downscaleFactor == 2 ? &camera_preview2_raw10 : (downscaleFactor == 3 ? &camera_preview3_raw10 : &camera_preview4_raw10);
+
+            case PixelFormat::RAW12:
+                return downscaleFactor == 2 ? &camera_preview2_raw12 : (downscaleFactor == 3 ? &camera_preview3_raw12 : &camera_preview4_raw12);
+
+            case PixelFormat::RAW16:
+                return downscaleFactor == 2 ? &camera_preview2_raw16 : (downscaleFactor == 3 ? &camera_preview3_raw16 : &camera_preview4_raw16);
+
+            default:
+                throw InvalidState("Camera preview does not support " + util::toString(pixelFormat));
+        }
+    }
+
+    static std::vector<Benchmark> createBenchmarks() {
+        std::vector<Benchmark> benchmarks;
+
+        //
+        // Raw sensor data
+        //
+
+        benchmarks.push_back(rawBenchmark("deinterleave_raw", [](RawInput& input) -> std::function<void()> {
+            return [&input]() {
+                ImageProcessor::loadRawImage(*input.rawImage, input.cameraMetadata);
+            };
+        }));
+
+        benchmarks.push_back(rawBenchmark("build_bayer", [](RawInput& input) -> std::function<void()> {
+            auto inputBuffer = getInputBuffer(input);
+            auto shadingMapBuffer = createShadingMapBuffers(input.rawImage->metadata);
+
+            Halide::Runtime::Buffer<uint16_t> bayerBuffer(input.rawImage->width, input.rawImage->height);
+
+            return [&input, inputBuffer, shadingMapBuffer, bayerBuffer]() mutable {
+                const RawImageBuffer& raw = *input.rawImage;
+                const auto& blackLevel = input.cameraMetadata.getBlackLevel();
+
+                checkResult(
+                    build_bayer(inputBuffer,
+                                shadingMapBuffer[0],
+                                shadingMapBuffer[1],
+                                shadingMapBuffer[2],
+                                shadingMapBuffer[3],
+                                raw.width,
+                                raw.height,
+                                raw.rowStride,
+                                static_cast<int>(raw.pixelFormat),
+                                static_cast<int>(input.cameraMetadata.sensorArrangment),
+                                blackLevel[0],
+                                blackLevel[1],
+                                blackLevel[2],
+                                blackLevel[3],
+                                input.cameraMetadata.getWhiteLevel(),
+                                EXPANDED_RANGE,
+                                bayerBuffer), "build_bayer");
+            };
+        }));
+
+        benchmarks.push_back(rawBenchmark("measure_noise", [](RawInput& input) -> std::function<void()> {
+            return [&input]() {
+                std::vector<float> noise, signal;
+                ImageProcessor::measureNoise(input.cameraMetadata, *input.rawImage, noise, signal);
+            };
+        }));
+
+        benchmarks.push_back(rawBenchmark("generate_stats", [](RawInput& input) -> std::function<void()> {
+            return [&input]() {
+                Halide::Runtime::Buffer<uint8_t> whiteLevelClipping, blackLevelClipping;
+                ImageProcessor::generateStats(*input.rawImage, 4, 4, input.cameraMetadata, whiteLevelClipping, blackLevelClipping);
+            };
+        }));
+
+        benchmarks.push_back(rawBenchmark("fast_preview", [](RawInput& input) -> std::function<void()> {
+            return [&input]() {
+                ImageProcessor::createFastPreview(*input.rawImage, 4, 4, input.cameraMetadata);
+            };
+        }));
+
+        // Preview pipelines, one per orientation and downscale factor
+        const std::vector<std::pair<std::string, ScreenOrientation>> orientations = {
+            { "landscape",          ScreenOrientation::LANDSCAPE },
+            { "portrait",           ScreenOrientation::PORTRAIT },
+            { "reverse_landscape",  ScreenOrientation::REVERSE_LANDSCAPE },
+            { "reverse_portrait",   ScreenOrientation::REVERSE_PORTRAIT }
+        };
+
+        for(int downscaleFactor : { 2, 4, 8 }) {
+            for(auto& orientation : orientations) {
+                const ScreenOrientation screenOrientation = orientation.second;
+                const std::string name = "preview_" + orientation.first + std::to_string(downscaleFactor);
+
+                benchmarks.push_back(rawBenchmark(name, [downscaleFactor, screenOrientation](RawInput& input) -> std::function<void()> {
+                    input.rawImage->metadata.screenOrientation = screenOrientation;
+
+                    return [&input, downscaleFactor]() {
+                        PostProcessSettings settings;
+                        ImageProcessor::createPreview(*input.rawImage, downscaleFactor, input.cameraMetadata, settings);
+                    };
+                }));
+            }
+        }
+
+        // Camera preview pipelines. The generator takes the downscaled size of a bayer quad.
+        for(int downscaleFactor : { 2, 3, 4 }) {
+            const std::string name = "camera_preview" + std::to_string(downscaleFactor);
+
+            benchmarks.push_back(rawBenchmark(name, [downscaleFactor](RawInput& input) -> std::function<void()> {
+                const RawImageBuffer& raw = *input.rawImage;
+
+                auto inputBuffer = getInputBuffer(input);
+                auto shadingMapBuffer = createShadingMapBuffers(raw.metadata);
+                auto cameraToSrgbBuffer = createCameraToSrgbBuffer(input);
+                auto cameraPreview = getCameraPreview(raw.pixelFormat, downscaleFactor);
+
+                const int width = raw.width / 2 / downscaleFactor;
+                const int height = raw.height / 2 / downscaleFactor;
+
+                auto outputBuffer = Halide::Runtime::Buffer<uint8_t>::make_interleaved(width, height, 4);
+
+                return [&input, cameraPreview, width, height, inputBuffer, shadingMapBuffer, cameraToSrgbBuffer, outputBuffer]() mutable {
+                    const RawImageBuffer& raw = *input.rawImage;
+                    const auto& blackLevel = input.cameraMetadata.getBlackLevel();
+                    PostProcessSettings settings;
+
+                    checkResult(
+                        cameraPreview(inputBuffer,
+                                      raw.rowStride,
+                                      raw.metadata.asShot[0],
+                                      raw.metadata.asShot[1],
+                                      raw.metadata.asShot[2],
+                                      1.0f,
+                                      1.0f,
+                                      1.0f,
+                                      cameraToSrgbBuffer,
+                                      false,
+                                      width,
+                                      height,
+                                      blackLevel[0],
+                                      blackLevel[1],
+                                      blackLevel[2],
+                                      blackLevel[3],
+                                      input.cameraMetadata.getWhiteLevel(),
+                                      shadingMapBuffer[0],
+                                      shadingMapBuffer[1],
+                                      shadingMapBuffer[2],
+                                      shadingMapBuffer[3],
+                                      static_cast<int>(input.cameraMetadata.sensorArrangment),
+                                      settings.tonemapVariance,
+                                      2.2f,
+                                      settings.shadows,
+                                      settings.blacks,
+                                      settings.whitePoint,
+                                      settings.contrast,
+                                      settings.saturation,
+                                      outputBuffer), "camera_preview");
+                };
+            }));
+        }
+
+        //
+        // Deinterleaved data
+        //
+
+        benchmarks.push_back(planarBenchmark("build_bayer2", true, [](RawInput& input, PlanarInput& planar) -> std::function<void()> {
+            auto& rawBuffer = planar.reference->rawBuffer;
+
+            std::vector<Halide::Runtime::Buffer<uint16_t>> planes;
+            for(int c = 0; c < 4; c++)
+                planes.push_back(rawBuffer.sliced(2, c).copy());
+
+            auto shadingMapBuffer = createShadingMapBuffers(input.rawImage->metadata);
+            Halide::Runtime::Buffer<uint16_t> bayerBuffer(rawBuffer.width() * 2, rawBuffer.height() * 2);
+
+            return [&input, planes, shadingMapBuffer, bayerBuffer]() mutable {
+                checkResult(
+                    build_bayer2(planes[0],
+                                 planes[1],
+                                 planes[2],
+                                 planes[3],
+                                 shadingMapBuffer[0],
+                                 shadingMapBuffer[1],
+                                 shadingMapBuffer[2],
+                                 shadingMapBuffer[3],
+                                 static_cast<int>(input.cameraMetadata.sensorArrangment),
+                                 EXPANDED_RANGE,
+                                 bayerBuffer), "build_bayer2");
+            };
+        }));
+
+        benchmarks.push_back(planarBenchmark("forward_transform", false, [](RawInput&, PlanarInput& planar) -> std::function<void()> {
+            auto rawBuffer = planar.reference->rawBuffer;
+
+            std::vector<Halide::Runtime::Buffer<float>> wavelet;
+            for(int level = 0; level < WAVELET_LEVELS; level++)
+                wavelet.emplace_back(rawBuffer.width() >> (level + 1), rawBuffer.height() >> (level + 1), 4, 4);
+
+            return [rawBuffer, wavelet]() mutable {
+                checkResult(
+                    forward_transform(rawBuffer,
+                                      rawBuffer.width(),
+                                      rawBuffer.height(),
+                                      0,
+                                      wavelet[0],
+                                      wavelet[1],
+                                      wavelet[2],
+                                      wavelet[3]), "forward_transform");
+            };
+        }));
+
+        benchmarks.push_back(planarBenchmark("inverse_transform", false, [](RawInput&, PlanarInput& planar) -> std::function<void()> {
+            auto rawBuffer = planar.reference->rawBuffer;
+
+            std::vector<Halide::Runtime::Buffer<float>> wavelet;
+            for(int level = 0; level < WAVELET_LEVELS; level++)
+                wavelet.emplace_back(rawBuffer.width() >> (level + 1), rawBuffer.height() >> (level + 1), 4, 4);
+
+            checkResult(
+                forward_transform(rawBuffer, rawBuffer.width(), rawBuffer.height(), 0, wavelet[0], wavelet[1], wavelet[2], wavelet[3]),
+                "forward_transform");
+
+            Halide::Runtime::Buffer<float> weightsBuffer(WAVELET_LEVELS);
+            weightsBuffer.fill(1.0f);
+
+            Halide::Runtime::Buffer<uint16_t> outputBuffer(rawBuffer.width(), rawBuffer.height());
+
+            return [wavelet, weightsBuffer, outputBuffer]() mutable {
+                checkResult(
+                    inverse_transform(wavelet[0],
+                                      wavelet[1],
+                                      wavelet[2],
+                                      wavelet[3],
+                                      FUSE_NOISE_THRESHOLD,
+                                      false,
+                                      weightsBuffer,
+                                      outputBuffer), "inverse_transform");
+            };
+        }));
+
+        // Fuse pipelines with a zero flow map. The tiled variants take one offset per alignment tile.
+        typedef int (*FuseFunc)(struct halide_buffer_t*, struct halide_buffer_t*, struct halide_buffer_t*,
+                                struct halide_buffer_t*, struct halide_buffer_t*, int, int, float, float, float, float,
+                                struct halide_buffer_t*);
+
+        const std::vector<std::tuple<std::string, FuseFunc, int>> fuseMethods = {
+            std::make_tuple("fuse_denoise_3x3",         &fuse_denoise_3x3,          1),
+            std::make_tuple("fuse_denoise_5x5",         &fuse_denoise_5x5,          1),
+            std::make_tuple("fuse_denoise_7x7",         &fuse_denoise_7x7,          1),
+            std::make_tuple("fuse_denoise_tiles_3x3",   &fuse_denoise_tiles_3x3,    ALIGN_TILE_SIZE),
+            std::make_tuple("fuse_denoise_tiles_5x5",   &fuse_denoise_tiles_5x5,    ALIGN_TILE_SIZE),
+            std::make_tuple("fuse_denoise_tiles_7x7",   &fuse_denoise_tiles_7x7,    ALIGN_TILE_SIZE)
+        };
+
+        for(auto& fuseMethod : fuseMethods) {
+            const std::string name = std::get<0>(fuseMethod);
+            const FuseFunc method = std::get<1>(fuseMethod);
+            const int flowScale = std::get<2>(fuseMethod);
+
+            benchmarks.push_back(planarBenchmark(name, false, [name, method, flowScale](RawInput&, PlanarInput& planar) -> std::function<void()> {
+                auto reference = planar.reference->rawBuffer;
+                auto current = planar.current->rawBuffer;
+
+                const int width = reference.width();
+                const int height = reference.height();
+                const float w = 1.0f/(2.0f*sqrt(2.0f));
+
+                Halide::Runtime::Buffer<float> fuseOutput(width, height, 4);
+                fuseOutput.fill(0.0f);
+
+                auto flowBuffer = Halide::Runtime::Buffer<float>::make_interleaved(
+                    (width + flowScale - 1) / flowScale, (height + flowScale - 1) / flowScale, 2);
+                flowBuffer.fill(0.0f);
+
+                Halide::Runtime::Buffer<float> thresholdBuffer(4);
+                thresholdBuffer.fill(FUSE_NOISE_THRESHOLD);
+
+                return [name, method, reference, current, fuseOutput, flowBuffer, thresholdBuffer, width, height, w]() mutable {
+                    checkResult(
+                        method(reference,
+                               current,
+                               fuseOutput,
+                               flowBuffer,
+                               thresholdBuffer,
+                               width,
+                               height,
+                               w,
+                               4.0f,
+                               0.0f,
+                               0.0f,
+                               fuseOutput), name);
+                };
+            }));
+        }
+
+        benchmarks.push_back(planarBenchmark("tile_align", false, [](RawInput&, PlanarInput& planar) -> std::function<void()> {
+            auto reference = planar.reference->rawBuffer;
+            auto current = planar.current->rawBuffer;
+
+            const int T = ALIGN_TILE_SIZE;
+
+            auto offsetsBuffer = Halide::Runtime::Buffer<float>::make_interleaved(
+                (reference.width() + T - 1) / T, (reference.height() + T - 1) / T, 2);
+
+            return [reference, current, offsetsBuffer]() mutable {
+                checkResult(tile_align(reference, current, offsetsBuffer), "tile_align");
+            };
+        }));
+
+        // Picks the postprocess schedule for the output size the same way processing does
+        benchmarks.push_back(planarBenchmark("postprocess", true, [](RawInput& input, PlanarInput& planar) -> std::function<void()> {
+            std::vector<Halide::Runtime::Buffer<uint16_t>> planes;
+            for(int c = 0; c < 4; c++)
+                planes.push_back(planar.reference->rawBuffer.sliced(2, c).copy());
+
+            return [&input, &planar, planes]() mutable {
+                PostProcessSettings settings;
+
+                ImageProcessor::postProcess(planes,
+                                            nullptr,
+                                            planar.offsetX,
+                                            planar.offsetY,
+                                            FUSE_NOISE_THRESHOLD,
+                                            input.rawImage->metadata,
+                                            input.cameraMetadata,
+                                            settings);
+            };
+        }));
+
+        return benchmarks;
+    }
+
+    //
+    // Measurement
+    //
+
+    static BenchmarkResult run(const std::function<void()>& method, const BenchmarkConfig& config) {
+        for(int i = 0; i < config.warmup; i++)
+            method();
+
+        std::vector<double> times;
+        size_t peakScratchBytes = 0;
+
+        for(int i = 0; i < config.iterations; i++) {
+            HalideAllocator::resetStats();
+
+            auto start = Clock::now();
+            method();
+            auto end = Clock::now();
+
+            times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            peakScratchBytes = (std::max)(peakScratchBytes, HalideAllocator::stats().peakAllocatedBytes);
+        }
+
+        std::sort(times.begin(), times.end());
+
+        const size_t n = times.size();
+
+        BenchmarkResult result;
+
+        result.iterations = static_cast<int>(n);
+        result.medianMs = n % 2 == 1 ? times[n / 2] : 0.5 * (times[n / 2 - 1] + times[n / 2]);
+        result.minMs = times.front();
+        result.maxMs = times.back();
+        result.peakScratchBytes = peakScratchBytes;
+
+        return result;
+    }
+
+    static bool isSelected(const Benchmark& benchmark, const BenchmarkConfig& config) {
+        if(config.filters.empty())
+            return true;
+
+        for(auto& filter : config.filters) {
+            if(benchmark.name.find(filter) != std::string::npos)
+                return true;
+        }
+
+        return false;
+    }
+
+    static std::vector<BenchmarkResult> runBenchmarks(const BenchmarkConfig& config) {
+        std::vector<Benchmark> benchmarks = createBenchmarks();
+        std::vector<BenchmarkResult> results;
+
+        auto runCase = [&](const Benchmark& benchmark,
+                           const std::function<void()>& method,
+                           const cv::Size& size,
+                           int threads,
+                           const std::string& pixelFormat,
+                           const std::string& sensorArrangement) -> void
+        {
+            BenchmarkResult result = run(method, config);
+
+            result.name                 = benchmark.name;
+            result.pixelFormat          = pixelFormat;
+            result.sensorArrangement    = sensorArrangement;
+            result.width                = size.width;
+            result.height               = size.height;
+            result.threads              = threads;
+            result.megapixelsPerSecond  = (size.area() / 1e6) / (result.medianMs / 1000.0);
+
+            std::cerr << result.name << " " << pixelFormat << " " << sensorArrangement << " "
+                      << size.width << "x" << size.height << " threads=" << threads << ": "
+                      << result.medianMs << " ms, " << result.megapixelsPerSecond << " MP/s, "
+                      << result.peakScratchBytes / (1024 * 1024) << " MB scratch" << std::endl;
+
+            results.push_back(result);
+        };
+
+        for(auto& size : config.resolutions) {
+            // Deinterleaved frames are only created when a selected benchmark needs them
+            std::shared_ptr<PlanarInput> planar;
+            std::shared_ptr<RawInput> planarMetadata;
+
+            for(auto& benchmark : benchmarks) {
+                if(!isSelected(benchmark, config) || benchmark.usesPixelFormat)
+                    continue;
+
+                if(!planar) {
+                    planar = std::make_shared<PlanarInput>(createPlanarInput(size));
+                    planarMetadata = std::make_shared<RawInput>(createRawInput(size, PixelFormat::RAW16, 1));
+                }
+
+                const auto arrangements = benchmark.usesSensorArrangement ?
+                    config.arrangements : std::vector<ColorFilterArrangment> { ColorFilterArrangment::RGGB };
+
+                for(auto arrangement : arrangements) {
+                    planarMetadata->cameraMetadata.sensorArrangment = arrangement;
+
+                    auto method = benchmark.setupPlanar(*planarMetadata, *planar);
+                    const std::string arrangementName = benchmark.usesSensorArrangement ? util::toString(arrangement) : "-";
+
+                    for(int threads : config.threads) {
+                        halide_set_num_threads(threads);
+                        cv::setNumThreads(threads);
+
+                        runCase(benchmark, method, size, threads, "-", arrangementName);
+                    }
+                }
+            }
+
+            planar = nullptr;
+            planarMetadata = nullptr;
+
+            for(auto pixelFormat : config.pixelFormats) {
+                std::shared_ptr<RawInput> input;
+
+                for(auto& benchmark : benchmarks) {
+                    if(!isSelected(benchmark, config) || !benchmark.usesPixelFormat)
+                        continue;
+
+                    if(!input)
+                        input = std::make_shared<RawInput>(createRawInput(size, pixelFormat, 1));
+
+                    for(auto arrangement : config.arrangements) {
+                        input->cameraMetadata.sensorArrangment = arrangement;
+
+                        auto method = benchmark.setupRaw(*input);
+
+                        for(int threads : config.threads) {
+                            halide_set_num_threads(threads);
+                            cv::setNumThreads(threads);
+
+                            runCase(benchmark, method, size, threads, util::toString(pixelFormat), util::toString(arrangement));
+                        }
+                    }
+                }
+            }
+        }
+
+        return results;
+    }
+
+    //
+    // Checks
+    //
+
+    static std::vector<Halide::Runtime::Buffer<uint16_t>> fuseBurst(const RawInput& reference,
+                                                                    const std::vector<std::shared_ptr<RawImageBuffer>>& burst,
+                                                                    int tileSize)
+    {
+        BurstFuserConfig fuserConfig;
+
+        fuserConfig.tileSize = tileSize;
+
+        BurstFuser fuser(reference.cameraMetadata, fuserConfig);
+        BufferFrameSource frames(burst);
+
+        fuser.setReference(reference.rawImage, ImageProcessor::loadRawImage(*reference.rawImage, reference.cameraMetadata));
+
+        return fuser.process(frames);
+    }
+
+    static bool checkTiledFuse(const BenchmarkConfig& config) {
+        bool passed = true;
+
+        for(auto& size : config.resolutions) {
+            RawInput reference = createRawInput(size, PixelFormat::RAW16, 1);
+            std::vector<std::shared_ptr<RawImageBuffer>> burst;
+
+            for(int i = 0; i < TILED_FUSE_FRAMES; i++)
+                burst.push_back(createRawImage(size, PixelFormat::RAW16, 2 + i));
+
+            auto untiled = fuseBurst(reference, burst, 0);
+            auto tiled = fuseBurst(reference, burst, TILED_FUSE_TILE_SIZE);
+
+            double errorSum = 0;
+            double maxError = 0;
+            size_t samples = 0;
+
+            for(int c = 0; c < 4; c++) {
+                cv::Mat untiledChannel(untiled[c].height(), untiled[c].width(), CV_16U, untiled[c].data());
+                cv::Mat tiledChannel(tiled[c].height(), tiled[c].width(), CV_16U, tiled[c].data());
+                cv::Mat difference;
+
+                cv::absdiff(untiledChannel, tiledChannel, difference);
+
+                double channelMax = 0;
+                cv::minMaxLoc(difference, nullptr, &channelMax);
+
+                errorSum += cv::sum(difference)[0];
+                maxError = (std::max)(maxError, channelMax);
+                samples += difference.total();
+            }
+
+            const double meanError = errorSum / (std::max)(static_cast<size_t>(1), samples) / EXPANDED_RANGE;
+            maxError /= EXPANDED_RANGE;
+
+            const bool ok = meanError <= TILED_FUSE_MEAN_TOLERANCE && maxError <= TILED_FUSE_MAX_TOLERANCE;
+
+            std::cerr << "tiled_fuse " << size.width << "x" << size.height << ": mean error " << meanError
+                      << ", max error " << maxError << (ok ? " ok" : " FAILED") << std::endl;
+
+            passed = passed && ok;
+        }
+
+        return passed;
+    }
+
+    //
+    // Output
+    //
+
+    static void writeCsv(const std::vector<BenchmarkResult>& results, std::ostream& out) {
+        out << "benchmark,pixel_format,sensor_arrangement,width,height,threads,iterations,"
+            << "median_ms,min_ms,max_ms,mpix_per_sec,peak_scratch_bytes" << std::endl;
+
+        for(auto& r : results) {
+            out << r.name << ","
+                << r.pixelFormat << ","
+                << r.sensorArrangement << ","
+                << r.width << ","
+                << r.height << ","
+                << r.threads << ","
+                << r.iterations << ","
+                << r.medianMs << ","
+                << r.minMs << ","
+                << r.maxMs << ","
+                << r.megapixelsPerSecond << ","
+                << r.peakScratchBytes << std::endl;
+        }
+    }
+
+    static void writeJson(const std::vector<BenchmarkResult>& results, std::ostream& out) {
+        json11::Json::array resultsJson;
+
+        for(auto& r : results) {
+            json11::Json::object resultJson;
+
+            resultJson["benchmark"]             = r.name;
+            resultJson["pixelFormat"]           = r.pixelFormat;
+            resultJson["sensorArrangement"]     = r.sensorArrangement;
+            resultJson["width"]                 = r.width;
+            resultJson["height"]                = r.height;
+            resultJson["threads"]               = r.threads;
+            resultJson["iterations"]            = r.iterations;
+            resultJson["medianMs"]              = r.medianMs;
+            resultJson["minMs"]                 = r.minMs;
+            resultJson["maxMs"]                 = r.maxMs;
+            resultJson["megapixelsPerSecond"]   = r.megapixelsPerSecond;
+            resultJson["peakScratchBytes"]      = static_cast<double>(r.peakScratchBytes);
+
+            resultsJson.push_back(resultJson);
+        }
+
+        json11::Json::object json;
+
+        json["hardwareConcurrency"] = static_cast<int>(std::thread::hardware_concurrency());
+        json["results"] = resultsJson;
+
+        out << json11::Json(json).dump() << std::endl;
+    }
+
+    //
+    // Options
+    //
+
+    static std::vector<std::string> split(const std::string& value) {
+        std::vector<std::string> items;
+        std::stringstream stream(value);
+        std::string item;
+
+        while(std::getline(stream, item, ',')) {
+            if(!item.empty())
+                items.push_back(item);
+        }
+
+        return items;
+    }
+
+    static BenchmarkConfig parseOptions(int argc, char* argv[]) {
+        BenchmarkConfig config;
+
+        for(int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            const size_t separator = arg.find('=');
+
+            if(arg.compare(0, 2, "--") != 0 || separator == std::string::npos)
+                throw InvalidState("Invalid option " + arg);
+
+            const std::string key = arg.substr(2, separator - 2);
+            const std::string value = arg.substr(separator + 1);
+
+            if(key == "resolutions") {
+                config.resolutions.clear();
+
+                for(auto& item : split(value)) {
+                    int width = 0, height = 0;
+
+                    if(sscanf(item.c_str(), "%dx%d", &width, &height) != 2)
+                        throw InvalidState("Invalid resolution " + item);
+
+                    // Packed rows need whole groups of four pixels
+                    if(width <= 0 || height <= 0 || width % 4 != 0 || height % 2 != 0)
+                        throw InvalidState("Resolution " + item + " must have a width divisible by 4 and an even height");
+
+                    config.resolutions.push_back(cv::Size(width, height));
+                }
+            }
+            else if(key == "threads") {
+                config.threads.clear();
+
+                for(auto& item : split(value))
+                    config.threads.push_back((std::max)(1, std::stoi(item)));
+            }
+            else if(key == "formats") {
+                config.pixelFormats.clear();
+
+                for(auto& item : split(value)) {
+                    bool found = false;
+
+                    for(auto format : { PixelFormat::RAW10, PixelFormat::RAW12, PixelFormat::RAW16 }) {
+                        if(util::toString(format) == item) {
+                            config.pixelFormats.push_back(format);
+                            found = true;
+                        }
+                    }
+
+                    if(!found)
+                        throw InvalidState("Unsupported pixel format " + item);
+                }
+            }
+            else if(key == "arrangements") {
+                config.arrangements.clear();
+
+                for(auto& item : split(value)) {
+                    bool found = false;
+
+                    for(auto arrangement : { ColorFilterArrangment::RGGB,
+                                             ColorFilterArrangment::GRBG,
+                                             ColorFilterArrangment::GBRG,
+                                             ColorFilterArrangment::BGGR })
+                    {
+                        if(util::toString(arrangement) == item) {
+                            config.arrangements.push_back(arrangement);
+                            found = true;
+                        }
+                    }
+
+                    if(!found)
+                        throw InvalidState("Unsupported sensor arrangement " + item);
+                }
+            }
+            else if(key == "iterations") {
+                config.iterations = (std::max)(1, std::stoi(value));
+            }
+            else if(key == "warmup") {
+                config.warmup = (std::max)(0, std::stoi(value));
+            }
+            else if(key == "filter") {
+                config.filters = split(value);
+            }
+            else if(key == "format") {
+                if(value != "csv" && value != "json")
+                    throw InvalidState("Invalid output format " + value);
+
+                config.format = value;
+            }
+            else if(key == "output") {
+                config.outputPath = value;
+            }
+            else if(key == "check") {
+                if(value != "tiled_fuse")
+                    throw InvalidState("Unknown check " + value);
+
+                config.check = value;
+            }
+            else {
+                throw InvalidState("Unknown option " + key);
+            }
+        }
+
+        if(config.outputPath.empty())
+            config.outputPath = "generator_benchmark." + config.format;
+
+        return config;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        BenchmarkConfig config = parseOptions(argc, argv);
+
+        // Scratch memory is measured by the pooled allocator the library uses
+        HalideAllocator::install();
+
+        if(config.check == "tiled_fuse")
+            return checkTiledFuse(config) ? 0 : 1;
+
+        auto results = runBenchmarks(config);
+
+        std::ofstream out(config.outputPath);
+        if(!out.is_open())
+            throw IOException("Failed to open " + config.outputPath);
+
+        if(config.format == "json")
+            writeJson(results, out);
+        else
+            writeCsv(results, out);
+
+        std::cerr << "Wrote " << results.size() << " results to " << config.outputPath << std::endl;
+    }
+    catch(std::exception& e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -21,4 +21,9 @@ const float YUV_B = 0.114f;
 
 const int TONEMAP_LEVELS = 11;
 
+// The post process tonemap levels from this level of the bayer channels up are computed once per image, from
+// the bayer channels downscaled to COARSE_TONEMAP_INPUT_LEVEL, and shared by all tiles
+const int COARSE_TONEMAP_LEVEL = 6;
+const int COARSE_TONEMAP_INPUT_LEVEL = 3;
+
 #endif // _COMMON_H_
@@ -44,6 +44,9 @@ class DenoiseGenerator : public Generator<DenoiseGenerator> {
 public:
     GeneratorParam<int> window{"window", 1};
 
+    // When greater than 1 the flow map holds one offset per tile of this size instead of one per pixel
+    GeneratorParam<int> flow_tile_size{"flow_tile_size", 1};
+
     Input<Buffer<uint16_t>> input0{"input0", 3};
     Input<Buffer<uint16_t>> input1{"input1", 3};
     Input<Buffer<float>> pendingOutput{"pendingOutput", 3};
@@ -64,7 +67,8 @@ public:
 
 private:
     Func blockMean(Func in);
-    Func registeredInput();
+    Func sampledFlow();
+    Func registeredInput(Func flow);
 
     Var v_i{"i"};
     Var v_x{"x"};
@@ -141,23 +145,60 @@ Func DenoiseGenerator::blockMean(Func in) {
     return M;
 }
 
-Func DenoiseGenerator::registeredInput() {
-    Func result{"registeredInput"};
-    Func inputF32{"inputF32"};
+Func DenoiseGenerator::sampledFlow() {
+    Func flow{"flow"};
 
     flowMap
         .dim(0).set_stride(2)
         .dim(2).set_stride(1);
 
-    Func clamped = BoundaryConditions::repeat_edge(input1, { {0, width}, {0, height}, {0, 4} } );
+    const int32_t FLOW_TILE_SIZE = flow_tile_size;
+
+    if(FLOW_TILE_SIZE <= 1) {
+        Expr flowX = clamp(v_x, flowMap.dim(0).min(), flowMap.dim(0).max());
+        Expr flowY = clamp(v_y, flowMap.dim(1).min(), flowMap.dim(1).max());
+
+        flow(v_x, v_y, v_c) = flowMap(flowX, flowY, v_c);
+    }
+    else {
+        // Interpolate between the offsets at the centre of each tile
+        const float T = static_cast<float>(FLOW_TILE_SIZE);
+
+        Expr tx = (v_x - T*0.5f) / T;
+        Expr ty = (v_y - T*0.5f) / T;
+
+        Expr ix = cast<int32_t>(floor(tx));
+        Expr iy = cast<int32_t>(floor(ty));
+
+        Expr a = tx - ix;
+        Expr b = ty - iy;
+
+        Expr x0 = clamp(ix,     flowMap.dim(0).min(), flowMap.dim(0).max());
+        Expr x1 = clamp(ix + 1, flowMap.dim(0).min(), flowMap.dim(0).max());
+        Expr y0 = clamp(iy,     flowMap.dim(1).min(), flowMap.dim(1).max());
+        Expr y1 = clamp(iy + 1, flowMap.dim(1).min(), flowMap.dim(1).max());
+
+        flow(v_x, v_y, v_c) =
+            lerp(lerp(flowMap(x0, y0, v_c), flowMap(x1, y0, v_c), a),
+                 lerp(flowMap(x0, y1, v_c), flowMap(x1, y1, v_c), a),
+                 b);
+    }
+
+    return flow;
+}
+
+Func DenoiseGenerator::registeredInput(Func flow) {
+    Func result{"registeredInput"};
+    Func inputF32{"inputF32"};
+
+    // Clamp to the bounds of the buffers rather than the image so tiles of the image can be fused
+    Func clamped = BoundaryConditions::repeat_edge(input1,
+        { {input1.dim(0).min(), input1.dim(0).extent()}, {input1.dim(1).min(), input1.dim(1).extent()}, {0, 4} } );
 
     inputF32(v_x, v_y, v_c) = cast<float>(clamped(v_x, v_y, v_c));
     
-    Expr flowX = clamp(v_x, 0, flowMap.width() - 1);
-    Expr flowY = clamp(v_y, 0, flowMap.height() - 1);
-    
-    Expr fx = v_x + flowMap(flowX, flowY, 0);
-    Expr fy = v_y + flowMap(flowX, flowY, 1);
+    Expr fx = v_x + flow(v_x, v_y, 0);
+    Expr fy = v_y + flow(v_x, v_y, 1);
     
     Expr x = cast<int16_t>(fx + 0.5f);
     Expr y = cast<int16_t>(fy + 0.5f);
@@ -174,7 +215,8 @@ Func DenoiseGenerator::registeredInput() {
 }
 
 void DenoiseGenerator::generate() {    
-    Func inRepeated1 = registeredInput();
+    Func flow = sampledFlow();
+    Func inRepeated1 = registeredInput(flow);
     Func inSigned0{"inSigned0"}, inSigned1{"inSigned1"};
 
     inSigned0(v_x, v_y, v_c) = cast<int16_t>(input0(clamp(v_x, 0, width - 1), clamp(v_y, 0, height - 1), v_c));
@@ -192,8 +234,8 @@ void DenoiseGenerator::generate() {
     Func outMean{"outMean"}, outHigh{"outHigh"};
 
     // Increase weight based on closeness to mean of movement
-    Expr fx = flowMap(v_x, v_y, 0) - flowMeanX;
-    Expr fy = flowMap(v_x, v_y, 1) - flowMeanY;
+    Expr fx = flow(v_x, v_y, 0) - flowMeanX;
+    Expr fy = flow(v_x, v_y, 1) - flowMeanY;
 
     Expr fd = sqrt(fx*fx + fy*fy);
     Expr fw = w*max(1.0f, -0.25f*fd + maxWeight);
@@ -1111,7 +1153,290 @@ void FuseImageGenerator::schedule_for_cpu() {
     }
 }
 
+class NormalizeFuseGenerator : public Generator<NormalizeFuseGenerator> {
+public:
+    Input<Buffer<float>> fused{"fused", 3};
+    Input<Buffer<uint16_t>> reference{"reference", 3};
+    Input<int32_t> numFrames{"numFrames"};
+
+    Input<float> whiteLevel{"whiteLevel"};
+    Input<float[4]> blackLevel{"blackLevel"};
+    Input<float> range{"range"};
+
+    Output<Buffer<uint16_t>> output{"output", 3};
+
+    void generate();
+
+private:
+    Var v_x{"x"};
+    Var v_y{"y"};
+    Var v_c{"c"};
+
+    Var v_yo{"yo"};
+    Var v_yi{"yi"};
+};
+
+void NormalizeFuseGenerator::generate() {
+    Func bl{"bl"};
+
+    bl(v_c) = mux(v_c, {
+        blackLevel[0],
+        blackLevel[1],
+        blackLevel[2],
+        blackLevel[3]
+    });
+
+    // Use the reference when nothing was fused
+    Expr in = select(numFrames <= 0,
+                     cast<float>(reference(v_x, v_y, v_c)),
+                     fused(v_x, v_y, v_c) / cast<float>(numFrames));
+
+    Expr p = in - bl(v_c);
+    Expr s = range / (whiteLevel - bl(v_c));
+
+    output(v_x, v_y, v_c) = cast<uint16_t>(clamp(p * s + 0.5f, 0.0f, range));
+
+    fused.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+    reference.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+    numFrames.set_estimate(8);
+    whiteLevel.set_estimate(1023);
+    blackLevel.set_estimate(0, 64);
+    blackLevel.set_estimate(1, 64);
+    blackLevel.set_estimate(2, 64);
+    blackLevel.set_estimate(3, 64);
+    range.set_estimate(16384);
+    output.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+
+    if(!auto_schedule) {
+        output
+            .compute_root()
+            .bound(v_c, 0, 4)
+            .reorder(v_c, v_x, v_y)
+            .split(v_y, v_yo, v_yi, 16, TailStrategy::GuardWithIf)
+            .vectorize(v_x, 8, TailStrategy::GuardWithIf)
+            .unroll(v_c)
+            .parallel(v_yo);
+
+        // Only read the buffer that is used
+        output.specialize(numFrames <= 0);
+        output.specialize(numFrames > 0);
+    }
+}
+
+//
+// Coarse to fine tile alignment of two deinterleaved bayer images. The four channels are summed into a
+// half resolution image that is downsampled into a pyramid. Starting from the coarsest level, each tile
+// searches around the offset found at the previous level, using L2 distance on the coarse levels and L1
+// on the finest level. The result is one offset per tile, relative to the reference.
+//
+
+class TileAlignGenerator : public Generator<TileAlignGenerator> {
+public:
+    GeneratorParam<int> tile_size{"tile_size", 16};
+    GeneratorParam<int> search_radius{"search_radius", 4};
+    GeneratorParam<int> levels{"levels", 3};
+
+    Input<Buffer<uint16_t>> reference{"reference", 3};
+    Input<Buffer<uint16_t>> input{"input", 3};
+
+    Output<Buffer<float>> output{"output", 3};
+
+    void generate();
+
+private:
+    Func gray(Func in, std::string name);
+    Func downsample(Func in, std::string name);
+    Expr priorOffset(Func prior, int level, int i);
+    Func distance(Func ref, Func alt, Func prior, int level, std::string name);
+
+    Var v_x{"x"};
+    Var v_y{"y"};
+    Var v_c{"c"};
+    Var v_tx{"tx"};
+    Var v_ty{"ty"};
+    Var v_dx{"dx"};
+    Var v_dy{"dy"};
+
+    Var v_yo{"yo"};
+    Var v_yi{"yi"};
+};
+
+Func TileAlignGenerator::gray(Func in, std::string name) {
+    Func result{name};
+
+    result(v_x, v_y) = cast<float>(in(v_x, v_y, 0)) +
+                       cast<float>(in(v_x, v_y, 1)) +
+                       cast<float>(in(v_x, v_y, 2)) +
+                       cast<float>(in(v_x, v_y, 3));
+
+    return result;
+}
+
+Func TileAlignGenerator::downsample(Func in, std::string name) {
+    Func result{name};
+
+    result(v_x, v_y) = 0.25f * (in(v_x*2,   v_y*2)   + in(v_x*2+1, v_y*2) +
+                                in(v_x*2,   v_y*2+1) + in(v_x*2+1, v_y*2+1));
+
+    return result;
+}
+
+Expr TileAlignGenerator::priorOffset(Func prior, int level, int i) {
+    // Largest offset that can be reached from the coarser levels, this keeps the search bounded
+    const int maxOffset = search_radius * ((1 << (levels - level)) - 2);
+
+    return clamp(prior(v_tx, v_ty)[i], -maxOffset, maxOffset);
+}
+
+Func TileAlignGenerator::distance(Func ref, Func alt, Func prior, int level, std::string name) {
+    const int T = tile_size;
+
+    Func result{name};
+    RDom r(0, T, 0, T);
+
+    Expr px = priorOffset(prior, level, 0);
+    Expr py = priorOffset(prior, level, 1);
+
+    Expr d = ref(v_tx*T + r.x, v_ty*T + r.y) - alt(v_tx*T + r.x + px + v_dx, v_ty*T + r.y + py + v_dy);
+
+    // L1 on the finest level is more robust to noise, L2 on the coarse levels
+    result(v_tx, v_ty, v_dx, v_dy) = sum(level == 0 ? abs(d) : d*d);
+
+    return result;
+}
+
+void TileAlignGenerator::generate() {
+    const int R = search_radius;
+
+    // Clamp to the bounds of the buffers so regions of the image can be aligned
+    Func refClamped = BoundaryConditions::repeat_edge(reference,
+        { {reference.dim(0).min(), reference.dim(0).extent()}, {reference.dim(1).min(), reference.dim(1).extent()}, {0, 4} } );
+
+    Func inputClamped = BoundaryConditions::repeat_edge(input,
+        { {input.dim(0).min(), input.dim(0).extent()}, {input.dim(1).min(), input.dim(1).extent()}, {0, 4} } );
+
+    std::vector<Func> refPyramid = { gray(refClamped, "refGray0") };
+    std::vector<Func> inputPyramid = { gray(inputClamped, "inputGray0") };
+
+    for(int level = 1; level < levels; level++) {
+        refPyramid.push_back(downsample(refPyramid[level - 1], "refGray" + std::to_string(level)));
+        inputPyramid.push_back(downsample(inputPyramid[level - 1], "inputGray" + std::to_string(level)));
+    }
+
+    //
+    // Coarse to fine search
+    //
+
+    RDom s(-R, 2*R + 1, -R, 2*R + 1);
+
+    std::vector<Func> alignFuncs;
+    std::vector<Func> distFuncs;
+
+    Func prior{"prior"};
+    prior(v_tx, v_ty) = { cast<int32_t>(0), cast<int32_t>(0) };
+
+    for(int level = levels - 1; level >= 0; level--) {
+        Func dist = distance(refPyramid[level], inputPyramid[level], prior, level, "dist" + std::to_string(level));
+        Func align{"align" + std::to_string(level)};
+
+        Tuple best = argmin(s, dist(v_tx, v_ty, s.x, s.y));
+
+        align(v_tx, v_ty) = { priorOffset(prior, level, 0) + cast<int32_t>(best[0]),
+                              priorOffset(prior, level, 1) + cast<int32_t>(best[1]) };
+
+        alignFuncs.push_back(align);
+        distFuncs.push_back(dist);
+
+        if(level > 0) {
+            Func upsampled{"prior" + std::to_string(level - 1)};
+
+            upsampled(v_tx, v_ty) = { align(v_tx / 2, v_ty / 2)[0] * 2, align(v_tx / 2, v_ty / 2)[1] * 2 };
+            prior = upsampled;
+        }
+    }
+
+    //
+    // Sub-pixel refinement by fitting a parabola to the distances around the best offset on the finest level
+    //
+
+    Func finest = alignFuncs.back();
+    Func refineDist = distance(refPyramid[0], inputPyramid[0], prior, 0, "refineDist");
+
+    Expr ox = finest(v_tx, v_ty)[0];
+    Expr oy = finest(v_tx, v_ty)[1];
+
+    Expr sx = ox - priorOffset(prior, 0, 0);
+    Expr sy = oy - priorOffset(prior, 0, 1);
+
+    // No refinement when the best offset is on the edge of the search area
+    Expr interior = abs(sx) < R && abs(sy) < R;
+
+    sx = clamp(sx, -R + 1, R - 1);
+    sy = clamp(sy, -R + 1, R - 1);
+
+    Expr d0  = refineDist(v_tx, v_ty, sx, sy);
+    Expr dx0 = refineDist(v_tx, v_ty, sx - 1, sy);
+    Expr dx1 = refineDist(v_tx, v_ty, sx + 1, sy);
+    Expr dy0 = refineDist(v_tx, v_ty, sx, sy - 1);
+    Expr dy1 = refineDist(v_tx, v_ty, sx, sy + 1);
+
+    Expr cx = dx0 - 2.0f*d0 + dx1;
+    Expr cy = dy0 - 2.0f*d0 + dy1;
+
+    Expr subX = select(interior && cx > 1e-5f, clamp((dx0 - dx1) / (2.0f*cx), -0.5f, 0.5f), 0.0f);
+    Expr subY = select(interior && cy > 1e-5f, clamp((dy0 - dy1) / (2.0f*cy), -0.5f, 0.5f), 0.0f);
+
+    output(v_tx, v_ty, v_c) = select(v_c == 0, cast<float>(ox) + subX, cast<float>(oy) + subY);
+
+    // Interleaved so the offsets can be used directly as a flow map by the fuse generators
+    output
+        .dim(0).set_stride(2)
+        .dim(2).set_stride(1)
+        .dim(2).set_bounds(0, 2);
+
+    reference.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+    input.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+    output.set_estimates({{0, 125}, {0, 94}, {0, 2}});
+
+    if(!auto_schedule) {
+        output
+            .compute_root()
+            .reorder(v_c, v_tx, v_ty)
+            .bound(v_c, 0, 2)
+            .unroll(v_c)
+            .parallel(v_ty);
+
+        refineDist
+            .compute_at(output, v_tx);
+
+        for(size_t i = 0; i < alignFuncs.size(); i++) {
+            alignFuncs[i]
+                .compute_root()
+                .parallel(v_ty);
+
+            distFuncs[i]
+                .compute_at(alignFuncs[i], v_tx);
+        }
+
+        for(size_t level = 0; level < refPyramid.size(); level++) {
+            refPyramid[level]
+                .compute_root()
+                .split(v_y, v_yo, v_yi, 16)
+                .vectorize(v_x, 8)
+                .parallel(v_yo);
+
+            inputPyramid[level]
+                .compute_root()
+                .split(v_y, v_yo, v_yi, 16)
+                .vectorize(v_x, 8)
+                .parallel(v_yo);
+        }
+    }
+}
+
 HALIDE_REGISTER_GENERATOR(DenoiseGenerator, denoise_generator)
 HALIDE_REGISTER_GENERATOR(ForwardTransformGenerator, forward_transform_generator)
 HALIDE_REGISTER_GENERATOR(FuseImageGenerator, fuse_image_generator)
 HALIDE_REGISTER_GENERATOR(InverseTransformGenerator, inverse_transform_generator)
+HALIDE_REGISTER_GENERATOR(NormalizeFuseGenerator, normalize_fuse_generator)
+HALIDE_REGISTER_GENERATOR(TileAlignGenerator, tile_align_generator)
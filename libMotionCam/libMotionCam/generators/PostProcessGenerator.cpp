@@ -18,6 +18,8 @@ using std::pair;
 class PostProcessBase {
 protected:
     void deinterleave(Func& result, Func in, Expr stride, Expr rawFormat, Expr width, Expr height);
+    void specializeRaw(Func f, Expr rawFormat);
+    void specializeRaw(Func f, Expr rawFormat, Expr sensorArrangement);
     void toRGGB(Func& result, Func in, Expr sensorArrangement);
     void toSensorPattern(Func& result, Func in, Expr sensorArrangement);
     void transform(Func& output, Func input, Func matrixSrgb);
@@ -210,6 +212,26 @@ Func PostProcessBase::deinterleaveRaw16(Func in, Expr stride) {
     return bayer;
 }
 
+//
+// Specializes a stage that reads the raw input on each raw format, and optionally each sensor arrangement, so the
+// unpacking and channel order selects are resolved at compile time. Call after the stage is scheduled, the
+// specializations copy its schedule. Other values run the generic code.
+//
+
+void PostProcessBase::specializeRaw(Func f, Expr rawFormat) {
+    for(auto format : { RawFormat::RAW10, RawFormat::RAW12, RawFormat::RAW16 })
+        f.specialize(rawFormat == static_cast<int>(format));
+}
+
+void PostProcessBase::specializeRaw(Func f, Expr rawFormat, Expr sensorArrangement) {
+    for(auto format : { RawFormat::RAW10, RawFormat::RAW12, RawFormat::RAW16 }) {
+        Stage formatStage = f.specialize(rawFormat == static_cast<int>(format));
+
+        for(auto arrangement : { SensorArrangement::RGGB, SensorArrangement::GRBG, SensorArrangement::GBRG, SensorArrangement::BGGR })
+            formatStage.specialize(sensorArrangement == static_cast<int>(arrangement));
+    }
+}
+
 void PostProcessBase::blur(Func& output, Func& outputTmp, Func input) {
     Func in32{"blur_in32"};
 
@@ -488,6 +510,12 @@ class GuidedFilter : public Halide::Generator<GuidedFilter> {
 public:
     GeneratorParam<int> radius{"radius", 51};
 
+    // Compute the box filters from running sums so the cost does not grow with the radius
+    GeneratorParam<bool> running_sum{"running_sum", false};
+
+    // Size of the output tiles in the CPU schedules
+    GeneratorParam<int> tile_size{"tile_size", 128};
+
     Input<Func> input{"input", 3};
     Input<Func> eps {"eps", 2};
 
@@ -516,11 +544,15 @@ public:
     Var subtile_idx{"subtile_idx"};
     Var tile_idx{"tile_idx"};
 
+    Var v_k{"k"};
+    Var v_t{"t"};
+
     void generate();
 
     void schedule();
     void schedule_for_cpu();
     void schedule_for_gpu();
+    void schedule_running_sum();
     void apply_auto_schedule();
 
     Func I{"I"}, I2{"I2"};
@@ -536,6 +568,17 @@ public:
 
 private:
     void boxFilter(Func& result, Func& intermediate, Func in);
+    void runningSumBoxFilter(Func& result, Func& intermediate, Func in);
+
+    // Window sum slid along a row or column of a span. The window is summed once at the start of the span.
+    struct RunningSum {
+        Func sum;
+        RDom window;
+        RDom slide;
+    };
+
+    vector<RunningSum> horizontalSums;
+    vector<RunningSum> verticalSums;
 };
 
 void GuidedFilter::apply_auto_schedule() {
@@ -545,6 +588,9 @@ void GuidedFilter::apply_auto_schedule() {
     using ::Halide::TailStrategy;
     using ::Halide::Var;
 
+    // Tiles were tuned at the default tile size of 128
+    const int T = tile_size;
+
     Var x = v_x;
     Var xi("xi");
     Var xii("xii");
@@ -552,8 +598,8 @@ void GuidedFilter::apply_auto_schedule() {
     Var y = v_y;
     Var yi("yi");
     output
-        .split(x, x, xi, 256, TailStrategy::ShiftInwards)
-        .split(y, y, yi, 384, TailStrategy::ShiftInwards)
+        .split(x, x, xi, 2*T, TailStrategy::ShiftInwards)
+        .split(y, y, yi, 3*T, TailStrategy::ShiftInwards)
         .split(xi, xi, xii, 32, TailStrategy::ShiftInwards)
         .split(xii, xii, xiii, 16, TailStrategy::ShiftInwards)
         .vectorize(xiii)
@@ -636,6 +682,11 @@ void GuidedFilter::apply_auto_schedule() {
 }
 
 void GuidedFilter::boxFilter(Func& result, Func& intermediate, Func in) {
+   if(running_sum && !get_target().has_gpu_feature()) {
+       runningSumBoxFilter(result, intermediate, in);
+       return;
+   }
+
    const int R = radius;
    RDom r(-R/2, R);
 
@@ -656,6 +707,39 @@ void GuidedFilter::boxFilter(Func& result, Func& intermediate, Func in) {
     // result(v_x, v_y) = t/R;
 }
 
+void GuidedFilter::runningSumBoxFilter(Func& result, Func& intermediate, Func in) {
+    const int R = radius;
+    const int lo = -R/2;
+
+    // Spans are as long as the output tiles so an aligned tile slides once along each row and column
+    const int N = tile_size;
+
+    // sum(k, t) is the sum of the R pixels starting at t*N + k + lo. Each step adds the pixel entering the
+    // window and removes the one leaving it, so the sums stay the size of the window and float is enough.
+    Func sum_x{intermediate.name() + "_sum"};
+    Func sum_y{result.name() + "_sum"};
+
+    RDom wx(lo, R);
+    RDom wy(lo, R);
+    RDom rx(1, N - 1);
+    RDom ry(1, N - 1);
+
+    sum_x(v_k, v_t, v_y) = 0.0f;
+    sum_x(0, v_t, v_y) += in(v_t*N + wx, v_y);
+    sum_x(rx, v_t, v_y) = sum_x(rx - 1, v_t, v_y) + in(v_t*N + rx + lo + R - 1, v_y) - in(v_t*N + rx + lo - 1, v_y);
+
+    intermediate(v_x, v_y) = sum_x(v_x % N, v_x / N, v_y) / R;
+
+    sum_y(v_x, v_k, v_t) = 0.0f;
+    sum_y(v_x, 0, v_t) += intermediate(v_x, v_t*N + wy);
+    sum_y(v_x, ry, v_t) = sum_y(v_x, ry - 1, v_t) + intermediate(v_x, v_t*N + ry + lo + R - 1) - intermediate(v_x, v_t*N + ry + lo - 1);
+
+    result(v_x, v_y) = sum_y(v_x, v_y % N, v_y / N) / R;
+
+    horizontalSums.push_back({sum_x, wx, rx});
+    verticalSums.push_back({sum_y, wy, ry});
+}
+
 void GuidedFilter::generate() {        
     I(v_x, v_y) = cast<float>(input(v_x, v_y, channel));
     I2(v_x, v_y) = I(v_x, v_y) * I(v_x, v_y);
@@ -676,6 +760,8 @@ void GuidedFilter::generate() {
     if(!auto_schedule) {
         if(get_target().has_gpu_feature())
             schedule_for_gpu();
+        else if(running_sum)
+            schedule_running_sum();
         else
             apply_auto_schedule();
     }
@@ -691,12 +777,14 @@ void GuidedFilter::schedule() {
 }
 
 void GuidedFilter::schedule_for_cpu() {
+   const int T = tile_size;
+
    output
         .compute_root()
         .reorder(v_x, v_y)
-        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
+        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, T, T)
         .fuse(v_xo, v_yo, tile_idx)
-        .tile(v_xi, v_yi, v_xio, v_yio, v_xii, v_yii, 64, 64)
+        .tile(v_xi, v_yi, v_xio, v_yio, v_xii, v_yii, T/2, T/2)
         .fuse(v_xio, v_yio, subtile_idx)
         .parallel(tile_idx)
         .vectorize(v_xii, 8);
@@ -757,6 +845,58 @@ void GuidedFilter::schedule_for_cpu() {
         .vectorize(v_x, 8);    
 }
 
+void GuidedFilter::schedule_running_sum() {
+    const int T = tile_size;
+
+    output
+        .compute_root()
+        .reorder(v_x, v_y)
+        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, T, T)
+        .fuse(v_xo, v_yo, tile_idx)
+        .parallel(tile_idx)
+        .vectorize(v_xi, 8);
+
+    for(Func f : { I, I2, var_I, a, b, mean_temp_I, mean_temp_II, mean_temp_a, mean_temp_b, mean_I, mean_II, mean_a, mean_b }) {
+        f
+            .compute_at(output, tile_idx)
+            .vectorize(v_x, 8);
+    }
+
+    // Horizontal sums run along the rows, so vectorize across them
+    for(auto& s : horizontalSums) {
+        s.sum
+            .compute_at(output, tile_idx)
+            .reorder_storage(v_y, v_k, v_t)
+            .vectorize(v_y, 8);
+
+        s.sum
+            .update(0)
+            .reorder(v_y, s.window.x, v_t)
+            .vectorize(v_y, 8);
+
+        s.sum
+            .update(1)
+            .reorder(v_y, s.slide.x, v_t)
+            .vectorize(v_y, 8);
+    }
+
+    for(auto& s : verticalSums) {
+        s.sum
+            .compute_at(output, tile_idx)
+            .vectorize(v_x, 8);
+
+        s.sum
+            .update(0)
+            .reorder(v_x, s.window.x, v_t)
+            .vectorize(v_x, 8);
+
+        s.sum
+            .update(1)
+            .reorder(v_x, s.slide.x, v_t)
+            .vectorize(v_x, 8);
+    }
+}
+
 void GuidedFilter::schedule_for_gpu() {
     output
         .compute_root()
@@ -813,6 +953,9 @@ void GuidedFilter::schedule_for_gpu() {
 
 class Demosaic : public Halide::Generator<Demosaic>, public PostProcessBase {
 public:
+    // Output one RGB pixel per bayer quad instead of demosaicing
+    GeneratorParam<bool> binned{"binned", false};
+
     Input<Func> in0{"in0", UInt(16), 2 };
     Input<Func> in1{"in1", UInt(16), 2 };
     Input<Func> in2{"in2", UInt(16), 2 };
@@ -1345,21 +1488,31 @@ void Demosaic::generate() {
     shaded(v_x, v_y, v_c) = cast<int16_t>(
         round(clamp(range * clamp(shadingMapArranged(v_x, v_y, v_c) * rggb(v_x, v_y, v_c) / range, 0.0f, asShotFunc(v_c)), 0, range)));
     
-    // Combined image
-    combinedInput(v_x, v_y) =
-        select(v_y % 2 == 0,
-               select(v_x % 2 == 0, shaded(v_x/2, v_y/2, 0), shaded(v_x/2, v_y/2, 1)),
-               select(v_x % 2 == 0, shaded(v_x/2, v_y/2, 2), shaded(v_x/2, v_y/2, 3)));
+    if(binned) {
+        // Channels are in RGGB order, average the two greens
+        demosaicOutput(v_x, v_y, v_c) = saturating_cast<uint16_t>(
+            select( v_c == 0, shaded(v_x, v_y, 0),
+                    v_c == 1, (cast<int32_t>(shaded(v_x, v_y, 1)) + cast<int32_t>(shaded(v_x, v_y, 2)) + 1) / 2,
+                              shaded(v_x, v_y, 3))
+        );
+    }
+    else {
+        // Combined image
+        combinedInput(v_x, v_y) =
+            select(v_y % 2 == 0,
+                   select(v_x % 2 == 0, shaded(v_x/2, v_y/2, 0), shaded(v_x/2, v_y/2, 1)),
+                   select(v_x % 2 == 0, shaded(v_x/2, v_y/2, 2), shaded(v_x/2, v_y/2, 3)));
 
-    calculateGreen(green, combinedInput);
-    calculateRed(red, combinedInput, green);
-    calculateBlue(blue, combinedInput, green);
+        calculateGreen(green, combinedInput);
+        calculateRed(red, combinedInput, green);
+        calculateBlue(blue, combinedInput, green);
 
-    demosaicOutput(v_x, v_y, v_c) = saturating_cast<uint16_t>(
-        select( v_c == 0, red(v_x, v_y),
-                v_c == 1, green(v_x, v_y),
-                          blue(v_x, v_y))
-    );
+        demosaicOutput(v_x, v_y, v_c) = saturating_cast<uint16_t>(
+            select( v_c == 0, red(v_x, v_y),
+                    v_c == 1, green(v_x, v_y),
+                              blue(v_x, v_y))
+        );
+    }
 
     // Transform to sRGB space
     linear(v_x, v_y, v_c) =  demosaicOutput(v_x, v_y, v_c) / cast<float>(range);
@@ -1400,6 +1553,21 @@ void Demosaic::generate() {
 }
 
 void Demosaic::schedule() {
+    if(binned) {
+        shadingMapArranged
+            .compute_at(output, v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+
+        output.compute_root()
+            .parallel(v_y)
+            .bound(v_c, 0, 3)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+
+        return;
+    }
+
     red
         .compute_root()
         .parallel(v_y)
@@ -1451,8 +1619,17 @@ public:
     GeneratorParam<int> tonemap_levels {"tonemap_levels", 9};
     GeneratorParam<Type> output_type{"output_type", UInt(16)};
 
+    // When set, the levels from coarse_level up are not built from the input. Their reconstruction is read
+    // from coarseInput instead, so tiles of an image share the same coarse levels.
+    GeneratorParam<int> coarse_level {"coarse_level", 0};
+
+    // When set, outputs the reconstruction at this level before the inverse gamma. Used to compute the
+    // coarse input of another pipeline.
+    GeneratorParam<int> output_level {"output_level", 0};
+
     Input<Func> input0{"input0", 3 };
     Input<Func> input1{"input1", 3 };
+    Input<Func> coarseInput{"coarseInput", 3 };
 
     Output<Func> output{ "output", 3 };
 
@@ -1645,12 +1822,15 @@ void TonemapGenerator::generate() {
             .vectorize(v_x, 8);
     }
 
+    // Levels built from the input
+    const int levels = coarse_level > 0 ? static_cast<int>(coarse_level) : static_cast<int>(tonemap_levels);
+
     // Create pyramid input
-    tonemapPyramid = buildPyramid(exposures, UInt(16), tonemap_levels);
-    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), tonemap_levels);
+    tonemapPyramid = buildPyramid(exposures, UInt(16), levels);
+    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), levels);
 
     if(!auto_schedule) {
-        for(int level = 0; level < tonemap_levels; level++) {
+        for(int level = 0; level < levels; level++) {
 
             if(level == 0) {
                 tonemapPyramid[0].second.in(tonemapPyramid[1].first)
@@ -1693,7 +1873,7 @@ void TonemapGenerator::generate() {
 
     vector<Func> laplacianPyramid, combinedPyramid;
     
-    for(int level = 0; level < tonemap_levels; level++) {
+    for(int level = 0; level < levels; level++) {
         Func up("laplacianUpLvl" + std::to_string(level));
         Func upIntermediate("laplacianUpIntermediateLvl" + std::to_string(level));
         Func laplacian("laplacianLvl" + std::to_string(level));
@@ -1721,13 +1901,13 @@ void TonemapGenerator::generate() {
         laplacianPyramid.push_back(laplacian);
     }
 
-    laplacianPyramid.push_back(tonemapPyramid[tonemap_levels].second);
+    laplacianPyramid.push_back(tonemapPyramid[levels].second);
 
     //
     // Combine pyramids
     //
 
-    for(int level = 0; level <= tonemap_levels; level++) {
+    for(int level = 0; level <= levels; level++) {
         Func result("resultLvl" + std::to_string(level));
 
         result(v_x, v_y, v_c) = cast<int32_t>(0.5f + 
@@ -1744,13 +1924,17 @@ void TonemapGenerator::generate() {
     
     vector<Func> outputPyramid;
 
-    for(int level = tonemap_levels; level > 0; level--) {
+    for(int level = levels; level > output_level; level--) {
         Func up("outputUpLvl" + std::to_string(level));
         Func upIntermediate("outputUpIntermediateLvl" + std::to_string(level));
         Func outputLvl("outputLvl" + std::to_string(level));
 
-        if(level == tonemap_levels) {
-            pyramidUp(up, Int(32), upIntermediate, combinedPyramid[level]);
+        if(level == levels) {
+            // The coarse input replaces the reconstruction of the top level
+            if(coarse_level > 0)
+                pyramidUp(up, Int(32), upIntermediate, coarseInput);
+            else
+                pyramidUp(up, Int(32), upIntermediate, combinedPyramid[level]);
         }
         else {
             pyramidUp(up, Int(32), upIntermediate, outputPyramid[outputPyramid.size() - 1]);
@@ -1780,7 +1964,10 @@ void TonemapGenerator::generate() {
     }
 
     // Inverse gamma correct tonemapped result
-    output(v_x, v_y, v_c) = inverseGammaLut(cast(output_type, clamp(outputPyramid[tonemap_levels - 1](v_x, v_y, v_c), 0, type_max)));
+    if(output_level > 0)
+        output(v_x, v_y, v_c) = outputPyramid.back()(v_x, v_y, v_c);
+    else
+        output(v_x, v_y, v_c) = inverseGammaLut(cast(output_type, clamp(outputPyramid.back()(v_x, v_y, v_c), 0, type_max)));
 
     if(!auto_schedule) {
         output
@@ -1798,6 +1985,8 @@ void TonemapGenerator::generate() {
 
     input0.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
     input1.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    if(coarse_level > 0)
+        coarseInput.set_estimates({{0, 4096 >> levels}, {0, 3072 >> levels}, {0, 3}});
     output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
 }
 
@@ -1816,6 +2005,12 @@ public:
     GeneratorParam<bool> denoiseChroma{"denoiseChroma", true};
     GeneratorParam<bool> enableSharpen{"enableSharpen", true};
 
+    // Size of the output tiles in the CPU schedule
+    GeneratorParam<int> tileSize{"tileSize", 128};
+
+    // Compute the large guided filters from running sums. Off until they are compared with the direct sums.
+    GeneratorParam<bool> runningSum{"runningSum", false};
+
     Input<int> width{"width"};
     Input<int> height{"height"};
 
@@ -1945,10 +2140,12 @@ void EnhanceGenerator::generate() {
         auto gf1 = create<GuidedFilter>();
 
         gf0->radius.set(15);
+        gf0->tile_size.set(tileSize);
         gf0->output_type.set(UInt(16));
         gf0->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
         gf1->radius.set(15);
+        gf1->tile_size.set(tileSize);
         gf1->output_type.set(UInt(16));
         gf1->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(2));
 
@@ -1960,10 +2157,12 @@ void EnhanceGenerator::generate() {
         secondPass(v_x, v_y, v_c) = select(v_c == 0, gf0->output(v_x, v_y), gf1->output(v_x, v_y));
 
         gf2->radius.set(15);
+        gf2->tile_size.set(tileSize);
         gf2->output_type.set(UInt(16));
         gf2->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
         gf3->radius.set(15);
+        gf3->tile_size.set(tileSize);
         gf3->output_type.set(UInt(16));
         gf3->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
@@ -1974,11 +2173,16 @@ void EnhanceGenerator::generate() {
 
         thirdPass(v_x, v_y, v_c) = select(v_c == 0, gf2->output(v_x, v_y), gf3->output(v_x, v_y));
 
+        // Running sums pay off at the larger radii
         gf4->radius.set(25);
+        gf4->running_sum.set(runningSum);
+        gf4->tile_size.set(tileSize);
         gf4->output_type.set(UInt(16));
         gf4->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
         gf5->radius.set(25);
+        gf5->running_sum.set(runningSum);
+        gf5->tile_size.set(tileSize);
         gf5->output_type.set(UInt(16));
         gf5->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
@@ -2018,6 +2222,8 @@ void EnhanceGenerator::generate() {
         eps(v_x, v_y) = 0.2f*0.2f*65535.0f*65535.0f;
 
         gf->radius.set(popRadius);
+        gf->running_sum.set(runningSum);
+        gf->tile_size.set(tileSize);
         gf->output_type.set(UInt(16));
         gf->apply(downsampled, eps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
@@ -2102,10 +2308,12 @@ void EnhanceGenerator::schedule_for_cpu() {
             .compute_at(sharpened, tile_idx)
             .vectorize(v_x, 8);
 
+        const int T = tileSize;
+
         sharpened
             .compute_root()
             .reorder(v_x, v_y)
-            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
+            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, T, T)
             .fuse(v_xo, v_yo, tile_idx)
             .parallel(tile_idx)
             .vectorize(v_xi, 8);
@@ -2116,7 +2324,7 @@ void EnhanceGenerator::schedule_for_cpu() {
 
         downsampled
             .compute_root()
-            .split(v_y, v_yo, v_yi, 64)
+            .split(v_y, v_yo, v_yi, T/2)
             .vectorize(v_x, 8)
             .parallel(v_yo);
 
@@ -2160,6 +2368,22 @@ void EnhanceGenerator::schedule_for_cpu() {
 
 class PostProcessGenerator : public Halide::Generator<PostProcessGenerator>, public PostProcessBase {
 public:
+    // Output half the width and height of the bayer image without demosaicing
+    GeneratorParam<bool> binned{"binned", false};
+
+    // Size of the tiles in the CPU schedule and the expected output size. Variants are built for different
+    // resolution classes and selected at runtime.
+    GeneratorParam<int> tile_size{"tile_size", 128};
+    GeneratorParam<int> output_width{"output_width", 4096};
+    GeneratorParam<int> output_height{"output_height", 3072};
+
+    // Compute the large guided filters from running sums. tune.sh compares both against each other.
+    GeneratorParam<bool> running_sum{"running_sum", false};
+
+    // Read the coarse tonemap levels from coarseTonemap instead of building them, so tiles of an image share them.
+    // coarseTonemap is not used otherwise.
+    GeneratorParam<bool> coarse_tonemap{"coarse_tonemap", false};
+
     Input<Buffer<uint16_t>> in0{"in0", 2 };
     Input<Buffer<uint16_t>> in1{"in1", 2 };
     Input<Buffer<uint16_t>> in2{"in2", 2 };
@@ -2169,6 +2393,9 @@ public:
     Input<Buffer<uint16_t>> hdrInput{"hdrInput", 3 };
     Input<Buffer<uint8_t>> hdrMask{"hdrMask", 2 };
 
+    // Output of postprocess_coarse, in the coordinates of this call
+    Input<Buffer<uint16_t>> coarseTonemap{"coarseTonemap", 3 };
+
     Input<bool> useHdr{"useHdr"};
 
     Input<float[3]> asShotVector{"asShotVector"};
@@ -2243,6 +2470,9 @@ void PostProcessGenerator::generate()
     Expr WIDTH = in0.width();
     Expr HEIGHT = in0.height();
 
+    // Size of the output relative to the bayer channels
+    const int outputScale = binned ? 1 : 2;
+
     // Demosaic image
     Func inClamped0 = BoundaryConditions::repeat_edge(in0);
     Func inClamped1 = BoundaryConditions::repeat_edge(in1);
@@ -2250,6 +2480,7 @@ void PostProcessGenerator::generate()
     Func inClamped3 = BoundaryConditions::repeat_edge(in3);
 
     demosaic = create<Demosaic>();
+    demosaic->binned.set(binned);
     demosaic->apply(
         inClamped0, inClamped1, inClamped2, inClamped3,
         inShadingMap0, inShadingMap1, inShadingMap2, inShadingMap3,
@@ -2291,11 +2522,17 @@ void PostProcessGenerator::generate()
     // Tonemap
     //
 
+    // The coarse levels come from the whole image so tiles of the same image match
+    Func coarseTonemapInput = BoundaryConditions::repeat_edge(coarseTonemap);
+
     tonemap = create<TonemapGenerator>();
 
     tonemap->output_type.set(UInt(16));
     tonemap->tonemap_levels.set(TONEMAP_LEVELS);
-    tonemap->apply(tonemapInput, hdrTonemapInput, WIDTH * 2, HEIGHT * 2, tonemapVariance, shadows);
+    if(coarse_tonemap)
+        tonemap->coarse_level.set(COARSE_TONEMAP_LEVEL + (binned ? 0 : 1));
+
+    tonemap->apply(tonemapInput, hdrTonemapInput, coarseTonemapInput, WIDTH * outputScale, HEIGHT * outputScale, tonemapVariance, shadows);
 
     // defringeVertical.define_extern("extern_defringe", { (Func) tonemap->output, WIDTH*2, HEIGHT*2 }, UInt(16), 3);
     // defringeVertical.compute_root();
@@ -2313,12 +2550,14 @@ void PostProcessGenerator::generate()
     enhance->denoiseChroma.set(true);
     enhance->enableSharpen.set(true);
     enhance->popRadius.set(25);
+    enhance->tileSize.set(tile_size);
+    enhance->runningSum.set(running_sum);
 
     enhance->apply(
         tonemap->output,
         chromaEps,
-        WIDTH*2,
-        HEIGHT*2,
+        WIDTH*outputScale,
+        HEIGHT*outputScale,
         blackPoint,
         whitePoint,
         contrast,
@@ -2370,13 +2609,29 @@ void PostProcessGenerator::generate()
     sharpen1.set_estimate(2.0f);
     chromaEps0.set_estimate(0.01f);
     chromaEps1.set_estimate(0.01f);
+    chromaEps3.set_estimate(0.01f);
+    useHdr.set_estimate(false);
+    hdrInputGain.set_estimate(1.0f);
+    hdrScale.set_estimate(1.0f);
+    brightness.set_estimate(1.0f);
+    pop.set_estimate(1.0f);
     
     cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
 
-    in0.set_estimates({{0, 2048}, {0, 1536}});
-    in1.set_estimates({{0, 2048}, {0, 1536}});
-    in2.set_estimates({{0, 2048}, {0, 1536}});
-    in3.set_estimates({{0, 2048}, {0, 1536}});
+    const int outputWidth = output_width;
+    const int outputHeight = output_height;
+    const int inputWidth = outputWidth / outputScale;
+    const int inputHeight = outputHeight / outputScale;
+
+    in0.set_estimates({{0, inputWidth}, {0, inputHeight}});
+    in1.set_estimates({{0, inputWidth}, {0, inputHeight}});
+    in2.set_estimates({{0, inputWidth}, {0, inputHeight}});
+    in3.set_estimates({{0, inputWidth}, {0, inputHeight}});
+
+    blueNoise.set_estimates({{0, 256}, {0, 256}, {0, 4}});
+    hdrInput.set_estimates({{0, outputWidth}, {0, outputHeight}, {0, 3}});
+    hdrMask.set_estimates({{0, outputWidth}, {0, outputHeight}});
+    coarseTonemap.set_estimates({{0, inputWidth >> COARSE_TONEMAP_LEVEL}, {0, inputHeight >> COARSE_TONEMAP_LEVEL}, {0, 3}});
 
     inShadingMap0.set_estimates({{0, 17}, {0, 13}});
     inShadingMap1.set_estimates({{0, 17}, {0, 13}});
@@ -2387,7 +2642,7 @@ void PostProcessGenerator::generate()
     asShotVector.set_estimate(1, 1.0f);
     asShotVector.set_estimate(2, 1.0f);
 
-    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    output.set_estimates({{0, outputWidth}, {0, outputHeight}, {0, 3}});
 
     if(!auto_schedule) {
         if(get_target().has_gpu_feature())
@@ -2451,16 +2706,205 @@ void PostProcessGenerator::schedule_for_cpu() {
             .unroll(v_c)
             .vectorize(v_x, vector_size_u16);
 
+    const int T = tile_size;
+
     output
         .compute_root()
         .bound(v_c, 0, 3)
         .reorder(v_c, v_x, v_y)
-        .split(v_y, v_yo, v_yi, 64)
+        .split(v_y, v_yo, v_yi, T/2)
         .parallel(v_yo)
         .unroll(v_c)
         .vectorize(v_x, vector_size_u8);
 }
 
+//
+// Computes the coarse tonemap levels of the post process once per image. The bayer channels are downscaled and
+// tonemapped with the levels of the full resolution pipeline above COARSE_TONEMAP_INPUT_LEVEL, the output is the
+// reconstruction at COARSE_TONEMAP_LEVEL used as the coarseTonemap input of postprocess.
+//
+
+class PostProcessCoarseGenerator : public Halide::Generator<PostProcessCoarseGenerator>, public PostProcessBase {
+public:
+    Input<Buffer<uint16_t>> in0{"in0", 2 };
+    Input<Buffer<uint16_t>> in1{"in1", 2 };
+    Input<Buffer<uint16_t>> in2{"in2", 2 };
+    Input<Buffer<uint16_t>> in3{"in3", 2 };
+
+    // Full resolution, same as the postprocess inputs
+    Input<Buffer<uint16_t>> hdrInput{"hdrInput", 3 };
+    Input<Buffer<uint8_t>> hdrMask{"hdrMask", 2 };
+
+    Input<bool> useHdr{"useHdr"};
+
+    Input<float[3]> asShotVector{"asShotVector"};
+
+    Input<Buffer<float>> cameraToSrgb{"cameraToSrgb", 2};
+
+    Input<Buffer<float>> inShadingMap0{"inShadingMap0", 2 };
+    Input<Buffer<float>> inShadingMap1{"inShadingMap1", 2 };
+    Input<Buffer<float>> inShadingMap2{"inShadingMap2", 2 };
+    Input<Buffer<float>> inShadingMap3{"inShadingMap3", 2 };
+
+    Input<uint16_t> range{"range"};
+    Input<int> sensorArrangement{"sensorArrangement"};
+
+    Input<float> shadows{"shadows"};
+    Input<float> hdrInputGain{"hdrInputGain"};
+    Input<float> hdrScale{"hdrScale"};
+    Input<float> tonemapVariance{"tonemapVariance"};
+    Input<float> exposure{"exposure"};
+
+    Output<Buffer<uint16_t>> output{"output", 3};
+
+    Func downscaled0{"downscaled0"}, downscaled1{"downscaled1"}, downscaled2{"downscaled2"}, downscaled3{"downscaled3"};
+    Func hdrInputDownscaled{"hdrInputDownscaled"};
+    Func hdrMaskDownscaled{"hdrMaskDownscaled"};
+    Func tonemapInput{"tonemapInput"};
+    Func hdrTonemapInput{"hdrTonemapInput"};
+
+    std::unique_ptr<Demosaic> demosaic;
+    std::unique_ptr<TonemapGenerator> tonemap;
+
+    void generate();
+
+private:
+    void boxDownscale(Func& output, Func input, int factor);
+};
+
+void PostProcessCoarseGenerator::boxDownscale(Func& output, Func input, int factor) {
+    using Halide::_;
+
+    RDom r(0, factor, 0, factor);
+
+    output(v_x, v_y, _) = cast(input.value().type(),
+        sum(cast<uint32_t>(input(v_x*factor + r.x, v_y*factor + r.y, _))) / (factor*factor));
+}
+
+void PostProcessCoarseGenerator::generate() {
+    std::vector<Expr> asShot{ asShotVector[0], asShotVector[1], asShotVector[2] };
+
+    const int factor = 1 << COARSE_TONEMAP_INPUT_LEVEL;
+
+    Expr WIDTH = in0.width() / factor;
+    Expr HEIGHT = in0.height() / factor;
+
+    boxDownscale(downscaled0, BoundaryConditions::repeat_edge(in0), factor);
+    boxDownscale(downscaled1, BoundaryConditions::repeat_edge(in1), factor);
+    boxDownscale(downscaled2, BoundaryConditions::repeat_edge(in2), factor);
+    boxDownscale(downscaled3, BoundaryConditions::repeat_edge(in3), factor);
+
+    // One pixel per bayer quad, the HDR inputs are twice the size of the bayer channels
+    demosaic = create<Demosaic>();
+    demosaic->binned.set(true);
+    demosaic->apply(
+        downscaled0, downscaled1, downscaled2, downscaled3,
+        inShadingMap0, inShadingMap1, inShadingMap2, inShadingMap3,
+        WIDTH, HEIGHT,
+        inShadingMap0.width(), inShadingMap0.height(),
+        cast<float>(range),
+        sensorArrangement,
+        asShot,
+        cameraToSrgb);
+
+    boxDownscale(hdrInputDownscaled, BoundaryConditions::repeat_edge(hdrInput), 2*factor);
+    boxDownscale(hdrMaskDownscaled, BoundaryConditions::repeat_edge(hdrMask), 2*factor);
+
+    // Same as the postprocess generator
+    tonemapInput(v_x, v_y, v_c) = saturating_cast<uint16_t>(0.5f + pow(2.0f, exposure) * demosaic->output(v_x, v_y, v_c));
+
+    Expr base = demosaic->output(v_x, v_y, v_c) / 65535.0f;
+    Expr mask = hdrMaskDownscaled(v_x, v_y) / 255.0f;
+    Expr highlights = mask*hdrInputDownscaled(v_x, v_y, v_c)/65535.0f + (1.0f - mask)*hdrScale*base;
+
+    hdrTonemapInput(v_x, v_y, v_c) = select(useHdr,
+        saturating_cast<uint16_t>(hdrInputGain * highlights * 65535.0f),
+        tonemapInput(v_x, v_y, v_c));
+
+    // The downscaled image is level COARSE_TONEMAP_INPUT_LEVEL + 1 of the postprocess tonemap pyramid
+    const int levelOffset = COARSE_TONEMAP_INPUT_LEVEL + 1;
+
+    tonemap = create<TonemapGenerator>();
+
+    tonemap->output_type.set(UInt(16));
+    tonemap->tonemap_levels.set(TONEMAP_LEVELS - levelOffset);
+    tonemap->output_level.set(COARSE_TONEMAP_LEVEL + 1 - levelOffset);
+    tonemap->apply(tonemapInput, hdrTonemapInput, tonemapInput, WIDTH, HEIGHT, tonemapVariance, shadows);
+
+    output(v_x, v_y, v_c) = tonemap->output(v_x, v_y, v_c);
+
+    range.set_estimate(16384);
+    sensorArrangement.set_estimate(0);
+    shadows.set_estimate(2.0f);
+    tonemapVariance.set_estimate(0.25f);
+    exposure.set_estimate(0.0f);
+    useHdr.set_estimate(false);
+    hdrInputGain.set_estimate(1.0f);
+    hdrScale.set_estimate(1.0f);
+
+    cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
+
+    in0.set_estimates({{0, 2048}, {0, 1536}});
+    in1.set_estimates({{0, 2048}, {0, 1536}});
+    in2.set_estimates({{0, 2048}, {0, 1536}});
+    in3.set_estimates({{0, 2048}, {0, 1536}});
+
+    hdrInput.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    hdrMask.set_estimates({{0, 4096}, {0, 3072}});
+
+    inShadingMap0.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap1.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap2.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap3.set_estimates({{0, 17}, {0, 13}});
+
+    asShotVector.set_estimate(0, 1.0f);
+    asShotVector.set_estimate(1, 1.0f);
+    asShotVector.set_estimate(2, 1.0f);
+
+    output.set_estimates({{0, 2048 >> COARSE_TONEMAP_LEVEL}, {0, 1536 >> COARSE_TONEMAP_LEVEL}, {0, 3}});
+
+    if(!auto_schedule) {
+        downscaled0.compute_root().vectorize(v_x, 8).parallel(v_y);
+        downscaled1.compute_root().vectorize(v_x, 8).parallel(v_y);
+        downscaled2.compute_root().vectorize(v_x, 8).parallel(v_y);
+        downscaled3.compute_root().vectorize(v_x, 8).parallel(v_y);
+
+        hdrInputDownscaled
+            .compute_root()
+            .vectorize(v_x, 8)
+            .parallel(v_y);
+
+        hdrMaskDownscaled
+            .compute_root()
+            .vectorize(v_x, 8)
+            .parallel(v_y);
+
+        tonemapInput
+            .compute_root()
+            .bound(v_c, 0, 3)
+            .reorder(v_c, v_x, v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8)
+            .parallel(v_y);
+
+        hdrTonemapInput
+            .compute_root()
+            .bound(v_c, 0, 3)
+            .reorder(v_c, v_x, v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8)
+            .parallel(v_y);
+
+        output
+            .compute_root()
+            .bound(v_c, 0, 3)
+            .reorder(v_c, v_x, v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8)
+            .parallel(v_y);
+    }
+}
+
 //
 
 class PreviewGenerator : public Halide::Generator<PreviewGenerator>, public PostProcessBase {
@@ -2608,11 +3052,14 @@ void PreviewGenerator::generate() {
         .parallel(v_y)
         .vectorize(v_x, 4);
 
+    specializeRaw(tonemapInput, pixelFormat, sensorArrangement);
+
     tonemap = create<TonemapGenerator>();
 
     tonemap->output_type.set(UInt(16));
     tonemap->tonemap_levels.set(tonemapLevels);
-    tonemap->apply(tonemapInput, tonemapInput, width, height, tonemapVariance, shadows);
+    // All levels are built from the input, the coarse input is not used
+    tonemap->apply(tonemapInput, tonemapInput, tonemapInput, width, height, tonemapVariance, shadows);
 
     enhance = create<EnhanceGenerator>();
     
@@ -2817,6 +3264,8 @@ void FastPreviewGenerator::generate() {
             .bound(v_c, 0, 4)
             .unroll(v_c)
             .parallel(v_y);
+
+        specializeRaw(output, pixelFormat, sensorArrangement);
     }
 }
 
@@ -3012,6 +3461,9 @@ void DeinterleaveRawGenerator::schedule_for_cpu(::Halide::Pipeline pipeline, ::H
             .split(x, x_vo, x_vi, 8)
             .vectorize(x_vi)
             .parallel(y);
+
+        // Unpacks the raw data, only depends on the raw format
+        specializeRaw(bayer_1, pixelFormat);
     }
     {
         Var i = gammaLut.args()[0];
@@ -3536,6 +3988,9 @@ void MeasureNoiseGenerator::generate() {
             .unroll(v_c)
             .parallel(v_y);
 
+        // The sensor arrangement is not used, noise is measured per channel
+        specializeRaw(mean, pixelFormat);
+
         output
             .compute_root()
             .bound(v_c, 0, 4)
@@ -3544,6 +3999,8 @@ void MeasureNoiseGenerator::generate() {
             .unroll(v_c)
             .parallel(v_y);
 
+        specializeRaw(output, pixelFormat);
+
         snr
             .compute_root()
             .bound(v_c, 0, 4)
@@ -3693,6 +4150,8 @@ void StatsGenerator::schedule_for_cpu(::Halide::Pipeline pipeline, ::Halide::Tar
             .split(x, x_vo, x_vi, 8)
             .vectorize(x_vi)
             .parallel(y);
+
+        specializeRaw(maxChannel, pixelFormat);
     }
     {
         Var x = minChannel.args()[0];
@@ -3702,6 +4161,8 @@ void StatsGenerator::schedule_for_cpu(::Halide::Pipeline pipeline, ::Halide::Tar
             .split(x, x_vo, x_vi, 4)
             .vectorize(x_vi)
             .parallel(y);
+
+        specializeRaw(minChannel, pixelFormat);
     }
     {
         Var x = whiteLevelClipping.args()[0];
@@ -3852,6 +4313,7 @@ HALIDE_REGISTER_GENERATOR(MeasureImageGenerator, measure_image_generator)
 HALIDE_REGISTER_GENERATOR(MeasureNoiseGenerator, measure_noise_generator)
 HALIDE_REGISTER_GENERATOR(DeinterleaveRawGenerator, deinterleave_raw_generator)
 HALIDE_REGISTER_GENERATOR(PostProcessGenerator, postprocess_generator)
+HALIDE_REGISTER_GENERATOR(PostProcessCoarseGenerator, postprocess_coarse_generator)
 HALIDE_REGISTER_GENERATOR(FastPreviewGenerator, fast_preview_generator)
 HALIDE_REGISTER_GENERATOR(FastPreviewGenerator2, fast_preview_generator2)
 HALIDE_REGISTER_GENERATOR(GuidedFilter, guided_filter_generator)
@@ -23,107 +23,182 @@ mkdir -p tmp
 
 g++ DenoiseGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/denoise_generator
 g++ PostProcessGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/postprocess_generator
+g++ CameraPreviewGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/camera_preview_generator
+
+# Appends the flags to each target of a comma separated multi-target list
+function with_flags() {
+	local RESULT=""
+	local TARGETS
+	IFS=',' read -ra TARGETS <<< "$1"
+
+	for T in "${TARGETS[@]}"; do
+		RESULT="${RESULT:+${RESULT},}${T}-$2"
+	done
+
+	echo "${RESULT}"
+}
 
 function build_denoise() {
-	TARGET=$1
+	TARGET=$(with_flags $1 no_runtime)
 	ARCH=$2
-	FLAGS="no_runtime"
 
 	echo "[$ARCH] Building denoise_generator_3x3"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_3x3 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=3
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_3x3 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=3
 
 	echo "[$ARCH] Building denoise_generator_5x5"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=5
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=5
 
 	echo "[$ARCH] Building denoise_generator_7x7"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=7
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=7
 
 	echo "[$ARCH] Building forward_transform_generator"
-	./tmp/denoise_generator -g forward_transform_generator -f forward_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 levels=4
+	./tmp/denoise_generator -g forward_transform_generator -f forward_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET} input.type=uint16 levels=4
 
 	echo "[$ARCH] Building fuse_image_generator"
-	./tmp/denoise_generator -g fuse_image_generator -f fuse_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 reference.size=4 reference.type=float32 intermediate.size=4 intermediate.type=float32
+	./tmp/denoise_generator -g fuse_image_generator -f fuse_image -e static_library,h -o ../halide/${ARCH} target=${TARGET} input.type=uint16 reference.size=4 reference.type=float32 intermediate.size=4 intermediate.type=float32
 
 	echo "[$ARCH] Building inverse_transform_generator"
-	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.size=4
+	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET} input.size=4
+
+	echo "[$ARCH] Building normalize_fuse_generator"
+	./tmp/denoise_generator -g normalize_fuse_generator -f normalize_fuse -e static_library,h -o ../halide/${ARCH} target=${TARGET}
+
+	echo "[$ARCH] Building denoise_generator_tiles_3x3"
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_tiles_3x3 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=3 flow_tile_size=16
+
+	echo "[$ARCH] Building denoise_generator_tiles_5x5"
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_tiles_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=5 flow_tile_size=16
+
+	echo "[$ARCH] Building denoise_generator_tiles_7x7"
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_tiles_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGET} window=7 flow_tile_size=16
+
+	echo "[$ARCH] Building tile_align_generator"
+	./tmp/denoise_generator -g tile_align_generator -f tile_align -e static_library,h -o ../halide/${ARCH} target=${TARGET} tile_size=16 search_radius=4 levels=3
 }
 
 function build_postprocess() {
-	TARGET=$1
+	TARGET=$(with_flags $1 no_runtime)
 	ARCH=$2
-	FLAGS="no_runtime"
 
 	echo "[$ARCH] Building stats_generator"
-	./tmp/postprocess_generator -g stats_generator -f generate_stats -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g stats_generator -f generate_stats -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building measure_noise_generator"
-	./tmp/postprocess_generator -g measure_noise_generator -f measure_noise -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g measure_noise_generator -f measure_noise -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building build_bayer_generator"
-	./tmp/postprocess_generator -g build_bayer_generator -f build_bayer -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g build_bayer_generator -f build_bayer -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building build_bayer_generator2"
-	./tmp/postprocess_generator -g build_bayer_generator2 -f build_bayer2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g build_bayer_generator2 -f build_bayer2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building hdr_mask_generator"
-	./tmp/postprocess_generator -g hdr_mask_generator -f hdr_mask -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g hdr_mask_generator -f hdr_mask -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building linear_image_generator"
-	./tmp/postprocess_generator -g linear_image_generator -f linear_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g linear_image_generator -f linear_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building measure_image_generator"
-	./tmp/postprocess_generator -g measure_image_generator -f measure_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g measure_image_generator -f measure_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building generate_edges_generator"
-	./tmp/postprocess_generator -g generate_edges_generator -f generate_edges -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g generate_edges_generator -f generate_edges -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building deinterleave_raw_generator"
-	./tmp/postprocess_generator -g deinterleave_raw_generator -f deinterleave_raw -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g deinterleave_raw_generator -f deinterleave_raw -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building postprocess_generator"
-	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${TARGET}
+
+	echo "[$ARCH] Building postprocess_binned"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_binned -e static_library,h -o ../halide/${ARCH} target=${TARGET} binned=true
+
+	echo "[$ARCH] Building postprocess_large"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_large -e static_library,h -o ../halide/${ARCH} target=${TARGET} tile_size=64 output_width=8192 output_height=6144
+
+	echo "[$ARCH] Building postprocess_tiles"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_tiles -e static_library,h -o ../halide/${ARCH} target=${TARGET} coarse_tonemap=true
+
+	echo "[$ARCH] Building postprocess_binned_tiles"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_binned_tiles -e static_library,h -o ../halide/${ARCH} target=${TARGET} binned=true coarse_tonemap=true
+
+	echo "[$ARCH] Building postprocess_large_tiles"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_large_tiles -e static_library,h -o ../halide/${ARCH} target=${TARGET} tile_size=64 output_width=8192 output_height=6144 coarse_tonemap=true
+
+	echo "[$ARCH] Building postprocess_coarse"
+	./tmp/postprocess_generator -g postprocess_coarse_generator -f postprocess_coarse -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building fast_preview_generator"
-	./tmp/postprocess_generator -g fast_preview_generator -f fast_preview -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g fast_preview_generator -f fast_preview -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building fast_preview_generator2"
-	./tmp/postprocess_generator -g fast_preview_generator2 -f fast_preview2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g fast_preview_generator2 -f fast_preview2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}
 
 	echo "[$ARCH] Building preview_generator2 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=0 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=-90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=180 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator4 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=0 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=-90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=180 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=0 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=-90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
 
 	echo "[$ARCH] Building preview_generator8 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET} rotation=180 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
+}
+
+# The Android app renders the camera preview on the GPU, the CPU builds are used by desktop tools and benchmarks
+function build_camera_preview() {
+	TARGET=$(with_flags $1 no_runtime)
+	ARCH=$2
+
+	# Pixel format values match RawFormat in Common.h
+	for FORMAT in raw10:0 raw12:1 raw16:2; do
+		NAME=${FORMAT%%:*}
+		PIXEL_FORMAT=${FORMAT##*:}
+
+		echo "[$ARCH] Building camera_preview_generator2_${NAME}"
+		./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview2_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} tonemap_levels=7 downscale_factor=2 pixel_format=${PIXEL_FORMAT}
+
+		echo "[$ARCH] Building camera_preview_generator3_${NAME}"
+		./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview3_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} tonemap_levels=6 downscale_factor=3 pixel_format=${PIXEL_FORMAT}
+
+		echo "[$ARCH] Building camera_preview_generator4_${NAME}"
+		./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview4_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} tonemap_levels=5 downscale_factor=4 pixel_format=${PIXEL_FORMAT}
+
+		echo "[$ARCH] Building camera_video_preview_generator2_${NAME}"
+		./tmp/camera_preview_generator -g camera_video_preview_generator -f camera_video_preview2_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} downscale_factor=2 pixel_format=${PIXEL_FORMAT}
+
+		echo "[$ARCH] Building camera_video_preview_generator3_${NAME}"
+		./tmp/camera_preview_generator -g camera_video_preview_generator -f camera_video_preview3_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} downscale_factor=3 pixel_format=${PIXEL_FORMAT}
+
+		echo "[$ARCH] Building camera_video_preview_generator4_${NAME}"
+		./tmp/camera_preview_generator -g camera_video_preview_generator -f camera_video_preview4_${NAME} -e static_library,h -o ../halide/${ARCH} target=${TARGET} downscale_factor=4 pixel_format=${PIXEL_FORMAT}
+	done
 }
 
 function build_runtime() {
@@ -141,11 +216,29 @@ function build_runtime() {
 	# mv ../halide/${ARCH}/halide_runtime.a ../halide/${ARCH}/halide_runtime_opencl.a
 }
 
+# Desktop x86-64 libraries contain a variant per feature set, the Halide runtime picks the best one the CPU
+# supports from cpuid when a pipeline is called. Targets are listed from most to least specific and the
+# runtime is built for the baseline.
+if [[ "$(uname -m)" == "x86_64" ]]; then
+	if [[ "$OSTYPE" == "darwin"* ]]; then
+		HOST_OS="osx"
+	else
+		HOST_OS="linux"
+	fi
+
+	HOST_BASELINE="x86-64-${HOST_OS}-sse41"
+	HOST_TARGETS="x86-64-${HOST_OS}-avx-avx2-avx512-avx512_skylake-f16c-fma-sse41,x86-64-${HOST_OS}-avx-avx2-f16c-fma-sse41,${HOST_BASELINE}"
+else
+	HOST_BASELINE="host"
+	HOST_TARGETS="host"
+fi
+
 mkdir -p ../halide/host
 
-build_denoise host host
-build_postprocess host host
-build_runtime host host
+build_denoise ${HOST_TARGETS} host
+build_postprocess ${HOST_TARGETS} host
+build_camera_preview ${HOST_TARGETS} host
+build_runtime ${HOST_BASELINE} host
 
 mkdir -p ../halide/arm64-v8a
 
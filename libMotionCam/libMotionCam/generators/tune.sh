@@ -0,0 +1,169 @@
+#!/bin/bash
+set -euo pipefail
+
+#
+# Builds schedule variants of the post process pipeline for each resolution class and benchmarks them
+# with Halide's RunGen on random inputs. Variants are the manual schedule at several tile sizes and the
+# autoschedulers. Results are written to tmp/tune/results.csv.
+#
+# Running sums in the guided filters are benchmarked at the default tile size and their output is compared with
+# the direct sums on the same random input. The differences are written to tmp/tune/running_sum.csv.
+#
+# Usage: ./tune.sh [class...]  where class is one of crop, 12mp, 50mp, 200mp
+#
+
+if [ -z "${HALIDE_PATH+x}" ]
+then
+	HALIDE_PATH="../../thirdparty/halide"
+fi
+
+if [ ! -d ${HALIDE_PATH} ]
+then
+    echo "Halide is missing. Run setupenv.sh first"
+    exit 1
+fi
+
+if [[ "$OSTYPE" == "darwin"* ]]; then
+	export DYLD_LIBRARY_PATH=${HALIDE_PATH}/lib
+	LIB_EXT="dylib"
+else
+	export LD_LIBRARY_PATH=${HALIDE_PATH}/lib
+	LIB_EXT="so"
+fi
+
+# Output width and height of each resolution class
+function class_size() {
+	case $1 in
+		crop)	echo "1024 768" ;;
+		12mp)	echo "4032 3024" ;;
+		50mp)	echo "8160 6120" ;;
+		200mp)	echo "16320 12240" ;;
+		*)		echo "Unknown class $1" >&2; exit 1 ;;
+	esac
+}
+
+TILE_SIZES="64 128 256"
+AUTOSCHEDULERS="Mullapudi2016 Adams2019"
+
+# Machine parameters used by the autoschedulers: parallelism, last level cache size, balance
+MACHINE_PARAMS="${MACHINE_PARAMS:-$(nproc 2>/dev/null || sysctl -n hw.ncpu),16777216,40}"
+
+SELECTED_CLASSES="${@:-crop 12mp 50mp 200mp}"
+
+TUNE_DIR="tmp/tune"
+RESULTS="${TUNE_DIR}/results.csv"
+RUNNING_SUM_RESULTS="${TUNE_DIR}/running_sum.csv"
+
+mkdir -p ${TUNE_DIR}
+
+g++ PostProcessGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -O3 -std=c++17 -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ${TUNE_DIR}/postprocess_generator
+
+echo "class,variant,msec" > ${RESULTS}
+echo "class,mean_abs_diff,max_abs_diff" > ${RUNNING_SUM_RESULTS}
+
+# Generates a variant, links it with RunGen and prints the best time per iteration in milliseconds
+function benchmark() {
+	local NAME=$1
+	local WIDTH=$2
+	local HEIGHT=$3
+	shift 3
+
+	local OUT="${TUNE_DIR}/${NAME}"
+	mkdir -p ${OUT}
+
+	${TUNE_DIR}/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h,registration -o ${OUT} \
+		target=host output_width=${WIDTH} output_height=${HEIGHT} "$@" > ${OUT}/generate.log 2>&1
+
+	g++ -O3 -std=c++17 -DHALIDE_NO_PNG -DHALIDE_NO_JPEG -I ${HALIDE_PATH}/include -I ${OUT} \
+		${HALIDE_PATH}/share/tools/RunGenMain.cpp ${OUT}/postprocess.registration.cpp ${OUT}/postprocess.a \
+		-lpthread -ldl -o ${OUT}/rungen
+
+	${OUT}/rungen \
+		--benchmarks=all \
+		--benchmark_min_time=1 \
+		--parsable_output \
+		--default_input_buffers=random:0:auto \
+		--default_input_scalars=estimate \
+		--output_extents=[${WIDTH},${HEIGHT},3] > ${OUT}/benchmark.log 2>&1
+
+	# Seconds per iteration
+	local SECONDS_PER_ITER=$(grep -oE "BENCHMARK = [0-9.e+-]+" ${OUT}/benchmark.log | awk '{ print $3 }')
+
+	if [ -z "${SECONDS_PER_ITER}" ]; then
+		SECONDS_PER_ITER=$(grep -oE "best case of [0-9.e+-]+" ${OUT}/benchmark.log | awk '{ print $4 }')
+	fi
+
+	awk -v s="${SECONDS_PER_ITER}" 'BEGIN { printf "%.2f\n", s * 1000.0 }'
+}
+
+# Runs a benchmarked variant once on the seeded random input and saves its 8 bit output
+function save_output() {
+	local OUT="${TUNE_DIR}/$1"
+
+	${OUT}/rungen \
+		--default_input_buffers=random:0:auto \
+		--default_input_scalars=estimate \
+		--output_extents=[$2,$3,3] \
+		output=${OUT}/output.tmp > ${OUT}/output.log 2>&1
+}
+
+# Prints the bytes of a saved output one per line, skipping the 20 byte header
+function output_bytes() {
+	od -An -v -tu1 -j20 ${TUNE_DIR}/$1/output.tmp | awk '{ for(i = 1; i <= NF; i++) print $i }'
+}
+
+# Prints the mean and maximum absolute difference between two saved outputs
+function compare_outputs() {
+	paste -d' ' <(output_bytes $1) <(output_bytes $2) | \
+		awk '{ d = $1 - $2; if(d < 0) d = -d; s += d; if(d > m) m = d; n++ } END { printf "%.4f,%d\n", s / n, m }'
+}
+
+for CLASS in ${SELECTED_CLASSES}; do
+	read WIDTH HEIGHT <<< "$(class_size ${CLASS})"
+	if [ -z "${WIDTH}" ]; then
+		exit 1
+	fi
+
+	for TILE_SIZE in ${TILE_SIZES}; do
+		VARIANT="tile_size=${TILE_SIZE}"
+		echo "[${CLASS}] Benchmarking ${VARIANT}"
+
+		MSEC=$(benchmark "${CLASS}/tile_${TILE_SIZE}" ${WIDTH} ${HEIGHT} tile_size=${TILE_SIZE})
+		echo "${CLASS},${VARIANT},${MSEC}" >> ${RESULTS}
+	done
+
+	VARIANT="tile_size=128 running_sum=true"
+	echo "[${CLASS}] Benchmarking ${VARIANT}"
+
+	MSEC=$(benchmark "${CLASS}/running_sum" ${WIDTH} ${HEIGHT} tile_size=128 running_sum=true)
+	echo "${CLASS},${VARIANT},${MSEC}" >> ${RESULTS}
+
+	save_output "${CLASS}/tile_128" ${WIDTH} ${HEIGHT}
+	save_output "${CLASS}/running_sum" ${WIDTH} ${HEIGHT}
+
+	echo "${CLASS},$(compare_outputs "${CLASS}/tile_128" "${CLASS}/running_sum")" >> ${RUNNING_SUM_RESULTS}
+
+	for SCHEDULER in ${AUTOSCHEDULERS}; do
+		PLUGIN="${HALIDE_PATH}/lib/libautoschedule_$(echo ${SCHEDULER} | tr '[:upper:]' '[:lower:]').${LIB_EXT}"
+
+		if [ ! -f ${PLUGIN} ]; then
+			echo "[${CLASS}] Skipping ${SCHEDULER}, ${PLUGIN} not found"
+			continue
+		fi
+
+		echo "[${CLASS}] Benchmarking ${SCHEDULER}"
+
+		MSEC=$(benchmark "${CLASS}/${SCHEDULER}" ${WIDTH} ${HEIGHT} -p ${PLUGIN} -s ${SCHEDULER} auto_schedule=true machine_params=${MACHINE_PARAMS})
+		echo "${CLASS},${SCHEDULER},${MSEC}" >> ${RESULTS}
+	done
+done
+
+echo
+echo "Fastest variant per class:"
+
+tail -n +2 ${RESULTS} | sort -t, -k1,1 -k3,3n | awk -F, '!seen[$1]++ { printf "  %-6s %-20s %8s ms\n", $1, $2, $3 }'
+
+echo
+echo "Running sums against direct sums (8 bit output):"
+
+tail -n +2 ${RUNNING_SUM_RESULTS} | awk -F, '{ printf "  %-6s mean %s max %s\n", $1, $2, $3 }'
@@ -0,0 +1,188 @@
+#ifndef BurstFuser_hpp
+#define BurstFuser_hpp
+
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/RawCameraMetadata.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    class RawContainer;
+    class BurstAlignment;
+    class WaveletBufferPool;
+    struct RawImageBuffer;
+
+    enum class AlignmentMode : int {
+        NONE = 0,
+
+        // Per pixel optical flow on the preview images
+        DENSE_FLOW,
+
+        // Coarse to fine per tile offsets on the bayer data
+        TILES
+    };
+
+    struct BurstFuserConfig {
+        // Fuse window size (3, 5 or 7). Selected from the signal level when 0.
+        int window;
+
+        // Wavelet denoise weights per level. Estimated from the signal level when empty.
+        std::vector<float> weights;
+
+        // Scale of the estimated noise used for wavelet thresholding
+        float waveletStrength;
+
+        AlignmentMode alignmentMode;
+
+        // Optical flow patch size. Selected from the exposure of the reference when 0.
+        int patchSize;
+
+        // Maximum number of loaded frames waiting to be fused
+        int framesInFlight;
+
+        // Process the image in overlapping tiles when tile size is greater than 0
+        int tileSize;
+        int tileHalo;
+
+        // Region of the frames to fuse in the coordinates of the extended bayer channels. The reference
+        // must be loaded from the same region. Whole frames are fused when empty.
+        cv::Rect region;
+
+        // Skip badly aligned frames and stop fusing once more frames no longer improve the result
+        bool adaptiveMerge;
+
+        // Frames with an alignment error above this multiple of the error of the frame next to the reference
+        // are skipped
+        float maxAlignmentError;
+
+        // Stop when the estimated signal to noise ratio reaches this or a frame improves it by less than minSnrGain
+        float targetSnr;
+        float minSnrGain;
+
+        BurstFuserConfig();
+    };
+
+    struct FrameMergeInfo {
+        size_t index;
+
+        // Mean difference between the reference and the aligned frame, negative when the frame was not loaded
+        float alignmentError;
+        bool used;
+    };
+
+    //
+    // Frames fused against the reference
+    //
+
+    class BurstFrameSource {
+    public:
+        virtual ~BurstFrameSource() {}
+
+        virtual size_t size() const = 0;
+        virtual std::shared_ptr<RawImageBuffer> loadFrame(size_t index) = 0;
+        virtual void releaseFrame(const std::shared_ptr<RawImageBuffer>& frame) {}
+    };
+
+    class ContainerFrameSource : public BurstFrameSource {
+    public:
+        ContainerFrameSource(RawContainer& container);
+
+        size_t size() const;
+        std::shared_ptr<RawImageBuffer> loadFrame(size_t index);
+        void releaseFrame(const std::shared_ptr<RawImageBuffer>& frame);
+
+    private:
+        RawContainer& mContainer;
+        std::vector<std::string> mFrames;
+    };
+
+    class BufferFrameSource : public BurstFrameSource {
+    public:
+        BufferFrameSource(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers);
+
+        size_t size() const;
+        std::shared_ptr<RawImageBuffer> loadFrame(size_t index);
+
+    private:
+        std::vector<std::shared_ptr<RawImageBuffer>> mBuffers;
+    };
+
+    //
+    // Aligns and fuses a burst of frames into the reference, then spatially denoises the result.
+    // The fuser can be reused for multiple bursts, which keeps its buffers and alignment state.
+    //
+
+    class BurstFuser {
+    public:
+        BurstFuser(const RawCameraMetadata& cameraMetadata, const BurstFuserConfig& config);
+        ~BurstFuser();
+
+        // When tiling, only the RAW reference is kept and the caller can release the decoded reference
+        void setReference(std::shared_ptr<RawImageBuffer> referenceRawBuffer, std::shared_ptr<RawData> reference);
+
+        // onFuseCompleted is called once fusing has finished, also when frames were skipped or merging stopped early.
+        // Returning false from onFrameFused cancels fusing, no output is returned and onFuseCompleted is not called.
+        std::vector<Halide::Runtime::Buffer<uint16_t>> process(BurstFrameSource& frames,
+                                                               float* outNoise=nullptr,
+                                                               const std::function<bool()>& onFrameFused=nullptr,
+                                                               const std::function<void()>& onFuseCompleted=nullptr);
+
+        // Normalised result of the frames fused so far without spatial denoising, one buffer per channel.
+        // This is the reference when nothing has been fused yet. When tiling, each band is fused with every frame
+        // before the next one is started so only the reference is available.
+        std::vector<Halide::Runtime::Buffer<uint16_t>> snapshot();
+
+        int fusedFrames() const { return mFusedFrames; }
+
+        // Frames of the last burst and whether they were fused
+        const std::vector<FrameMergeInfo>& mergeReport() const { return mMergeReport; }
+
+        const BurstFuserConfig& config() const { return mConfig; }
+
+        // Estimated peak memory used to fuse and denoise numFrames frames of the given size, excluding the decoded
+        // reference. When tiling, this includes the RAW reference and frames, which stay loaded for every band.
+        static size_t estimateMemory(const int width,
+                                     const int height,
+                                     const size_t frameBytes,
+                                     const size_t numFrames,
+                                     const BurstFuserConfig& config);
+
+    private:
+        bool fuse(BurstFrameSource& frames, const std::function<bool()>& onFrameFused);
+        std::vector<Halide::Runtime::Buffer<uint16_t>> denoise(float* outNoise);
+
+    private:
+        const RawCameraMetadata mCameraMetadata;
+        const BurstFuserConfig mConfig;
+        std::unique_ptr<WaveletBufferPool> mWaveletPool;
+
+        std::shared_ptr<RawData> mReference;
+        std::shared_ptr<RawImageBuffer> mReferenceFrame;
+        RawImageMetadata mReferenceMetadata;
+        std::unique_ptr<BurstAlignment> mAlignment;
+        int mWidth;
+        int mHeight;
+
+        Halide::Runtime::Buffer<float> mFuseOutput;
+
+        // When tiling, the normalised fused image and its noise measured per channel
+        std::vector<Halide::Runtime::Buffer<uint16_t>> mTiledOutput;
+        std::vector<float> mTiledNoise;
+        std::vector<float> mTiledSignal;
+
+        std::vector<float> mNoise;
+        std::vector<FrameMergeInfo> mMergeReport;
+        float mSignalAverage;
+        float mReferenceSnr;
+        int mPatchSize;
+        int mFusedFrames;
+    };
+}
+
+#endif /* BurstFuser_hpp */
@@ -0,0 +1,50 @@
+#ifndef DecodedFrameStore_hpp
+#define DecodedFrameStore_hpp
+
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/RawCameraMetadata.h"
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <tuple>
+
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct PostProcessSettings;
+
+    //
+    // Keeps the decoded frames and previews of a capture so each one is only created once while the capture
+    // is processed. Frames are identified by their buffer, which must outlive the store or be released from it.
+    //
+
+    class DecodedFrameStore {
+    public:
+        DecodedFrameStore(const RawCameraMetadata& cameraMetadata);
+
+        std::shared_ptr<RawData> rawData(const RawImageBuffer& frame, const bool extendEdges=true, const float scalePreview=1.0f);
+
+        Halide::Runtime::Buffer<uint8_t> preview(const RawImageBuffer& frame,
+                                                 const int downscaleFactor,
+                                                 const PostProcessSettings& settings);
+
+        void release(const RawImageBuffer& frame);
+        void releasePreviews();
+        void clear();
+
+    private:
+        typedef std::tuple<const RawImageBuffer*, bool, float> RawDataKey;
+        typedef std::tuple<const RawImageBuffer*, int, std::string> PreviewKey;
+
+        const RawCameraMetadata& mCameraMetadata;
+
+        std::recursive_mutex mMutex;
+        std::map<RawDataKey, std::shared_ptr<RawData>> mRawData;
+        std::map<PreviewKey, Halide::Runtime::Buffer<uint8_t>> mPreviews;
+    };
+}
+
+#endif /* DecodedFrameStore_hpp */
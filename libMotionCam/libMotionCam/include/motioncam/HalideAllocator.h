@@ -0,0 +1,52 @@
+#ifndef HalideAllocator_hpp
+#define HalideAllocator_hpp
+
+#include <cstddef>
+
+namespace motioncam {
+    struct HalideAllocatorConfig {
+        // Free blocks kept for reuse. Blocks are released to the system above this.
+        size_t maxCachedBytes;
+
+        // Ask for huge pages for blocks of at least hugePageThreshold bytes (Linux only)
+        bool hugePages;
+        size_t hugePageThreshold;
+
+        HalideAllocatorConfig();
+    };
+
+    struct HalideAllocatorStats {
+        size_t allocations;
+        size_t reused;
+        size_t allocatedBytes;
+        size_t peakAllocatedBytes;
+        size_t cachedBytes;
+
+        double reuseRate() const {
+            return allocations > 0 ? reused / static_cast<double>(allocations) : 0.0;
+        }
+    };
+
+    //
+    // Pools the scratch memory Halide pipelines allocate for their intermediate buffers so repeated calls
+    // reuse blocks instead of going back to the system each time. Blocks are reused by size class.
+    //
+
+    class HalideAllocator {
+    public:
+        // Installs the allocator as the Halide custom malloc/free. Must be called before any pipeline runs, only the
+        // first call has an effect and later calls keep the existing config.
+        static void install(const HalideAllocatorConfig& config=HalideAllocatorConfig());
+
+        // The stats stay empty until the allocator is installed
+        static bool installed();
+
+        // Releases all cached blocks
+        static void trim();
+
+        static HalideAllocatorStats stats();
+        static void resetStats();
+    };
+}
+
+#endif /* HalideAllocator_hpp */
@@ -18,11 +18,13 @@ namespace motioncam {
     class RawImage;
     class RawContainer;
     class Temperature;
+    class OutputWriter;
     struct PostProcessSettings;
     struct HdrMetadata;
     struct PreviewMetadata;
     struct RawImageBuffer;
     struct RawCameraMetadata;
+    class DecodedFrameStore;
     struct RawImageMetadata;
 
     struct RawData {
@@ -36,9 +38,18 @@ namespace motioncam {
         ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start);
 
         void nextFusedImage();        
+        
+        // Moves to the end of fusing when frames were skipped or merging stopped early
+        void fuseCompleted();
+        
         void denoiseCompleted();
         void postProcessCompleted();
-        void imageSaved();
+        
+        // True once the listener has asked for processing to stop
+        bool cancelled() const { return mCancelled; }
+        
+    private:
+        void update(int progress);
         
     private:
         const ImageProcessorProgress& mProgressListener;
@@ -46,6 +57,7 @@ namespace motioncam {
         int mNumImages;
         double mPerImageIncrement;
         int mCurImage;
+        bool mCancelled;
     };
     
     class ImageProcessor {
@@ -56,6 +68,21 @@ namespace motioncam {
 
         static void process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener);
 
+        // The DNG and output image are written on a background thread while processing continues, this returns once
+        // they have been written.
+        static void process(RawContainer& rawContainer,
+                            const PostProcessSettings& postProcessSettings,
+                            const std::string& outputPath,
+                            const ImageProcessorProgress& progressListener);
+
+        // Without a writer this is the same as above. With a writer this returns as soon as the output is submitted,
+        // the output tasks keep the listener alive until they have run.
+        static void process(RawContainer& rawContainer,
+                            const PostProcessSettings& postProcessSettings,
+                            const std::string& outputPath,
+                            const std::shared_ptr<const ImageProcessorProgress>& progressListener,
+                            OutputWriter* outputWriter);
+
         static Halide::Runtime::Buffer<uint8_t> createPreview(const RawImageBuffer& rawBuffer,
                                                               const int downscaleFactor,
                                                               const RawCameraMetadata& cameraMetadata,
@@ -96,7 +123,8 @@ namespace motioncam {
                                             const RawCameraMetadata& cameraMetadata,
                                             const PostProcessSettings& postProcessSettings,
                                             float& outBlackPoint,
-                                            float& outWhitePoint);
+                                            float& outWhitePoint,
+                                            DecodedFrameStore* frameStore=nullptr);
         
         static float estimateShadows(const cv::Mat& histogram, float keyValue);
         static float estimateExposureCompensation(const cv::Mat& histogram, float threshold=1e-4f);
@@ -120,6 +148,10 @@ namespace motioncam {
                                                      const RawCameraMetadata& cameraMetadata,
                                                      const bool extendEdges=true,
                                                      const float scalePreview=1.0f);
+
+        static std::shared_ptr<RawData> loadRawImage(const RawImageBuffer& rawImage,
+                                                     const RawCameraMetadata& cameraMetadata,
+                                                     const cv::Rect& region);
         
         static void createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
                                      const RawImageMetadata& rawImageMetadata,
@@ -135,24 +167,6 @@ namespace motioncam {
                                      cv::Mat& outCameraToPcs,
                                      cv::Mat& outPcsToSrgb);
 
-        static std::vector<Halide::Runtime::Buffer<uint16_t>> denoise(
-            std::shared_ptr<RawImageBuffer> referenceRawBuffer,
-            std::vector<std::shared_ptr<RawImageBuffer>> buffers,
-            const std::vector<float>& denoiseWeights,
-            const RawCameraMetadata& cameraMetadata);
-
-        static Halide::Runtime::Buffer<float> denoise(
-            std::shared_ptr<RawImageBuffer> referenceRawBuffer,
-            std::vector<std::shared_ptr<RawImageBuffer>> buffers,
-            const RawCameraMetadata& cameraMetadata);
-
-        static std::vector<Halide::Runtime::Buffer<uint16_t>> denoise(
-            RawImageBuffer& referenceRawBuffer,
-            RawData& reference,
-            RawContainer& rawContainer,
-            float* outNoise,
-            ImageProgressHelper& progressHelper);
-
         static void addExifMetadata(const RawImageMetadata& metadata,
                                     const cv::Mat& thumbnail,
                                     const RawCameraMetadata& cameraMetadata,
@@ -177,7 +191,8 @@ namespace motioncam {
         static std::shared_ptr<HdrMetadata> prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                        const PostProcessSettings& settings,
                                                        const RawImageBuffer& reference,
-                                                       const RawImageBuffer& underexposed);
+                                                       const RawImageBuffer& underexposed,
+                                                       DecodedFrameStore* frameStore=nullptr);
 
         static double calcEv(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata);
 
@@ -4,12 +4,28 @@
 #include <string>
 
 namespace motioncam {
+    enum class OutputStage : int {
+        // Single frame result of the reference
+        REFERENCE = 0,
+
+        // Result of the frames merged so far
+        PARTIAL_MERGE,
+
+        FINAL,
+
+        // Denoised RAW image written next to the output
+        DNG
+    };
+
     class ImageProcessorProgress {
     public:
         virtual std::string onPreviewSaved(const std::string& outputPath) const = 0;
         virtual bool onProgressUpdate(int progress) const = 0;
         virtual void onCompleted() const = 0;
         virtual void onError(const std::string& error) const = 0;
+
+        // Called each time the output file has been replaced with the result of a stage
+        virtual void onStageSaved(const std::string& outputPath, OutputStage stage) const {}
     };
 }
 
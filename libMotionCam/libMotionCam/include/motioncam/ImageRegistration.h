@@ -0,0 +1,72 @@
+#ifndef ImageRegistration_hpp
+#define ImageRegistration_hpp
+
+#include <opencv2/opencv.hpp>
+#include <HalideBuffer.h>
+
+namespace motioncam {
+
+    struct RegistrationConfig {
+        // Keypoints are detected on images downscaled so their largest side is at most this size
+        int maxDimension;
+        int maxFeatures;
+
+        // Lowe's ratio test for matches
+        float matchRatio;
+
+        // RANSAC reprojection threshold, in pixels of the downscaled image
+        float ransacThreshold;
+        int minInliers;
+
+        // ECC refinement runs when the keypoint estimate fails or its residual is above this, in full size pixels
+        bool refine;
+        float refineResidual;
+        int refineLevel;
+
+        RegistrationConfig();
+    };
+
+    struct RegistrationResult {
+        RegistrationResult() : confidence(0), residual(-1), refined(false) {
+        }
+
+        // Homography from the aligned image to the reference. Empty when registration failed.
+        cv::Mat warpMatrix;
+
+        // 0 to 1
+        float confidence;
+
+        // Mean reprojection error of the keypoint inliers in full size pixels, -1 when not available
+        float residual;
+
+        bool refined;
+    };
+
+    //
+    // Estimates a homography between two images. Keypoints matched with RANSAC are used first, the slower ECC
+    // estimate is only used to refine the result when the keypoint estimate is poor.
+    //
+
+    class ImageRegistration {
+    public:
+        ImageRegistration(const RegistrationConfig& config=RegistrationConfig());
+
+        RegistrationResult align(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
+                                 const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer);
+
+    private:
+        bool estimateFromKeypoints(const cv::Mat& referenceImage,
+                                   const cv::Mat& toAlignImage,
+                                   RegistrationResult& result);
+
+        bool refine(const cv::Mat& referenceImage,
+                    const cv::Mat& toAlignImage,
+                    RegistrationResult& result);
+
+    private:
+        const RegistrationConfig mConfig;
+        cv::Ptr<cv::ORB> mDetector;
+    };
+}
+
+#endif /* ImageRegistration_hpp */
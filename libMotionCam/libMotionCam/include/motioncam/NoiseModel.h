@@ -0,0 +1,46 @@
+#ifndef NoiseModel_hpp
+#define NoiseModel_hpp
+
+#include <vector>
+
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    struct RawCameraMetadata;
+    struct RawImageMetadata;
+    struct RawImageBuffer;
+
+    //
+    // Noise of each raw channel as a function of the signal, from the noise profile reported by the camera.
+    // The standard deviation at a raw value x is range * sqrt(S * (x - black) / range + O).
+    //
+
+    struct NoiseCurves {
+        float scale[4];
+        float offset[4];
+        float blackLevel[4];
+        float range[4];
+
+        // Standard deviation in raw values
+        float noise(int channel, float rawValue) const;
+    };
+
+    class NoiseModel {
+    public:
+        // Returns false when the metadata has no usable noise profile
+        static bool getCurves(const RawCameraMetadata& cameraMetadata,
+                              const RawImageMetadata& metadata,
+                              NoiseCurves& outCurves);
+
+        // Estimates the noise (standard deviation in raw values) and signal of each channel of a deinterleaved
+        // raw image. The image is only measured when the noise profile can't be used.
+        static void estimate(const RawCameraMetadata& cameraMetadata,
+                             const RawImageBuffer& rawBuffer,
+                             const Halide::Runtime::Buffer<uint16_t>& deinterleaved,
+                             const int patchSize,
+                             std::vector<float>& outNoise,
+                             std::vector<float>& outSignal);
+    };
+}
+
+#endif /* NoiseModel_hpp */
@@ -0,0 +1,35 @@
+#ifndef OutputWriter_hpp
+#define OutputWriter_hpp
+
+#include <memory>
+#include <functional>
+
+namespace motioncam {
+
+    //
+    // Writes output files on a background thread. Tasks run one at a time in the order they were submitted,
+    // so a task submitted after the output of a capture runs once all of that output has been written.
+    //
+
+    class OutputWriter {
+    public:
+        OutputWriter();
+
+        // Waits for pending tasks to finish
+        ~OutputWriter();
+
+        void submit(const std::function<void()>& task);
+
+        // Waits until all submitted tasks have finished
+        void wait();
+
+    private:
+        void run();
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> mImpl;
+    };
+}
+
+#endif /* OutputWriter_hpp */
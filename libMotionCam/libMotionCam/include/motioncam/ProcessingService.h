@@ -0,0 +1,101 @@
+#ifndef ProcessingService_hpp
+#define ProcessingService_hpp
+
+#include "motioncam/ImageProcessorProgress.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace motioncam {
+    class RawContainer;
+    struct PostProcessSettings;
+    struct JobEntry;
+
+    enum class JobPriority : int {
+        LOW = 0,
+        NORMAL,
+        HIGH
+    };
+
+    enum class JobState : int {
+        UNKNOWN = 0,
+        QUEUED,
+        RUNNING,
+        COMPLETED,
+        CANCELLED,
+        FAILED
+    };
+
+    struct ProcessingJob {
+        // The container is opened from the path when not set
+        std::shared_ptr<RawContainer> container;
+        std::string containerPath;
+
+        // Settings of the container are used when not set
+        std::shared_ptr<PostProcessSettings> settings;
+
+        std::string outputPath;
+        JobPriority priority;
+
+        // Optional, receives the progress of the job
+        std::shared_ptr<ImageProcessorProgress> progressListener;
+
+        ProcessingJob();
+    };
+
+    struct JobTiming {
+        // Time spent waiting in the queue and processing, in milliseconds
+        double queuedMs;
+        double processingMs;
+
+        JobTiming() : queuedMs(0), processingMs(0) {}
+    };
+
+    struct ProcessingServiceConfig {
+        // Number of captures processed at the same time
+        int maxConcurrentJobs;
+
+        // Threads shared by all jobs. Uses all cores when 0.
+        int threadBudget;
+
+        ProcessingServiceConfig();
+    };
+
+    //
+    // Processes captures on a pool of workers so the serial parts of different captures overlap
+    //
+
+    class ProcessingService {
+    public:
+        ProcessingService(const ProcessingServiceConfig& config=ProcessingServiceConfig());
+        ~ProcessingService();
+
+        int64_t submit(const ProcessingJob& job);
+
+        // Queued jobs are removed, running jobs stop at the next progress update
+        bool cancel(int64_t jobId);
+
+        JobState state(int64_t jobId);
+        bool timing(int64_t jobId, JobTiming& outTiming);
+
+        void wait(int64_t jobId);
+        void waitForAll();
+
+        // Cancels queued jobs and waits for running jobs to finish
+        void shutdown();
+
+    private:
+        void run();
+
+        // Called with the lock held after the job has been removed from the queue
+        void cancelQueuedJob(const std::shared_ptr<JobEntry>& entry);
+        void finishJob(const std::shared_ptr<JobEntry>& entry);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> mImpl;
+    };
+}
+
+#endif /* ProcessingService_hpp */
@@ -0,0 +1,70 @@
+#ifndef ResourceCache_hpp
+#define ResourceCache_hpp
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    struct RawImageMetadata;
+
+    //
+    // Builds keys for cached resources from their inputs
+    //
+
+    class ResourceKey {
+    public:
+        ResourceKey();
+
+        ResourceKey& add(const cv::Mat& m);
+        ResourceKey& add(const void* data, size_t len);
+        ResourceKey& add(double v);
+        ResourceKey& add(int v);
+
+        uint64_t value() const { return mHash; }
+
+    private:
+        uint64_t mHash;
+    };
+
+    struct ColorMatrices {
+        cv::Vec3f cameraWhite;
+        cv::Mat cameraToPcs;
+        cv::Mat pcsToSrgb;
+    };
+
+    //
+    // Process wide cache of immutable resources derived from embedded assets and metadata. Resources returned
+    // by the cache are shared and must not be modified.
+    //
+
+    class ResourceCache {
+    public:
+        static ResourceCache& get();
+
+        ~ResourceCache();
+
+        // Memory limits of each type of resource. Least recently used resources are evicted when exceeded.
+        void setLimits(size_t colorMatricesBytes, size_t shadingMapBytes);
+        size_t memoryUsage();
+        void clear();
+
+        cv::Mat blueNoise();
+
+        ColorMatrices colorMatrices(const ResourceKey& key, const std::function<ColorMatrices()>& create);
+
+        std::vector<Halide::Runtime::Buffer<float>> shadingMap(const RawImageMetadata& metadata);
+
+    private:
+        ResourceCache();
+
+        struct Impl;
+        std::unique_ptr<Impl> mImpl;
+    };
+}
+
+#endif /* ResourceCache_hpp */
@@ -17,6 +17,33 @@ namespace motioncam {
     struct PostProcessSettings {
         // Denoising
         int spatialDenoiseLevel;
+        int fuseFramesInFlight;
+        int fuseTileSize;
+        int fuseTileHalo;
+        bool fuseTileAlignment;
+
+        // Skip badly aligned frames and stop merging once the target signal to noise ratio is reached
+        bool adaptiveMerge;
+        float mergeTargetSnr;
+
+        // Peak memory budget of processing in megabytes, unlimited when 0
+        int memoryBudget;
+
+        // Write the reference and optionally a partial merge to the output before the final image
+        bool progressive;
+        int progressiveMergeFrames;
+
+        // Region of the sensor to process as a fraction of its size. The whole sensor is processed when empty.
+        float roiX;
+        float roiY;
+        float roiWidth;
+        float roiHeight;
+
+        // Output one pixel per bayer quad without demosaicing, half the width and height of the sensor
+        bool binnedOutput;
+
+        // Post process in overlapping tiles of this size in input plane pixels, disabled when 0
+        int postProcessTileSize;
 
         // Post processing
         float temperature;
@@ -0,0 +1,1334 @@
+#include "motioncam/BurstFuser.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/ImageOps.h"
+#include "motioncam/Measure.h"
+#include "motioncam/Lock.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/NoiseModel.h"
+#include "motioncam/Logger.h"
+
+// Halide
+#include "forward_transform.h"
+#include "inverse_transform.h"
+#include "fuse_denoise_3x3.h"
+#include "fuse_denoise_5x5.h"
+#include "fuse_denoise_7x7.h"
+#include "normalize_fuse.h"
+#include "fuse_denoise_tiles_3x3.h"
+#include "fuse_denoise_tiles_5x5.h"
+#include "fuse_denoise_tiles_7x7.h"
+#include "tile_align.h"
+
+#include <map>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <queue/blockingconcurrentqueue.h>
+
+namespace motioncam {
+    typedef Halide::Runtime::Buffer<float> WaveletBuffer;
+
+    // Tile size the tile_align and fuse_denoise_tiles generators are built with
+    const int ALIGN_TILE_SIZE = 16;
+
+    // Spacing of the preview pixels compared to measure the alignment error
+    const int ALIGNMENT_ERROR_STEP = 8;
+
+    static size_t waveletBufferBytes(int width, int height) {
+        size_t bytes = 0;
+        
+        for(int level = 0; level < WAVELET_LEVELS; level++) {
+            width = width / 2;
+            height = height / 2;
+            
+            bytes += static_cast<size_t>(width) * height * 4 * 4 * sizeof(float);
+        }
+        
+        return bytes;
+    }
+
+    static std::vector<Halide::Runtime::Buffer<float>> createWaveletBuffers(int width, int height) {
+        std::vector<Halide::Runtime::Buffer<float>> buffers;
+    
+        for(int level = 0; level < WAVELET_LEVELS; level++) {
+            width = width / 2;
+            height = height / 2;
+        
+            buffers.emplace_back(width, height, 4, 4);
+        }
+    
+        return buffers;
+    }
+
+    //
+    // Loads part of a frame. The region is relative to the fused region, which is the whole frame when empty.
+    //
+    
+    static std::shared_ptr<RawData> loadRegion(const RawImageBuffer& frame,
+                                               const RawCameraMetadata& cameraMetadata,
+                                               const cv::Rect& fuseRegion,
+                                               const cv::Rect& region)
+    {
+        if(fuseRegion.area() <= 0)
+            return ImageProcessor::loadRawImage(frame, cameraMetadata, region);
+        
+        auto rawData = ImageProcessor::loadRawImage(frame, cameraMetadata, region + fuseRegion.tl());
+        
+        rawData->rawBuffer.set_min(region.x, region.y, 0);
+        rawData->previewBuffer.set_min(region.x, region.y);
+        
+        return rawData;
+    }
+
+    struct FuseFrame {
+        size_t index;
+        std::shared_ptr<RawImageBuffer> frame;
+        std::shared_ptr<RawData> rawData;
+        cv::Mat flow;
+        cv::Scalar flowMean;
+        float alignmentError;
+
+        // When tiling, the band the frame was loaded for and the part of the reference it was aligned against
+        size_t band;
+        std::shared_ptr<RawData> reference;
+    };
+
+    //
+    // Mean absolute difference between the reference preview and the preview of a frame moved by its flow.
+    // Only a sparse grid of pixels is compared.
+    //
+
+    static float measureAlignmentError(const RawData& reference, const RawData& current, const cv::Mat& flow, const int flowScale) {
+        const auto& referencePreview = reference.previewBuffer;
+        const auto& preview = current.previewBuffer;
+
+        if(flow.empty())
+            return 0.0f;
+
+        const int minX = (std::max)(preview.dim(0).min(), referencePreview.dim(0).min());
+        const int minY = (std::max)(preview.dim(1).min(), referencePreview.dim(1).min());
+        const int maxX = (std::min)(preview.dim(0).max(), referencePreview.dim(0).max());
+        const int maxY = (std::min)(preview.dim(1).max(), referencePreview.dim(1).max());
+
+        double error = 0;
+        size_t samples = 0;
+
+        for(int y = minY; y <= maxY; y += ALIGNMENT_ERROR_STEP) {
+            const int flowY = (std::min)(flow.rows - 1, (y - preview.dim(1).min()) / flowScale);
+
+            for(int x = minX; x <= maxX; x += ALIGNMENT_ERROR_STEP) {
+                const int flowX = (std::min)(flow.cols - 1, (x - preview.dim(0).min()) / flowScale);
+                const cv::Vec2f& f = flow.at<cv::Vec2f>(flowY, flowX);
+
+                int sx = cvRound(x + f[0]);
+                int sy = cvRound(y + f[1]);
+
+                sx = (std::max)(preview.dim(0).min(), (std::min)(preview.dim(0).max(), sx));
+                sy = (std::max)(preview.dim(1).min(), (std::min)(preview.dim(1).max(), sy));
+
+                error += std::abs(static_cast<int>(referencePreview(x, y)) - static_cast<int>(preview(sx, sy)));
+                ++samples;
+            }
+        }
+
+        return samples > 0 ? static_cast<float>(error / samples) : 0.0f;
+    }
+
+    class BurstAlignment {
+    public:
+        BurstAlignment(const int patchSize) : mPatchSize(patchSize)
+        {
+            mOpticalFlow = cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
+            
+            mOpticalFlow->setPatchSize(patchSize);
+            mOpticalFlow->setPatchStride(patchSize/2);
+            mOpticalFlow->setGradientDescentIterations(16);
+            mOpticalFlow->setUseMeanNormalization(true);
+            mOpticalFlow->setUseSpatialPropagation(true);
+        }
+        
+        void setReference(const Halide::Runtime::Buffer<uint8_t>& referencePreview) {
+            // Keep our own copy of the reference so the context does not depend on the lifetime of the caller's buffer
+            cv::Mat reference(referencePreview.height(), referencePreview.width(), CV_8U, (void*) referencePreview.data());
+            mReference = reference.clone();
+        }
+        
+        void align(const Halide::Runtime::Buffer<uint8_t>& preview, cv::Mat& outFlow, cv::Scalar& outFlowMean) {
+            cv::Mat current(preview.height(), preview.width(), CV_8U, (void*) preview.data());
+            
+            mOpticalFlow->calc(mReference, current, outFlow);
+            
+            outFlowMean = cv::mean(outFlow);
+        }
+        
+        void align(const Halide::Runtime::Buffer<uint8_t>& preview,
+                   const cv::Rect& region,
+                   cv::Mat& outFlow,
+                   cv::Scalar& outFlowMean)
+        {
+            cv::Mat current(preview.height(), preview.width(), CV_8U, (void*) preview.data());
+            cv::Mat reference = mReference(region).clone();
+            
+            mOpticalFlow->calc(reference, current, outFlow);
+            
+            outFlowMean = cv::mean(outFlow);
+        }
+        
+        int patchSize() const {
+            return mPatchSize;
+        }
+        
+    private:
+        const int mPatchSize;
+        cv::Mat mReference;
+        cv::Ptr<cv::DISOpticalFlow> mOpticalFlow;
+    };
+
+    static void alignTiles(RawData& reference,
+                           RawData& current,
+                           const cv::Rect& region,
+                           cv::Mat& outOffsets,
+                           cv::Scalar& outOffsetsMean)
+    {
+        const int T = ALIGN_TILE_SIZE;
+        
+        outOffsets.create((region.height + T - 1) / T, (region.width + T - 1) / T, CV_32FC2);
+        
+        Halide::Runtime::Buffer<float> offsetsBuffer =
+            Halide::Runtime::Buffer<float>::make_interleaved((float*) outOffsets.data, outOffsets.cols, outOffsets.rows, 2);
+        
+        offsetsBuffer.set_min(region.x / T, region.y / T, 0);
+        
+        tile_align(reference.rawBuffer, current.rawBuffer, offsetsBuffer);
+        
+        outOffsetsMean = cv::mean(outOffsets);
+    }
+
+    struct FuseTile {
+        cv::Rect inner;
+        cv::Rect outer;
+    };
+
+    static std::vector<FuseTile> createFuseTiles(const int width, const int height, const int tileSize, const int halo) {
+        // Keep tiles aligned so each one can be decomposed into wavelet levels
+        const int T = pow(2, EXTEND_EDGE_AMOUNT);
+        
+        const int alignedTileSize = (std::max)(2*T, T * static_cast<int>(ceil(tileSize / (double) T)));
+        
+        // Bands are denoised in place and only the band above is kept undenoised, so the halo must stay below the
+        // tile size
+        const int alignedHalo = (std::min)(alignedTileSize - T, T * static_cast<int>(ceil((std::max)(0, halo) / (double) T)));
+        
+        const cv::Rect bounds(0, 0, width, height);
+        std::vector<FuseTile> tiles;
+        
+        for(int y = 0; y < height; y += alignedTileSize) {
+            for(int x = 0; x < width; x += alignedTileSize) {
+                FuseTile tile;
+                
+                tile.inner = cv::Rect(x, y, alignedTileSize, alignedTileSize) & bounds;
+                tile.outer = cv::Rect(x - alignedHalo,
+                                      y - alignedHalo,
+                                      alignedTileSize + 2*alignedHalo,
+                                      alignedTileSize + 2*alignedHalo) & bounds;
+                
+                tiles.push_back(tile);
+            }
+        }
+        
+        return tiles;
+    }
+
+    //
+    // A row of tiles. When tiling, every frame is fused into one band before moving to the next so only the band
+    // needs a float accumulator.
+    //
+
+    struct FuseBand {
+        FuseTile region;
+        std::vector<FuseTile> tiles;
+    };
+
+    static std::vector<FuseBand> createFuseBands(const int width, const int height, const int tileSize, const int halo) {
+        // The fuse filters read a few rows around the output, which must be part of the loaded band
+        auto tiles = createFuseTiles(width, height, tileSize, (std::max)(1, halo));
+        std::vector<FuseBand> bands;
+
+        for(auto& tile : tiles) {
+            if(bands.empty() || bands.back().region.inner.y != tile.inner.y) {
+                bands.push_back(FuseBand { tile, { tile } });
+            }
+            else {
+                bands.back().region.inner |= tile.inner;
+                bands.back().region.outer |= tile.outer;
+                bands.back().tiles.push_back(tile);
+            }
+        }
+
+        return bands;
+    }
+
+    static Halide::Runtime::Buffer<float> createAccumulator(const cv::Rect& region) {
+        Halide::Runtime::Buffer<float> accumulator(region.width, region.height, 4);
+
+        accumulator.set_min(region.x, region.y, 0);
+        accumulator.fill(0);
+
+        return accumulator;
+    }
+
+    //
+    // Loads items on a background thread while the previous one is being processed. The number of loaded items
+    // waiting to be processed is bounded. Once process returns false the remaining loaded items are only released.
+    //
+
+    template<typename T>
+    static void loadAndProcess(const size_t count,
+                               const int maxInFlight,
+                               const std::function<std::shared_ptr<T>(size_t)>& load,
+                               const std::function<bool(T&)>& process,
+                               const std::function<void(T&)>& release)
+    {
+        moodycamel::BlockingConcurrentQueue<std::shared_ptr<T>> loaded;
+        moodycamel::LightweightSemaphore freeSlots((std::max)(1, maxInFlight));
+        std::atomic<bool> cancelled(false);
+        std::exception_ptr loadError;
+
+        std::thread loadThread([&]() {
+            try {
+                for(size_t i = 0; i < count && !cancelled; i++) {
+                    freeSlots.wait();
+                    if(cancelled)
+                        break;
+
+                    loaded.enqueue(load(i));
+                }
+            }
+            catch(...) {
+                loadError = std::current_exception();
+            }
+
+            // Signal end of items
+            loaded.enqueue(nullptr);
+        });
+
+        try {
+            std::shared_ptr<T> current;
+            bool stopped = false;
+
+            while(true) {
+                loaded.wait_dequeue(current);
+                if(!current)
+                    break;
+
+                if(!stopped && !process(*current)) {
+                    stopped = true;
+                    cancelled = true;
+                }
+
+                if(release)
+                    release(*current);
+
+                current = nullptr;
+                freeSlots.signal();
+            }
+        }
+        catch(...) {
+            cancelled = true;
+            freeSlots.signal();
+
+            loadThread.join();
+            throw;
+        }
+
+        loadThread.join();
+
+        if(loadError)
+            std::rethrow_exception(loadError);
+    }
+
+    static void normalizeFused(Halide::Runtime::Buffer<float>& fuseOutput,
+                               Halide::Runtime::Buffer<uint16_t>& reference,
+                               const int numFrames,
+                               const float whiteLevel,
+                               const std::vector<float>& blackLevel,
+                               const cv::Rect& region,
+                               Halide::Runtime::Buffer<uint16_t>& output)
+    {
+        // Output is relative to the region
+        Halide::Runtime::Buffer<uint16_t> regionOutput = output;
+        
+        regionOutput.translate({ region.x, region.y });
+        
+        normalize_fuse(fuseOutput,
+                       reference,
+                       numFrames,
+                       whiteLevel,
+                       blackLevel[0],
+                       blackLevel[1],
+                       blackLevel[2],
+                       blackLevel[3],
+                       EXPANDED_RANGE,
+                       regionOutput);
+    }
+
+    //
+    // Wavelet buffers are large, keep them around so they can be reused by the next channel or tile of a burst
+    //
+    
+    class WaveletBufferPool {
+    public:
+        std::vector<WaveletBuffer> acquire(const int width, const int height) {
+            {
+                Lock lock(mMutex, "WaveletBufferPool::acquire()");
+                
+                auto it = mBuffers.find(std::make_pair(width, height));
+                
+                if(it != mBuffers.end() && !it->second.empty()) {
+                    auto result = it->second.back();
+                    it->second.pop_back();
+                    
+                    return result;
+                }
+            }
+            
+            return createWaveletBuffers(width, height);
+        }
+        
+        void clear() {
+            Lock lock(mMutex, "WaveletBufferPool::clear()");
+            
+            mBuffers.clear();
+        }
+        
+        void release(const int width, const int height, const std::vector<WaveletBuffer>& wavelet) {
+            Lock lock(mMutex, "WaveletBufferPool::release()");
+            
+            auto key = std::make_pair(width, height);
+            auto& sizePool = mBuffers[key];
+            
+            if(sizePool.size() < MAX_POOLED_BUFFERS_PER_SIZE)
+                sizePool.push_back(wavelet);
+            
+            // Drop buffers of other sizes when too many different sizes are in use
+            for(auto it = mBuffers.begin(); it != mBuffers.end() && mBuffers.size() > MAX_POOLED_SIZES;) {
+                if(it->first != key)
+                    it = mBuffers.erase(it);
+                else
+                    ++it;
+            }
+        }
+        
+    private:
+        static const size_t MAX_POOLED_BUFFERS_PER_SIZE = 4;
+        static const size_t MAX_POOLED_SIZES = 4;
+        
+        std::recursive_mutex mMutex;
+        std::map<std::pair<int, int>, std::vector<std::vector<WaveletBuffer>>> mBuffers;
+    };
+
+    static void forwardTransform(Halide::Runtime::Buffer<uint16_t>& input, const int channel, std::vector<WaveletBuffer>& wavelet) {
+        forward_transform(input,
+                          input.width(),
+                          input.height(),
+                          channel,
+                          wavelet[0],
+                          wavelet[1],
+                          wavelet[2],
+                          wavelet[3]);
+    }
+
+    static void measureWaveletNoise(std::vector<WaveletBuffer>& wavelet,
+                                    const cv::Rect& region,
+                                    float& outNoiseSigma,
+                                    float& outSignal)
+    {
+        int offset = wavelet[0].stride(2);
+
+        cv::Mat ll(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + 4);
+        cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
+        
+        cv::Mat hhRegion = hh(region);
+        
+        outNoiseSigma = estimateNoise(hhRegion);
+        outSignal = static_cast<float>(cv::mean(ll(region))[0]);
+    }
+
+    //
+    // Wavelet denoise all four channels concurrently. When noiseSigma is empty, the noise of each channel is estimated
+    // from its first wavelet level.
+    //
+    
+    static void waveletDenoise(WaveletBufferPool& pool,
+                               Halide::Runtime::Buffer<uint16_t>& input,
+                               Halide::Runtime::Buffer<float>& weightsBuffer,
+                               const float strength,
+                               std::vector<float>& noiseSigma,
+                               std::vector<float>& outSignal,
+                               std::vector<Halide::Runtime::Buffer<uint16_t>>& outDenoised)
+    {
+        const bool estimate = noiseSigma.empty();
+        
+        if(estimate)
+            noiseSigma.resize(4);
+        
+        outSignal.resize(4);
+        outDenoised.resize(4);
+        
+        cv::parallel_for_(cv::Range(0, 4), [&](const cv::Range& range) {
+            auto wavelet = pool.acquire(input.width(), input.height());
+            
+            for(int c = range.start; c < range.end; c++) {
+                forwardTransform(input, c, wavelet);
+                
+                float sigma, signal;
+                
+                measureWaveletNoise(wavelet, cv::Rect(0, 0, wavelet[0].width(), wavelet[0].height()), sigma, signal);
+                
+                if(estimate)
+                    noiseSigma[c] = sigma;
+                
+                outSignal[c] = signal;
+                outDenoised[c] = Halide::Runtime::Buffer<uint16_t>(input.width(), input.height());
+
+                inverse_transform(wavelet[0],
+                                  wavelet[1],
+                                  wavelet[2],
+                                  wavelet[3],
+                                  strength * noiseSigma[c],
+                                  false,
+                                  weightsBuffer,
+                                  outDenoised[c]);
+            }
+            
+            pool.release(input.width(), input.height(), wavelet);
+        });
+    }
+
+    //
+    // Measures the noise of each tile of a normalised band. The noise is estimated over the whole image so tiles
+    // are only denoised once every band has been fused.
+    //
+
+    static void measureBandNoise(WaveletBufferPool& pool,
+                                 Halide::Runtime::Buffer<uint16_t>& normalized,
+                                 const FuseBand& band,
+                                 std::vector<std::vector<float>>& tileNoise,
+                                 std::vector<double>& signalSum,
+                                 double& signalArea)
+    {
+        for(auto& tile : band.tiles) {
+            Halide::Runtime::Buffer<uint16_t> tileInput(tile.inner.width, tile.inner.height, 4);
+            
+            tileInput.set_min(tile.inner.x, tile.inner.y, 0);
+            tileInput.copy_from(normalized);
+            tileInput.set_min(0, 0, 0);
+            
+            float noiseSigma[4], signal[4];
+
+            cv::parallel_for_(cv::Range(0, 4), [&](const cv::Range& range) {
+                auto wavelet = pool.acquire(tileInput.width(), tileInput.height());
+                
+                for(int c = range.start; c < range.end; c++) {
+                    forwardTransform(tileInput, c, wavelet);
+                    measureWaveletNoise(wavelet, cv::Rect(0, 0, wavelet[0].width(), wavelet[0].height()), noiseSigma[c], signal[c]);
+                }
+                
+                pool.release(tileInput.width(), tileInput.height(), wavelet);
+            });
+            
+            // Area of the tile at the first wavelet level
+            const double area = tile.inner.area() / 4.0;
+            
+            for(int c = 0; c < 4; c++) {
+                tileNoise[c].push_back(noiseSigma[c]);
+                signalSum[c] += signal[c] * area;
+            }
+            
+            signalArea += area;
+        }
+    }
+
+    //
+    // Denoises the normalised image in place one band at a time. The rows above a band have already been denoised
+    // by the time it is processed, so they are taken from the input of the previous band.
+    //
+
+    static void denoiseBands(WaveletBufferPool& pool,
+                             const std::vector<FuseBand>& bands,
+                             Halide::Runtime::Buffer<float>& weightsBuffer,
+                             const float strength,
+                             std::vector<float>& noiseSigma,
+                             std::vector<Halide::Runtime::Buffer<uint16_t>>& image)
+    {
+        Halide::Runtime::Buffer<uint16_t> previousInput;
+        
+        for(auto& band : bands) {
+            const cv::Rect& outer = band.region.outer;
+            
+            Halide::Runtime::Buffer<uint16_t> bandInput(outer.width, outer.height, 4);
+            
+            bandInput.set_min(outer.x, outer.y, 0);
+            
+            for(int c = 0; c < 4; c++)
+                bandInput.sliced(2, c).copy_from(image[c]);
+            
+            if(previousInput.defined())
+                bandInput.copy_from(previousInput);
+            
+            for(auto& tile : band.tiles) {
+                Halide::Runtime::Buffer<uint16_t> tileInput(tile.outer.width, tile.outer.height, 4);
+                
+                tileInput.set_min(tile.outer.x, tile.outer.y, 0);
+                tileInput.copy_from(bandInput);
+                tileInput.set_min(0, 0, 0);
+                
+                std::vector<float> tileSignal;
+                std::vector<Halide::Runtime::Buffer<uint16_t>> tileOutput;
+                
+                waveletDenoise(pool, tileInput, weightsBuffer, strength, noiseSigma, tileSignal, tileOutput);
+                
+                // Only keep the inner region
+                for(int c = 0; c < 4; c++) {
+                    tileOutput[c].translate({ tile.outer.x, tile.outer.y });
+                    
+                    image[c]
+                        .cropped({ {tile.inner.x, tile.inner.width}, {tile.inner.y, tile.inner.height} })
+                        .copy_from(tileOutput[c]);
+                }
+            }
+            
+            previousInput = bandInput;
+        }
+    }
+
+    //
+    // Decides which frames are fused when merging adaptively. The reference counts as one frame. Frames are
+    // judged against the frame next to the reference, so whether a frame is used does not depend on the ones
+    // before it.
+    //
+
+    class MergeDecision {
+    public:
+        MergeDecision(const BurstFuserConfig& config, const float referenceSnr) :
+            mConfig(config),
+            mReferenceSnr(referenceSnr),
+            mBaselineError(-1.0f),
+            mEffectiveFrames(1.0f)
+        {
+        }
+        
+        bool accept(const size_t index, const float alignmentError) {
+            if(index == 0 || mBaselineError < 0)
+                mBaselineError = alignmentError;
+            
+            // Errors below one level of the preview are treated as perfectly aligned
+            return alignmentError <= mConfig.maxAlignmentError * (std::max)(1.0f, mBaselineError);
+        }
+        
+        // Returns false once more frames no longer improve the result enough
+        bool fused(const float alignmentError) {
+            // Frames with more alignment error than the baseline are merged less by the fuse filter
+            const float quality = (std::max)(1.0f, mBaselineError) / (std::max)(1.0f, alignmentError);
+            
+            mEffectiveFrames += (std::min)(1.0f, quality * quality);
+            
+            const float nextFrameGain = std::sqrt((mEffectiveFrames + 1.0f) / mEffectiveFrames) - 1.0f;
+            
+            return snr() < mConfig.targetSnr && nextFrameGain >= mConfig.minSnrGain;
+        }
+        
+        float snr() const {
+            return mReferenceSnr * std::sqrt(mEffectiveFrames);
+        }
+        
+    private:
+        const BurstFuserConfig& mConfig;
+        const float mReferenceSnr;
+        float mBaselineError;
+        float mEffectiveFrames;
+    };
+
+    //
+    // Frame sources
+    //
+
+    ContainerFrameSource::ContainerFrameSource(RawContainer& container) :
+        mContainer(container), mFrames(container.getFrames())
+    {
+    }
+
+    size_t ContainerFrameSource::size() const {
+        return mFrames.size();
+    }
+
+    std::shared_ptr<RawImageBuffer> ContainerFrameSource::loadFrame(size_t index) {
+        auto frame = mContainer.loadFrame(mFrames[index]);
+        if(!frame)
+            throw IOException("Cannot load " + mFrames[index]);
+        
+        return frame;
+    }
+
+    void ContainerFrameSource::releaseFrame(const std::shared_ptr<RawImageBuffer>& frame) {
+        frame->data->release();
+    }
+
+    BufferFrameSource::BufferFrameSource(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers) : mBuffers(buffers)
+    {
+    }
+
+    size_t BufferFrameSource::size() const {
+        return mBuffers.size();
+    }
+
+    std::shared_ptr<RawImageBuffer> BufferFrameSource::loadFrame(size_t index) {
+        return mBuffers[index];
+    }
+
+    //
+    // BurstFuser
+    //
+
+    BurstFuserConfig::BurstFuserConfig() :
+        window(0),
+        waveletStrength(1.0f),
+        alignmentMode(AlignmentMode::DENSE_FLOW),
+        patchSize(0),
+        framesInFlight(2),
+        tileSize(0),
+        tileHalo(64),
+        adaptiveMerge(false),
+        maxAlignmentError(2.0f),
+        targetSnr(150.0f),
+        minSnrGain(0.01f)
+    {
+    }
+
+    BurstFuser::BurstFuser(const RawCameraMetadata& cameraMetadata, const BurstFuserConfig& config) :
+        mCameraMetadata(cameraMetadata),
+        mConfig(config),
+        mWaveletPool(new WaveletBufferPool()),
+        mWidth(0),
+        mHeight(0),
+        mSignalAverage(0),
+        mReferenceSnr(0),
+        mPatchSize(0),
+        mFusedFrames(0)
+    {
+    }
+
+    BurstFuser::~BurstFuser() {
+    }
+
+    void BurstFuser::setReference(std::shared_ptr<RawImageBuffer> referenceRawBuffer, std::shared_ptr<RawData> reference) {
+        mReferenceMetadata = reference->metadata;
+        mWidth = reference->rawBuffer.width();
+        mHeight = reference->rawBuffer.height();
+        mFusedFrames = 0;
+        
+        // Use smaller patches in bright scenes
+        int patchSize = mConfig.patchSize;
+        
+        if(patchSize <= 0) {
+            int ev = (int) (0.5f + ImageProcessor::calcEv(mCameraMetadata, referenceRawBuffer->metadata));
+            patchSize = ev < 8 ? 16 : 8;
+        }
+
+        //
+        // Estimate noise
+        //
+        
+        std::vector<float> signal;
+        
+        NoiseModel::estimate(mCameraMetadata, *referenceRawBuffer, reference->rawBuffer, patchSize, mNoise, signal);
+        
+        mSignalAverage = std::accumulate(signal.begin(), signal.end(), 0.0f) / signal.size();
+        mSignalAverage /= mCameraMetadata.getWhiteLevel(reference->metadata);
+        
+        // Signal to noise ratio of the reference, the signal estimate is normalised to ISO 100
+        const auto& blackLevel = mCameraMetadata.getBlackLevel(reference->metadata);
+        const float isoScale = referenceRawBuffer->metadata.iso > 0 ? referenceRawBuffer->metadata.iso / 100.0f : 1.0f;
+        
+        mReferenceSnr = 0;
+        
+        for(size_t c = 0; c < signal.size() && c < mNoise.size() && c < blackLevel.size(); c++)
+            mReferenceSnr += (std::max)(0.0f, signal[c] * isoScale - blackLevel[c]) / (std::max)(1e-3f, mNoise[c]);
+        
+        mReferenceSnr /= (std::max)(static_cast<size_t>(1), signal.size());
+        
+        //
+        // Alignment
+        //
+        
+        if(mConfig.alignmentMode == AlignmentMode::DENSE_FLOW) {
+            if(!mAlignment || mPatchSize != patchSize)
+                mAlignment = std::unique_ptr<BurstAlignment>(new BurstAlignment(patchSize));
+            
+            mAlignment->setReference(reference->previewBuffer);
+            mPatchSize = patchSize;
+        }
+        
+        if(mConfig.tileSize > 0) {
+            // Each band of the reference is loaded from the RAW frame when it is fused, so the caller can release
+            // the decoded reference
+            mReference = nullptr;
+            mReferenceFrame = referenceRawBuffer;
+            mFuseOutput = Halide::Runtime::Buffer<float>();
+        }
+        else {
+            mReference = reference;
+            mReferenceFrame = nullptr;
+            
+            // Reuse the fused output if the size has not changed
+            if(mFuseOutput.width() != mWidth || mFuseOutput.height() != mHeight)
+                mFuseOutput = Halide::Runtime::Buffer<float>(mWidth, mHeight, 4);
+            
+            mFuseOutput.fill(0);
+        }
+    }
+
+    std::vector<Halide::Runtime::Buffer<uint16_t>> BurstFuser::process(BurstFrameSource& frames,
+                                                                       float* outNoise,
+                                                                       const std::function<bool()>& onFrameFused,
+                                                                       const std::function<void()>& onFuseCompleted)
+    {
+        Measure measure("BurstFuser::process()");
+        
+        if(!mReference && !mReferenceFrame)
+            throw InvalidState("Reference not set");
+        
+        if(!fuse(frames, onFrameFused)) {
+            logger::log("Fusing cancelled after " + std::to_string(mFusedFrames) + " frames");
+            
+            mReference = nullptr;
+            mReferenceFrame = nullptr;
+            mTiledOutput.clear();
+            mWaveletPool->clear();
+            
+            return {};
+        }
+        
+        if(onFuseCompleted)
+            onFuseCompleted();
+        
+        auto result = denoise(outNoise);
+        
+        // Don't need the reference or the wavelet buffers anymore
+        mReference = nullptr;
+        mReferenceFrame = nullptr;
+        mWaveletPool->clear();
+        
+        return result;
+    }
+
+    bool BurstFuser::fuse(BurstFrameSource& frames, const std::function<bool()>& onFrameFused) {
+        Halide::Runtime::Buffer<float> thresholdBuffer(&mNoise[0], 4);
+
+        const int width = mWidth;
+        const int height = mHeight;
+        const float w = 1.0f/(2.0f*sqrt(2.0f));
+        
+        // Tile alignment produces one offset per tile rather than a dense flow map
+        const bool tileAlign = mConfig.alignmentMode == AlignmentMode::TILES;
+        const int flowScale = tileAlign ? ALIGN_TILE_SIZE : 1;
+        
+        auto method = &fuse_denoise_3x3;
+        int window = mConfig.window;
+        
+        // Use a larger window when there is less light
+        if(window <= 0) {
+            if(mSignalAverage < 0.02f)
+                window = 7;
+            else if(mSignalAverage < 0.04f)
+                window = 5;
+            else
+                window = 3;
+        }
+        
+        if(window >= 7) {
+            method = tileAlign ? &fuse_denoise_tiles_7x7 : &fuse_denoise_7x7;
+        }
+        else if(window >= 5) {
+            method = tileAlign ? &fuse_denoise_tiles_5x5 : &fuse_denoise_5x5;
+        }
+        else {
+            method = tileAlign ? &fuse_denoise_tiles_3x3 : &fuse_denoise_3x3;
+        }
+        
+        // Optionally process the image in bands of overlapping tiles to bound memory use
+        const bool tiled = mConfig.tileSize > 0;
+        
+        auto alignFrame = [&](RawData& reference, RawData& current, const cv::Rect& region, cv::Mat& outFlow, cv::Scalar& outFlowMean) {
+            const auto& preview = current.previewBuffer;
+            
+            if(mConfig.alignmentMode == AlignmentMode::NONE) {
+                outFlow = cv::Mat::zeros(preview.height(), preview.width(), CV_32FC2);
+                outFlowMean = cv::Scalar(0, 0);
+            }
+            else if(tileAlign) {
+                alignTiles(reference, current, region, outFlow, outFlowMean);
+            }
+            else if(tiled) {
+                mAlignment->align(preview, region, outFlow, outFlowMean);
+            }
+            else {
+                mAlignment->align(preview, outFlow, outFlowMean);
+            }
+        };
+        
+        // Fuses the frame into the output, the flow covers the region the frame was loaded from
+        auto fuseRegion = [&](RawData& reference,
+                              RawData& current,
+                              const cv::Rect& region,
+                              const cv::Mat& flow,
+                              const cv::Scalar& flowMean,
+                              Halide::Runtime::Buffer<float>& output)
+        {
+            Halide::Runtime::Buffer<float> flowBuffer =
+                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
+            
+            flowBuffer.set_min(region.x / flowScale, region.y / flowScale, 0);
+            
+            method(
+                reference.rawBuffer,
+                current.rawBuffer,
+                output,
+                flowBuffer,
+                thresholdBuffer,
+                width,
+                height,
+                w,
+                4.0f,
+                flowMean[0],
+                flowMean[1],
+                output);
+        };
+        
+        // Frames are loaded, deinterleaved and aligned on a background thread while the previous
+        // frame is being fused. The number of loaded frames waiting to be fused is bounded.
+        const int maxFramesInFlight = (std::max)(1, mConfig.framesInFlight);
+        
+        mMergeReport.clear();
+        
+        for(size_t i = 0; i < frames.size(); i++)
+            mMergeReport.push_back(FrameMergeInfo{ i, -1.0f, false });
+        
+        MergeDecision merge(mConfig, mReferenceSnr);
+        
+        // Set once onFrameFused asks to stop
+        bool cancelled = false;
+        
+        if(!tiled) {
+            RawData& reference = *mReference;
+            const cv::Rect region(0, 0, width, height);
+            
+            loadAndProcess<FuseFrame>(frames.size(), maxFramesInFlight,
+                [&](size_t i) -> std::shared_ptr<FuseFrame> {
+                    auto fuseFrame = std::make_shared<FuseFrame>();
+                    
+                    fuseFrame->index = i;
+                    fuseFrame->frame = frames.loadFrame(i);
+                    fuseFrame->alignmentError = 0.0f;
+                    
+                    if(mConfig.region.area() > 0)
+                        fuseFrame->rawData = loadRegion(*fuseFrame->frame, mCameraMetadata, mConfig.region, region);
+                    else
+                        fuseFrame->rawData = ImageProcessor::loadRawImage(*fuseFrame->frame, mCameraMetadata);
+                    
+                    alignFrame(reference, *fuseFrame->rawData, region, fuseFrame->flow, fuseFrame->flowMean);
+                    
+                    if(mConfig.adaptiveMerge)
+                        fuseFrame->alignmentError = measureAlignmentError(reference, *fuseFrame->rawData, fuseFrame->flow, flowScale);
+                    
+                    return fuseFrame;
+                },
+                [&](FuseFrame& current) -> bool {
+                    if(mConfig.adaptiveMerge) {
+                        mMergeReport[current.index].alignmentError = current.alignmentError;
+                        
+                        if(!merge.accept(current.index, current.alignmentError))
+                            return true;
+                    }
+                    
+                    fuseRegion(reference, *current.rawData, region, current.flow, current.flowMean, mFuseOutput);
+                    
+                    ++mFusedFrames;
+                    mMergeReport[current.index].used = true;
+                    
+                    const bool next = !mConfig.adaptiveMerge || merge.fused(current.alignmentError);
+                    
+                    if(onFrameFused && !onFrameFused()) {
+                        cancelled = true;
+                        return false;
+                    }
+                    
+                    return next;
+                },
+                [&](FuseFrame& current) {
+                    frames.releaseFrame(current.frame);
+                });
+        }
+        else {
+            auto bands = createFuseBands(width, height, mConfig.tileSize, mConfig.tileHalo);
+            
+            // Frames stay loaded until the last band has used them. Frames of in memory containers can't be
+            // loaded again once released, and other containers would read and decode them once per band.
+            std::vector<std::shared_ptr<RawImageBuffer>> loadedFrames(frames.size());
+            
+            auto loadFrame = [&](size_t index) -> std::shared_ptr<RawImageBuffer> {
+                if(!loadedFrames[index])
+                    loadedFrames[index] = frames.loadFrame(index);
+                
+                return loadedFrames[index];
+            };
+            
+            auto releaseFrame = [&](size_t index) {
+                if(loadedFrames[index]) {
+                    frames.releaseFrame(loadedFrames[index]);
+                    loadedFrames[index] = nullptr;
+                }
+            };
+            
+            //
+            // Every frame is fused into each band, so the frames that are used are decided up front from the
+            // centre tile
+            //
+            
+            std::vector<size_t> plan;
+            
+            if(mConfig.adaptiveMerge) {
+                auto tiles = createFuseTiles(width, height, mConfig.tileSize, mConfig.tileHalo);
+                const auto& tile = tiles[tiles.size() / 2];
+                
+                auto referenceTile = loadRegion(*mReferenceFrame, mCameraMetadata, mConfig.region, tile.outer);
+                
+                loadAndProcess<FuseFrame>(frames.size(), maxFramesInFlight,
+                    [&](size_t i) -> std::shared_ptr<FuseFrame> {
+                        auto fuseFrame = std::make_shared<FuseFrame>();
+                        
+                        fuseFrame->index = i;
+                        fuseFrame->rawData = loadRegion(*loadFrame(i), mCameraMetadata, mConfig.region, tile.outer);
+                        
+                        alignFrame(*referenceTile, *fuseFrame->rawData, tile.outer, fuseFrame->flow, fuseFrame->flowMean);
+                        
+                        fuseFrame->alignmentError =
+                            measureAlignmentError(*referenceTile, *fuseFrame->rawData, fuseFrame->flow, flowScale);
+                        
+                        return fuseFrame;
+                    },
+                    [&](FuseFrame& current) -> bool {
+                        mMergeReport[current.index].alignmentError = current.alignmentError;
+                        
+                        if(!merge.accept(current.index, current.alignmentError))
+                            return true;
+                        
+                        plan.push_back(current.index);
+                        
+                        return merge.fused(current.alignmentError);
+                    },
+                    nullptr);
+                
+                // Keep only the frames that are fused
+                std::vector<bool> planned(frames.size(), false);
+                
+                for(auto index : plan)
+                    planned[index] = true;
+                
+                for(size_t i = 0; i < frames.size(); i++) {
+                    if(!planned[i])
+                        releaseFrame(i);
+                }
+            }
+            else {
+                for(size_t i = 0; i < frames.size(); i++)
+                    plan.push_back(i);
+            }
+            
+            //
+            // Fuse one band at a time and write the normalised result into the output
+            //
+            
+            const size_t numFrames = plan.size();
+            const size_t totalFrames = bands.size() * numFrames;
+            
+            auto whiteLevel = mCameraMetadata.getWhiteLevel(mReferenceMetadata);
+            const auto& blackLevel = mCameraMetadata.getBlackLevel(mReferenceMetadata);
+            
+            std::vector<std::vector<float>> tileNoise(4);
+            std::vector<double> signalSum(4, 0.0);
+            double signalArea = 0.0;
+            
+            mTiledOutput.clear();
+            
+            for(int c = 0; c < 4; c++)
+                mTiledOutput.emplace_back(width, height);
+            
+            auto finishBand = [&](const FuseBand& band, RawData& reference, Halide::Runtime::Buffer<float>& accumulator) {
+                const cv::Rect& inner = band.region.inner;
+                
+                Halide::Runtime::Buffer<uint16_t> normalized(inner.width, inner.height, 4);
+                
+                normalizeFused(accumulator, reference.rawBuffer, static_cast<int>(numFrames), whiteLevel, blackLevel, inner, normalized);
+                
+                normalized.set_min(inner.x, inner.y, 0);
+                
+                measureBandNoise(*mWaveletPool, normalized, band, tileNoise, signalSum, signalArea);
+                
+                for(int c = 0; c < 4; c++)
+                    mTiledOutput[c].copy_from(normalized.sliced(2, c));
+            };
+            
+            if(numFrames == 0) {
+                for(auto& band : bands) {
+                    auto reference = loadRegion(*mReferenceFrame, mCameraMetadata, mConfig.region, band.region.outer);
+                    auto accumulator = createAccumulator(band.region.inner);
+                    
+                    finishBand(band, *reference, accumulator);
+                }
+            }
+            else {
+                // Part of the reference the load thread is aligning against
+                std::shared_ptr<RawData> bandReference;
+                
+                Halide::Runtime::Buffer<float> accumulator;
+                size_t fused = 0;
+                
+                loadAndProcess<FuseFrame>(totalFrames, maxFramesInFlight,
+                    [&](size_t i) -> std::shared_ptr<FuseFrame> {
+                        const size_t band = i / numFrames;
+                        const cv::Rect& region = bands[band].region.outer;
+                        
+                        if(i % numFrames == 0)
+                            bandReference = loadRegion(*mReferenceFrame, mCameraMetadata, mConfig.region, region);
+                        
+                        auto fuseFrame = std::make_shared<FuseFrame>();
+                        
+                        fuseFrame->index = plan[i % numFrames];
+                        fuseFrame->band = band;
+                        fuseFrame->reference = bandReference;
+                        fuseFrame->alignmentError = 0.0f;
+                        
+                        fuseFrame->rawData = loadRegion(*loadFrame(fuseFrame->index), mCameraMetadata, mConfig.region, region);
+                        
+                        // The RAW frame is not needed once the last band has been loaded from it
+                        if(band == bands.size() - 1)
+                            releaseFrame(fuseFrame->index);
+                        
+                        alignFrame(*fuseFrame->reference, *fuseFrame->rawData, region, fuseFrame->flow, fuseFrame->flowMean);
+                        
+                        return fuseFrame;
+                    },
+                    [&](FuseFrame& current) -> bool {
+                        const auto& band = bands[current.band];
+                        
+                        if(fused % numFrames == 0)
+                            accumulator = createAccumulator(band.region.inner);
+                        
+                        // Only the inner region is fused, the halo is there to give the alignment and filters context
+                        fuseRegion(*current.reference, *current.rawData, band.region.outer, current.flow, current.flowMean, accumulator);
+                        
+                        ++fused;
+                        
+                        // Progress is reported once per frame, spread evenly over the bands
+                        while(static_cast<size_t>(mFusedFrames) < fused / bands.size()) {
+                            ++mFusedFrames;
+                            
+                            if(onFrameFused && !onFrameFused()) {
+                                cancelled = true;
+                                return false;
+                            }
+                        }
+                        
+                        if(fused % numFrames == 0) {
+                            finishBand(band, *current.reference, accumulator);
+                            accumulator = Halide::Runtime::Buffer<float>();
+                        }
+                        
+                        return true;
+                    },
+                    nullptr);
+                
+                for(auto index : plan)
+                    mMergeReport[index].used = true;
+            }
+            
+            for(size_t i = 0; i < frames.size(); i++)
+                releaseFrame(i);
+            
+            if(cancelled)
+                return false;
+            
+            mTiledNoise.clear();
+            mTiledSignal.clear();
+            
+            for(int c = 0; c < 4; c++) {
+                mTiledNoise.push_back(findMedian(tileNoise[c]));
+                mTiledSignal.push_back(static_cast<float>(signalSum[c] / (std::max)(1.0, signalArea)));
+            }
+        }
+        
+        if(cancelled)
+            return false;
+        
+        if(mConfig.adaptiveMerge) {
+            logger::log("Fused " + std::to_string(mFusedFrames) + " of " + std::to_string(frames.size()) + " frames" +
+                        " (estimated SNR " + std::to_string(merge.snr()) + ")");
+        }
+        
+        return true;
+    }
+
+    std::vector<Halide::Runtime::Buffer<uint16_t>> BurstFuser::snapshot() {
+        if(!mReference && !mReferenceFrame)
+            throw InvalidState("Reference not set");
+        
+        auto whiteLevel = mCameraMetadata.getWhiteLevel(mReferenceMetadata);
+        const auto& blackLevel = mCameraMetadata.getBlackLevel(mReferenceMetadata);
+        
+        Halide::Runtime::Buffer<uint16_t> normalized(mWidth, mHeight, 4);
+        
+        if(mReferenceFrame) {
+            // Each band is finished with every frame before the next one is started
+            if(mFusedFrames > 0)
+                throw InvalidState("No snapshot of a tiled fusion in progress");
+            
+            for(auto& band : createFuseBands(mWidth, mHeight, mConfig.tileSize, mConfig.tileHalo)) {
+                const cv::Rect& inner = band.region.inner;
+                
+                auto reference = loadRegion(*mReferenceFrame, mCameraMetadata, mConfig.region, band.region.outer);
+                auto accumulator = createAccumulator(inner);
+                
+                Halide::Runtime::Buffer<uint16_t> bandOutput(inner.width, inner.height, 4);
+                
+                normalizeFused(accumulator, reference->rawBuffer, 0, whiteLevel, blackLevel, inner, bandOutput);
+                
+                bandOutput.set_min(inner.x, inner.y, 0);
+                normalized.copy_from(bandOutput);
+            }
+        }
+        else {
+            normalizeFused(mFuseOutput, mReference->rawBuffer, mFusedFrames, whiteLevel, blackLevel, cv::Rect(0, 0, mWidth, mHeight), normalized);
+        }
+        
+        std::vector<Halide::Runtime::Buffer<uint16_t>> result;
+        
+        for(int c = 0; c < 4; c++)
+            result.push_back(normalized.sliced(2, c));
+        
+        return result;
+    }
+
+    size_t BurstFuser::estimateMemory(const int width,
+                                      const int height,
+                                      const size_t frameBytes,
+                                      const size_t numFrames,
+                                      const BurstFuserConfig& config)
+    {
+        // Four channels of the bayer data and one channel of the preview
+        const size_t rawDataBytesPerPixel = 4 * sizeof(uint16_t) + 1;
+        const size_t flowBytesPerPixel = 2 * sizeof(float);
+        
+        // Channels are denoised concurrently, each with its own wavelet buffers
+        const size_t waveletSets = 4;
+        
+        const size_t pixels = static_cast<size_t>(width) * height;
+        const size_t fuseOutputBytes = pixels * 4 * sizeof(float);
+        const size_t denoiseOutputBytes = pixels * 4 * sizeof(uint16_t);
+        
+        // Frames waiting to be fused and the one being fused
+        const size_t frames = (std::max)(1, config.framesInFlight) + 1;
+        
+        size_t fuseBytes, denoiseBytes;
+        
+        if(config.tileSize > 0) {
+            auto bands = createFuseBands(width, height, config.tileSize, config.tileHalo);
+            
+            cv::Rect largestBand, largestTile;
+            
+            for(auto& band : bands) {
+                if(band.region.outer.area() > largestBand.area())
+                    largestBand = band.region.outer;
+                
+                for(auto& tile : band.tiles) {
+                    if(tile.outer.area() > largestTile.area())
+                        largestTile = tile.outer;
+                }
+            }
+            
+            const size_t bandPixels = static_cast<size_t>(largestBand.area());
+            const size_t tilePixels = static_cast<size_t>(largestTile.area());
+            
+            // The RAW reference and frames, which stay loaded until the last band, the parts of the reference and
+            // frames loaded for the band, and the band accumulator and its normalised result
+            fuseBytes = denoiseOutputBytes +
+                        (numFrames + 1) * frameBytes +
+                        (frames + 2) * bandPixels * (rawDataBytesPerPixel + flowBytesPerPixel) +
+                        bandPixels * 4 * (sizeof(float) + sizeof(uint16_t));
+            
+            // Inputs of the current and previous band, and the tile being denoised
+            denoiseBytes = denoiseOutputBytes +
+                           frameBytes +
+                           2 * bandPixels * 4 * sizeof(uint16_t) +
+                           2 * tilePixels * 4 * sizeof(uint16_t) +
+                           waveletSets * waveletBufferBytes(largestTile.width, largestTile.height);
+        }
+        else {
+            fuseBytes = fuseOutputBytes +
+                        frames * (frameBytes + pixels * (rawDataBytesPerPixel + flowBytesPerPixel));
+            
+            denoiseBytes = fuseOutputBytes +
+                           2 * denoiseOutputBytes +
+                           waveletSets * waveletBufferBytes(width, height);
+        }
+        
+        return (std::max)(fuseBytes, denoiseBytes);
+    }
+
+    std::vector<Halide::Runtime::Buffer<uint16_t>> BurstFuser::denoise(float* outNoise) {
+        std::vector<float> weights = mConfig.weights;
+        
+        if(weights.empty())
+            weights = ImageProcessor::estimateDenoiseWeights(mSignalAverage);
+        
+        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
+
+        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
+        std::vector<float> normalisedNoise;
+
+        if(mConfig.tileSize > 0) {
+            auto bands = createFuseBands(mWidth, mHeight, mConfig.tileSize, mConfig.tileHalo);
+            std::vector<float> noiseSigma = mTiledNoise;
+            
+            // The fused bands have already been normalised into the output
+            denoiseBands(*mWaveletPool, bands, weightsBuffer, mConfig.waveletStrength, noiseSigma, mTiledOutput);
+            
+            for(int c = 0; c < 4; c++)
+                normalisedNoise.push_back(mTiledNoise[c] / (1e-5f + mTiledSignal[c]));
+            
+            denoiseOutput.swap(mTiledOutput);
+        }
+        else {
+            auto whiteLevel = mCameraMetadata.getWhiteLevel(mReferenceMetadata);
+            const auto& blackLevel = mCameraMetadata.getBlackLevel(mReferenceMetadata);
+            
+            Halide::Runtime::Buffer<uint16_t> denoiseInput(mWidth, mHeight, 4);
+            
+            normalizeFused(mFuseOutput, mReference->rawBuffer, mFusedFrames, whiteLevel, blackLevel, cv::Rect(0, 0, mWidth, mHeight), denoiseInput);
+            
+            std::vector<float> noiseSigma, waveletSignal;
+            
+            waveletDenoise(*mWaveletPool, denoiseInput, weightsBuffer, mConfig.waveletStrength, noiseSigma, waveletSignal, denoiseOutput);
+            
+            for(int c = 0; c < 4; c++)
+                normalisedNoise.push_back(noiseSigma[c] / (1e-5f + waveletSignal[c]));
+        }
+        
+        if(outNoise)
+            *outNoise = *std::max_element(normalisedNoise.begin(), normalisedNoise.end());
+        
+        return denoiseOutput;
+    }
+}
@@ -0,0 +1,82 @@
+#include "motioncam/DecodedFrameStore.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/Settings.h"
+#include "motioncam/Lock.h"
+
+#include <json11/json11.hpp>
+
+namespace motioncam {
+
+    DecodedFrameStore::DecodedFrameStore(const RawCameraMetadata& cameraMetadata) : mCameraMetadata(cameraMetadata) {
+    }
+
+    std::shared_ptr<RawData> DecodedFrameStore::rawData(const RawImageBuffer& frame, const bool extendEdges, const float scalePreview) {
+        Lock lock(mMutex, "DecodedFrameStore::rawData()");
+
+        auto key = std::make_tuple(&frame, extendEdges, scalePreview);
+        auto it = mRawData.find(key);
+
+        if(it != mRawData.end())
+            return it->second;
+
+        auto result = ImageProcessor::loadRawImage(frame, mCameraMetadata, extendEdges, scalePreview);
+
+        mRawData[key] = result;
+
+        return result;
+    }
+
+    Halide::Runtime::Buffer<uint8_t> DecodedFrameStore::preview(const RawImageBuffer& frame,
+                                                                const int downscaleFactor,
+                                                                const PostProcessSettings& settings)
+    {
+        Lock lock(mMutex, "DecodedFrameStore::preview()");
+
+        // Previews are only shared when created with the same settings
+        std::map<std::string, json11::Json> settingsJson;
+        settings.toJson(settingsJson);
+
+        auto key = std::make_tuple(&frame, downscaleFactor, json11::Json(settingsJson).dump());
+        auto it = mPreviews.find(key);
+
+        if(it != mPreviews.end())
+            return it->second;
+
+        auto result = ImageProcessor::createPreview(frame, downscaleFactor, mCameraMetadata, settings);
+
+        mPreviews[key] = result;
+
+        return result;
+    }
+
+    void DecodedFrameStore::release(const RawImageBuffer& frame) {
+        Lock lock(mMutex, "DecodedFrameStore::release()");
+
+        for(auto it = mRawData.begin(); it != mRawData.end();) {
+            if(std::get<0>(it->first) == &frame)
+                it = mRawData.erase(it);
+            else
+                ++it;
+        }
+
+        for(auto it = mPreviews.begin(); it != mPreviews.end();) {
+            if(std::get<0>(it->first) == &frame)
+                it = mPreviews.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void DecodedFrameStore::releasePreviews() {
+        Lock lock(mMutex, "DecodedFrameStore::releasePreviews()");
+
+        mPreviews.clear();
+    }
+
+    void DecodedFrameStore::clear() {
+        Lock lock(mMutex, "DecodedFrameStore::clear()");
+
+        mRawData.clear();
+        mPreviews.clear();
+    }
+}
@@ -0,0 +1,241 @@
+#include "motioncam/HalideAllocator.h"
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+
+#include <HalideRuntime.h>
+
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sys/mman.h>
+#endif
+
+namespace motioncam {
+    // Alignment Halide expects from halide_malloc
+    const size_t BLOCK_ALIGNMENT    = 128;
+    const size_t MIN_BLOCK_SIZE     = 4096;
+    const size_t HUGE_PAGE_SIZE     = 2 * 1024 * 1024;
+
+    HalideAllocatorConfig::HalideAllocatorConfig() :
+        maxCachedBytes(256 * 1024 * 1024),
+        hugePages(false),
+        hugePageThreshold(4 * 1024 * 1024)
+    {
+    }
+
+    namespace {
+        // Stored in front of every block returned to Halide
+        struct BlockHeader {
+            void* base;
+            size_t size;
+        };
+
+        struct AllocatorState {
+            AllocatorState() : cachedBytes(0) {
+                resetStats();
+            }
+
+            void resetStats() {
+                stats.allocations = 0;
+                stats.reused = 0;
+                stats.peakAllocatedBytes = stats.allocatedBytes;
+            }
+
+            // Not a recursive lock, this is called for every scratch buffer of every pipeline
+            std::mutex mutex;
+
+            HalideAllocatorConfig config;
+            HalideAllocatorStats stats {};
+
+            std::map<size_t, std::vector<void*>> freeBlocks;
+            size_t cachedBytes;
+        };
+
+        std::atomic<bool> allocatorInstalled(false);
+
+        AllocatorState& state() {
+            // Never destroyed, Halide may still free blocks while static objects are destroyed
+            static AllocatorState* s = new AllocatorState();
+            return *s;
+        }
+
+        // Four size classes per power of two so at most a quarter of a block is wasted
+        size_t sizeClass(size_t size) {
+            if(size <= MIN_BLOCK_SIZE)
+                return MIN_BLOCK_SIZE;
+
+            size_t p = MIN_BLOCK_SIZE;
+            while(p < size)
+                p <<= 1;
+
+            const size_t step = p / 8;
+
+            return ((size + step - 1) / step) * step;
+        }
+
+        void* createBlock(size_t size, const HalideAllocatorConfig& config) {
+            const size_t totalSize = size + BLOCK_ALIGNMENT;
+            void* base = nullptr;
+
+#if defined(__linux__) || defined(__ANDROID__)
+            if(config.hugePages && size >= config.hugePageThreshold) {
+                if(posix_memalign(&base, HUGE_PAGE_SIZE, totalSize) != 0)
+                    base = nullptr;
+                else
+                    madvise(base, totalSize, MADV_HUGEPAGE);
+            }
+#endif
+
+            if(!base)
+                base = std::malloc(totalSize);
+
+            if(!base)
+                return nullptr;
+
+            // Leave room for the header in front of the aligned block
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(base) + sizeof(BlockHeader) + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1);
+
+            void* block = reinterpret_cast<void*>(aligned);
+            BlockHeader* header = reinterpret_cast<BlockHeader*>(block) - 1;
+
+            header->base = base;
+            header->size = size;
+
+            return block;
+        }
+
+        void destroyBlock(void* block) {
+            BlockHeader* header = reinterpret_cast<BlockHeader*>(block) - 1;
+            std::free(header->base);
+        }
+
+        void trimLocked(AllocatorState& s) {
+            for(auto& sizeBlocks : s.freeBlocks) {
+                for(auto block : sizeBlocks.second)
+                    destroyBlock(block);
+            }
+
+            s.freeBlocks.clear();
+            s.cachedBytes = 0;
+        }
+
+        void* allocate(void* userContext, size_t size) {
+            auto& s = state();
+            const size_t blockSize = sizeClass(size);
+
+            void* block = nullptr;
+            HalideAllocatorConfig config;
+
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+
+                s.stats.allocations++;
+
+                auto it = s.freeBlocks.find(blockSize);
+                if(it != s.freeBlocks.end() && !it->second.empty()) {
+                    block = it->second.back();
+                    it->second.pop_back();
+
+                    s.cachedBytes -= blockSize;
+                    s.stats.reused++;
+                }
+
+                s.stats.allocatedBytes += blockSize;
+                s.stats.peakAllocatedBytes = (std::max)(s.stats.peakAllocatedBytes, s.stats.allocatedBytes);
+                s.stats.cachedBytes = s.cachedBytes;
+
+                config = s.config;
+            }
+
+            if(block)
+                return block;
+
+            // Allocate outside of the lock
+            block = createBlock(blockSize, config);
+
+            if(!block) {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.stats.allocatedBytes -= blockSize;
+            }
+
+            return block;
+        }
+
+        void release(void* userContext, void* block) {
+            if(!block)
+                return;
+
+            auto& s = state();
+            const size_t blockSize = (reinterpret_cast<BlockHeader*>(block) - 1)->size;
+
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+
+                s.stats.allocatedBytes -= blockSize;
+
+                if(s.cachedBytes + blockSize <= s.config.maxCachedBytes) {
+                    s.freeBlocks[blockSize].push_back(block);
+                    s.cachedBytes += blockSize;
+                    s.stats.cachedBytes = s.cachedBytes;
+
+                    return;
+                }
+            }
+
+            destroyBlock(block);
+        }
+    }
+
+    void HalideAllocator::install(const HalideAllocatorConfig& config) {
+        static std::once_flag installed;
+
+        // Installed once before any pipeline runs. Swapping the allocator later would let blocks from the default
+        // halide_malloc reach release(), which expects a BlockHeader in front of them.
+        std::call_once(installed, [&]() {
+            auto& s = state();
+
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.config = config;
+            }
+
+            halide_set_custom_malloc(&allocate);
+            halide_set_custom_free(&release);
+
+            allocatorInstalled = true;
+        });
+    }
+
+    bool HalideAllocator::installed() {
+        return allocatorInstalled;
+    }
+
+    void HalideAllocator::trim() {
+        auto& s = state();
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        trimLocked(s);
+        s.stats.cachedBytes = 0;
+    }
+
+    HalideAllocatorStats HalideAllocator::stats() {
+        auto& s = state();
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        return s.stats;
+    }
+
+    void HalideAllocator::resetStats() {
+        auto& s = state();
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        s.resetStats();
+    }
+}
@@ -8,23 +8,23 @@
 #include "motioncam/Measure.h"
 #include "motioncam/Settings.h"
 #include "motioncam/ImageOps.h"
-#include "motioncam/BlueNoiseLUT.h"
 #include "motioncam/FaceClassifier.h"
 #include "motioncam/RawBufferStreamer.h"
 #include "motioncam/RawImageBuffer.h"
 #include "motioncam/RawCameraMetadata.h"
+#include "motioncam/BurstFuser.h"
+#include "motioncam/ImageRegistration.h"
+#include "motioncam/DecodedFrameStore.h"
+#include "motioncam/ResourceCache.h"
+#include "motioncam/HalideAllocator.h"
+#include "motioncam/OutputWriter.h"
 
 // Halide
 #include "generate_stats.h"
 #include "generate_edges.h"
 #include "measure_image.h"
 #include "deinterleave_raw.h"
-#include "forward_transform.h"
-#include "inverse_transform.h"
 #include "fuse_image.h"
-#include "fuse_denoise_3x3.h"
-#include "fuse_denoise_5x5.h"
-#include "fuse_denoise_7x7.h"
 #include "fast_preview.h"
 #include "fast_preview2.h"
 #include "measure_noise.h"
@@ -46,12 +46,24 @@
 #include "preview_reverse_landscape8.h"
 
 #include "postprocess.h"
+#include "postprocess_binned.h"
+#include "postprocess_large.h"
+#include "postprocess_tiles.h"
+#include "postprocess_binned_tiles.h"
+#include "postprocess_large_tiles.h"
+#include "postprocess_coarse.h"
 
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <memory>
 #include <numeric>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <exception>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <exiv2/exiv2.hpp>
@@ -92,24 +104,51 @@ extern "C" int extern_defringe(halide_buffer_t *in, int32_t width, int32_t heigh
     return 0;
 }
 
-static std::vector<Halide::Runtime::Buffer<float>> createWaveletBuffers(int width, int height) {
-    std::vector<Halide::Runtime::Buffer<float>> buffers;
-    
-    for(int level = 0; level < motioncam::WAVELET_LEVELS; level++) {
-        width = width / 2;
-        height = height / 2;
-        
-        buffers.emplace_back(width, height, 4, 4);
-    }
-    
-    return buffers;
-}
-
 namespace motioncam {
     const float MAX_HDR_ERROR           = 0.0001f;
+    const float MIN_HDR_REGISTRATION_CONFIDENCE = 0.2f;
     const float SHADOW_BIAS             = 6.0f;
 
-    typedef Halide::Runtime::Buffer<float> WaveletBuffer;
+    // Context around a region of interest used by the alignment and filters
+    const int ROI_HALO                      = 64;
+
+    // Tile sizes tried when the memory budget is exceeded
+    const int MEMORY_BUDGET_TILE_SIZE       = 512;
+    const int MIN_MEMORY_BUDGET_TILE_SIZE   = 128;
+
+    // Post process tile size used when the memory budget is set
+    const int MEMORY_BUDGET_POSTPROCESS_TILE_SIZE = 1024;
+
+    // Radius of the guided filter in the postprocess generator, in output pixels
+    const int POSTPROCESS_FILTER_RADIUS     = 51;
+
+    // Size of the coarse tonemap pixels in bayer channel pixels (COARSE_TONEMAP_LEVEL of the generators). The
+    // coarse tonemap levels are computed once per image, tiles only build the finer levels.
+    const int COARSE_TONEMAP_SCALE          = 64;
+
+    // Tiles processed at the same time. Each pipeline call is already parallel.
+    const int POSTPROCESS_TILE_THREADS      = 2;
+
+    typedef decltype(&postprocess) PostProcessFunc;
+
+    struct PostProcessVariant {
+        // Largest full frame output of the resolution class, in pixels
+        int maxPixels;
+        PostProcessFunc func;
+
+        // Reads the coarse tonemap levels shared by the tiles of an image
+        PostProcessFunc tilesFunc;
+    };
+
+    // Variant per resolution class of generators/tune.sh. These are untuned defaults, the large variant is assumed
+    // to pay off from 50mp; replace them with what tune.sh reports on the target devices. A class covers the output
+    // sizes up to halfway to the next one.
+    const PostProcessVariant POSTPROCESS_VARIANTS[] = {
+        { 6500 * 1000,                          &postprocess,       &postprocess_tiles },         // crop, 1024x768
+        { 31 * 1000 * 1000,                     &postprocess,       &postprocess_tiles },         // 12mp, 4032x3024
+        { 125 * 1000 * 1000,                    &postprocess_large, &postprocess_large_tiles },   // 50mp, 8160x6120
+        { std::numeric_limits<int>::max(),      &postprocess_large, &postprocess_large_tiles }    // 200mp, 16320x12240
+    };
 
     struct HdrMetadata {
         float exposureScale;
@@ -215,29 +254,37 @@ namespace motioncam {
     };
 
     ImageProgressHelper::ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start) :
-        mStart(start), mProgressListener(progressListener), mNumImages(numImages), mCurImage(0)
+        mStart(start), mProgressListener(progressListener), mNumImages(numImages), mCurImage(0), mCancelled(false)
     {
         // Per fused image increment is numImages over a 75% progress amount.
         mPerImageIncrement = 75.0 / numImages;
     }
     
+    void ImageProgressHelper::update(int progress) {
+        if(!mProgressListener.onProgressUpdate(progress))
+            mCancelled = true;
+    }
+    
     void ImageProgressHelper::postProcessCompleted() {
-        mProgressListener.onProgressUpdate(mStart + 95);
+        update(mStart + 95);
     }
     
     void ImageProgressHelper::denoiseCompleted() {
         // Starting point is mStart, denoising takes 50%, progress should now be mStart + 50%
-        mProgressListener.onProgressUpdate(mStart + 75);
+        update(mStart + 75);
     }
 
     void ImageProgressHelper::nextFusedImage() {
         ++mCurImage;
-        mProgressListener.onProgressUpdate(static_cast<int>(mStart + (mPerImageIncrement * mCurImage)));
+        update(static_cast<int>(mStart + (mPerImageIncrement * mCurImage)));
     }
 
-    void ImageProgressHelper::imageSaved() {
-        mProgressListener.onProgressUpdate(100);
-        mProgressListener.onCompleted();
+    void ImageProgressHelper::fuseCompleted() {
+        if(mCurImage >= mNumImages)
+            return;
+        
+        mCurImage = mNumImages;
+        update(static_cast<int>(mStart + (mPerImageIncrement * mCurImage)));
     }
 
     double ImageProcessor::calcEv(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata) {
@@ -305,6 +352,199 @@ namespace motioncam {
 //        }
 //    }
 
+    //
+    // Halves the size of the HDR input and mask to match the binned output
+    //
+
+    static std::shared_ptr<HdrMetadata> binHdrMetadata(const HdrMetadata& hdrMetadata) {
+        auto result = std::make_shared<HdrMetadata>(hdrMetadata);
+        
+        const auto& hdrInput = hdrMetadata.hdrInput;
+        const auto& hdrMask = hdrMetadata.hdrMask;
+        
+        result->hdrInput = Halide::Runtime::Buffer<uint16_t>(hdrInput.width() / 2, hdrInput.height() / 2, 3);
+        result->hdrMask = Halide::Runtime::Buffer<uint8_t>(hdrMask.width() / 2, hdrMask.height() / 2);
+        
+        for(int c = 0; c < 3; c++) {
+            cv::Mat input(hdrInput.height(), hdrInput.width(), CV_16U, (void*) (hdrInput.data() + c*hdrInput.stride(2)), hdrInput.stride(1) * sizeof(uint16_t));
+            cv::Mat output(result->hdrInput.height(), result->hdrInput.width(), CV_16U, result->hdrInput.data() + c*result->hdrInput.stride(2));
+            
+            cv::resize(input, output, output.size(), 0, 0, cv::INTER_AREA);
+        }
+        
+        cv::Mat mask(hdrMask.height(), hdrMask.width(), CV_8U, (void*) hdrMask.data(), hdrMask.stride(1));
+        cv::Mat binnedMask(result->hdrMask.height(), result->hdrMask.width(), CV_8U, result->hdrMask.data());
+        
+        cv::resize(mask, binnedMask, binnedMask.size(), 0, 0, cv::INTER_AREA);
+        
+        return result;
+    }
+
+    //
+    // Resamples the shading map so it covers a region of an image instead of the whole image
+    //
+
+    static std::vector<cv::Mat> cropShadingMap(const std::vector<cv::Mat>& shadingMap, const cv::Size& imageSize, const cv::Rect& region) {
+        std::vector<cv::Mat> result;
+        
+        for(const auto& m : shadingMap) {
+            const double scaleX = m.cols / static_cast<double>(imageSize.width);
+            const double scaleY = m.rows / static_cast<double>(imageSize.height);
+            
+            const double sx = region.width * scaleX / m.cols;
+            const double sy = region.height * scaleY / m.rows;
+            
+            // Maps output pixel centres to the input
+            cv::Mat transform = (cv::Mat_<double>(2, 3) <<
+                sx, 0, region.x * scaleX + 0.5 * sx - 0.5,
+                0, sy, region.y * scaleY + 0.5 * sy - 0.5);
+            
+            cv::Mat cropped;
+            
+            cv::warpAffine(m, cropped, transform, m.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+            
+            result.push_back(cropped);
+        }
+        
+        return result;
+    }
+
+    //
+    // Post process tiles
+    //
+
+    struct PostProcessTile {
+        // Region written to the output, in input plane coordinates
+        cv::Rect inner;
+        
+        // Region processed, including the halo
+        cv::Rect outer;
+    };
+
+    static int postProcessHalo(int outputScale, int T) {
+        // Input plane pixels needed by the guided filter and the tonemap levels built per tile
+        const int filterHalo = (POSTPROCESS_FILTER_RADIUS + outputScale - 1) / outputScale;
+        const int pyramidHalo = 2 * COARSE_TONEMAP_SCALE;
+        
+        const int halo = (std::max)(filterHalo, pyramidHalo);
+        
+        return T * static_cast<int>(ceil(halo / (double) T));
+    }
+
+    // Selected from the size of the whole output so tiles of a large frame use the variant of its class
+    static PostProcessFunc selectPostProcess(const int outputWidth, const int outputHeight, const bool binned, const bool tiled) {
+        if(binned)
+            return tiled ? &postprocess_binned_tiles : &postprocess_binned;
+        
+        const int64_t pixels = static_cast<int64_t>(outputWidth) * outputHeight;
+        const PostProcessVariant* selected = &POSTPROCESS_VARIANTS[sizeof(POSTPROCESS_VARIANTS) / sizeof(POSTPROCESS_VARIANTS[0]) - 1];
+        
+        for(const auto& variant : POSTPROCESS_VARIANTS) {
+            if(pixels <= variant.maxPixels) {
+                selected = &variant;
+                break;
+            }
+        }
+        
+        return tiled ? selected->tilesFunc : selected->func;
+    }
+
+    static std::vector<std::vector<PostProcessTile>> createPostProcessTiles(int width, int height, int tileSize, int halo) {
+        const cv::Rect bounds(0, 0, width, height);
+        std::vector<std::vector<PostProcessTile>> rows;
+        
+        for(int y = 0; y < height; y += tileSize) {
+            std::vector<PostProcessTile> row;
+            
+            for(int x = 0; x < width; x += tileSize) {
+                PostProcessTile tile;
+                
+                tile.inner = cv::Rect(x, y, tileSize, tileSize) & bounds;
+                tile.outer = cv::Rect(x - halo, y - halo, tileSize + 2*halo, tileSize + 2*halo) & bounds;
+                
+                row.push_back(tile);
+            }
+            
+            rows.push_back(row);
+        }
+        
+        return rows;
+    }
+
+    //
+    // Crops a shading map to a tile. The shading map buffers are shared and not modified.
+    //
+
+    static std::vector<Halide::Runtime::Buffer<float>> cropShadingMapBuffers(const std::vector<Halide::Runtime::Buffer<float>>& shadingMap,
+                                                                             const cv::Size& imageSize,
+                                                                             const cv::Rect& region)
+    {
+        std::vector<cv::Mat> maps;
+        
+        for(const auto& buffer : shadingMap)
+            maps.push_back(cv::Mat(buffer.height(), buffer.width(), CV_32F, (void*) buffer.data(), buffer.stride(1) * sizeof(float)));
+        
+        std::vector<Halide::Runtime::Buffer<float>> result;
+        
+        for(auto& m : cropShadingMap(maps, imageSize, region))
+            result.push_back(Halide::Runtime::Buffer<float>((float*) m.data, m.cols, m.rows).copy());
+        
+        return result;
+    }
+
+    //
+    // Copies the inner region of a tile to the output. The tile also covers a band of its left and top
+    // neighbours that is blended with what they wrote to hide the seams.
+    //
+
+    static void stitchPostProcessTile(cv::Mat& output,
+                                      const cv::Point& outputOrigin,
+                                      const cv::Mat& tileOutput,
+                                      const PostProcessTile& tile,
+                                      const int outputScale,
+                                      const int blend)
+    {
+        const cv::Point tileOrigin(tile.outer.x * outputScale, tile.outer.y * outputScale);
+        
+        const bool blendLeft = tile.inner.x > 0;
+        const bool blendTop = tile.inner.y > 0;
+        
+        const int x0 = tile.inner.x * outputScale - (blendLeft ? blend : 0);
+        const int y0 = tile.inner.y * outputScale - (blendTop ? blend : 0);
+        const int x1 = (tile.inner.x + tile.inner.width) * outputScale;
+        const int y1 = (tile.inner.y + tile.inner.height) * outputScale;
+        
+        // Parts outside the output image are not written
+        const cv::Rect area = cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(outputOrigin, output.size());
+        if(area.area() <= 0)
+            return;
+        
+        cv::Mat src = tileOutput(area - tileOrigin);
+        cv::Mat dst = output(area - outputOrigin);
+        
+        if(!blendLeft && !blendTop) {
+            src.copyTo(dst);
+            return;
+        }
+        
+        cv::Mat weights(area.size(), CV_32F);
+        
+        for(int y = 0; y < weights.rows; y++) {
+            const float wy = blendTop ? (std::min)(1.0f, (area.y + y - y0 + 0.5f) / blend) : 1.0f;
+            float* w = weights.ptr<float>(y);
+            
+            for(int x = 0; x < weights.cols; x++) {
+                const float wx = blendLeft ? (std::min)(1.0f, (area.x + x - x0 + 0.5f) / blend) : 1.0f;
+                
+                w[x] = wx * wy;
+            }
+        }
+        
+        cv::Mat inverseWeights = 1.0f - weights;
+        
+        cv::blendLinear(src, dst, weights, inverseWeights, dst);
+    }
+
     cv::Mat ImageProcessor::postProcess(std::vector<Halide::Runtime::Buffer<uint16_t>>& inputBuffers,
                                         const shared_ptr<HdrMetadata>& hdrMetadata,
                                         int offsetX,
@@ -330,7 +570,7 @@ namespace motioncam {
         }
 
         // Get blue noise buffer
-        auto noise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
+        cv::Mat noise = ResourceCache::get().blueNoise();
         
         Halide::Runtime::Buffer<uint8_t> noiseBuffer =
             Halide::Runtime::Buffer<uint8_t>::make_interleaved((uint8_t*) noise.data, noise.cols, noise.rows, 4);
@@ -339,23 +579,11 @@ namespace motioncam {
         
         Halide::Runtime::Buffer<float> cameraToSrgbBuffer = ToHalideBuffer<float>(cameraToSrgb);
         
-        cv::Mat output((inputBuffers[0].height() - offsetY)*2, (inputBuffers[0].width() - offsetX)*2, CV_8UC3);
+        // Binned output has one pixel per bayer quad
+        const int outputScale = settings.binnedOutput ? 1 : 2;
         
-        Halide::Runtime::Buffer<uint8_t> outputBuffer(
-            Halide::Runtime::Buffer<uint8_t>::make_interleaved(output.data, output.cols, output.rows, 3));
-
-        // Edges are garbage, don't process them
-        outputBuffer.translate(0, offsetX);
-        outputBuffer.translate(1, offsetY);
+        cv::Mat output((inputBuffers[0].height() - offsetY)*outputScale, (inputBuffers[0].width() - offsetX)*outputScale, CV_8UC3);
         
-        // Get shading map
-        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer;
-
-        const auto& shadingMap = metadata.shadingMap();
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer.push_back(ToHalideBuffer<float>(shadingMap[i]).copy());
-        }
-
         float shadows = settings.shadows;
         float tonemapVariance = TONEMAP_VARIANCE;
         bool useHdr = false;
@@ -366,8 +594,10 @@ namespace motioncam {
         Halide::Runtime::Buffer<uint8_t> hdrMask;
 
         if(hdrMetadata) {
-            hdrInput = hdrMetadata->hdrInput;
-            hdrMask = hdrMetadata->hdrMask;
+            auto outputHdrMetadata = settings.binnedOutput ? binHdrMetadata(*hdrMetadata) : hdrMetadata;
+            
+            hdrInput = outputHdrMetadata->hdrInput;
+            hdrMask = outputHdrMetadata->hdrMask;
             hdrInputGain = hdrMetadata->gain;
             hdrScale = 1.0f / hdrMetadata->exposureScale;
             useHdr = true;
@@ -382,43 +612,222 @@ namespace motioncam {
             useHdr = false;
         }
                 
-        postprocess(inputBuffers[0],
-                    inputBuffers[1],
-                    inputBuffers[2],
-                    inputBuffers[3],
-                    noiseBuffer,
-                    hdrInput,
-                    hdrMask,
-                    useHdr,
-                    metadata.asShot[0],
-                    metadata.asShot[1],
-                    metadata.asShot[2],
-                    cameraToSrgbBuffer,
-                    shadingMapBuffer[0],
-                    shadingMapBuffer[1],
-                    shadingMapBuffer[2],
-                    shadingMapBuffer[3],
-                    EXPANDED_RANGE,
-                    static_cast<int>(cameraMetadata.sensorArrangment),
-                    shadows,
-                    hdrInputGain,
-                    hdrScale,
-                    tonemapVariance,
-                    settings.blacks,
-                    settings.exposure,
-                    settings.whitePoint,
-                    settings.contrast,
-                    settings.brightness,
-                    settings.blues,
-                    settings.greens,
-                    settings.saturation,
-                    settings.sharpen0,
-                    settings.sharpen1,
-                    settings.pop,
-                    128.0f,
-                    7.0f,
-                    (std::min)(0.015f, (std::max)(0.005f, noiseEstimate / 2.0f)),
-                    outputBuffer);
+        const int width = inputBuffers[0].width();
+        const int height = inputBuffers[0].height();
+        
+        // Tiles start on a coarse tonemap pixel
+        const int T = (std::max)(static_cast<int>(pow(2, EXTEND_EDGE_AMOUNT)), COARSE_TONEMAP_SCALE);
+        const int tileSize = T * (settings.postProcessTileSize / T);
+        const bool tiled = tileSize > 0 && (width > tileSize || height > tileSize);
+        
+        // Pick the schedule tuned for the resolution class of the whole frame, also when it is processed in tiles
+        const PostProcessFunc postprocessFunc = selectPostProcess(output.cols, output.rows, settings.binnedOutput, tiled);
+        
+        auto runPostProcess = [&](std::vector<Halide::Runtime::Buffer<uint16_t>>& input,
+                                  std::vector<Halide::Runtime::Buffer<float>>& shadingMapBuffer,
+                                  Halide::Runtime::Buffer<uint16_t>& hdrInputBuffer,
+                                  Halide::Runtime::Buffer<uint8_t>& hdrMaskBuffer,
+                                  Halide::Runtime::Buffer<uint16_t>& coarseTonemapBuffer,
+                                  Halide::Runtime::Buffer<uint8_t>& outputBuffer) -> void
+        {
+            postprocessFunc(input[0],
+                            input[1],
+                            input[2],
+                            input[3],
+                            noiseBuffer,
+                            hdrInputBuffer,
+                            hdrMaskBuffer,
+                            coarseTonemapBuffer,
+                            useHdr,
+                            metadata.asShot[0],
+                            metadata.asShot[1],
+                            metadata.asShot[2],
+                            cameraToSrgbBuffer,
+                            shadingMapBuffer[0],
+                            shadingMapBuffer[1],
+                            shadingMapBuffer[2],
+                            shadingMapBuffer[3],
+                            EXPANDED_RANGE,
+                            static_cast<int>(cameraMetadata.sensorArrangment),
+                            shadows,
+                            hdrInputGain,
+                            hdrScale,
+                            tonemapVariance,
+                            settings.blacks,
+                            settings.exposure,
+                            settings.whitePoint,
+                            settings.contrast,
+                            settings.brightness,
+                            settings.blues,
+                            settings.greens,
+                            settings.saturation,
+                            settings.sharpen0,
+                            settings.sharpen1,
+                            settings.pop,
+                            128.0f,
+                            7.0f,
+                            (std::min)(0.015f, (std::max)(0.005f, noiseEstimate / 2.0f)),
+                            outputBuffer);
+        };
+        
+        // Get shading map
+        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer = ResourceCache::get().shadingMap(metadata);
+        
+        if(!tiled) {
+            Halide::Runtime::Buffer<uint8_t> outputBuffer(
+                Halide::Runtime::Buffer<uint8_t>::make_interleaved(output.data, output.cols, output.rows, 3));
+
+            // Edges are garbage, don't process them
+            outputBuffer.translate(0, offsetX);
+            outputBuffer.translate(1, offsetY);
+            
+            // The whole image builds its own coarse tonemap levels, the input is not used
+            Halide::Runtime::Buffer<uint16_t> coarseTonemap(1, 1, 3);
+            
+            runPostProcess(inputBuffers, shadingMapBuffer, hdrInput, hdrMask, coarseTonemap, outputBuffer);
+            
+            return output;
+        }
+        
+        //
+        // Coarse tonemap levels of the whole image. Computed from the downscaled image, the postprocess
+        // pipelines of the tiles only build the finer levels.
+        //
+        
+        const int coarseMinX = inputBuffers[0].dim(0).min() / COARSE_TONEMAP_SCALE;
+        const int coarseMinY = inputBuffers[0].dim(1).min() / COARSE_TONEMAP_SCALE;
+        
+        Halide::Runtime::Buffer<uint16_t> coarseTonemap(
+            (width + COARSE_TONEMAP_SCALE - 1) / COARSE_TONEMAP_SCALE, (height + COARSE_TONEMAP_SCALE - 1) / COARSE_TONEMAP_SCALE, 3);
+        
+        coarseTonemap.set_min(coarseMinX, coarseMinY, 0);
+        
+        {
+            // Not binned, same as the postprocess inputs
+            Halide::Runtime::Buffer<uint16_t> coarseHdrInput = useHdr ? hdrMetadata->hdrInput : hdrInput;
+            Halide::Runtime::Buffer<uint8_t> coarseHdrMask = useHdr ? hdrMetadata->hdrMask : hdrMask;
+            
+            postprocess_coarse(inputBuffers[0],
+                               inputBuffers[1],
+                               inputBuffers[2],
+                               inputBuffers[3],
+                               coarseHdrInput,
+                               coarseHdrMask,
+                               useHdr,
+                               metadata.asShot[0],
+                               metadata.asShot[1],
+                               metadata.asShot[2],
+                               cameraToSrgbBuffer,
+                               shadingMapBuffer[0],
+                               shadingMapBuffer[1],
+                               shadingMapBuffer[2],
+                               shadingMapBuffer[3],
+                               EXPANDED_RANGE,
+                               static_cast<int>(cameraMetadata.sensorArrangment),
+                               shadows,
+                               hdrInputGain,
+                               hdrScale,
+                               tonemapVariance,
+                               settings.exposure,
+                               coarseTonemap);
+        }
+        
+        //
+        // Tiled post process. The exposure, colour parameters and the coarse tonemap levels are global, so each
+        // tile only needs enough context for the local filters and the finer tonemap levels.
+        //
+        
+        const int halo = postProcessHalo(outputScale, T);
+        const int blend = halo * outputScale / 2;
+        const cv::Size imageSize(width, height);
+        const cv::Point outputOrigin(offsetX, offsetY);
+        
+        auto tileRows = createPostProcessTiles(width, height, tileSize, halo);
+        
+        logger::log("Post processing in " + std::to_string(tileRows.size() * tileRows[0].size()) + " tiles" +
+                    " (tile size: " + std::to_string(tileSize) + ", halo: " + std::to_string(halo) + ")");
+        
+        for(auto& row : tileRows) {
+            std::vector<cv::Mat> tileOutputs(row.size());
+            std::atomic<size_t> nextTile(0);
+            std::exception_ptr error;
+            std::mutex errorMutex;
+            
+            auto processTiles = [&]() -> void {
+                try {
+                    for(size_t i = nextTile++; i < row.size(); i = nextTile++) {
+                        const auto& tile = row[i];
+                        
+                        std::vector<Halide::Runtime::Buffer<uint16_t>> tileInput;
+                        
+                        for(auto& buffer : inputBuffers) {
+                            auto cropped = buffer.cropped({
+                                { buffer.dim(0).min() + tile.outer.x, tile.outer.width },
+                                { buffer.dim(1).min() + tile.outer.y, tile.outer.height } });
+                            
+                            cropped.set_min(0, 0);
+                            tileInput.push_back(cropped);
+                        }
+                        
+                        auto tileShadingMap = cropShadingMapBuffers(shadingMapBuffer, imageSize, tile.outer);
+                        
+                        // Tile coordinates of the coarse tonemap
+                        Halide::Runtime::Buffer<uint16_t> tileCoarseTonemap = coarseTonemap;
+                        
+                        tileCoarseTonemap.translate(0, -(coarseMinX + tile.outer.x / COARSE_TONEMAP_SCALE));
+                        tileCoarseTonemap.translate(1, -(coarseMinY + tile.outer.y / COARSE_TONEMAP_SCALE));
+                        
+                        Halide::Runtime::Buffer<uint16_t> tileHdrInput = hdrInput;
+                        Halide::Runtime::Buffer<uint8_t> tileHdrMask = hdrMask;
+                        
+                        if(useHdr) {
+                            tileHdrInput = hdrInput.cropped({
+                                { tile.outer.x * outputScale, tile.outer.width * outputScale },
+                                { tile.outer.y * outputScale, tile.outer.height * outputScale } });
+                            
+                            tileHdrMask = hdrMask.cropped({
+                                { tile.outer.x * outputScale, tile.outer.width * outputScale },
+                                { tile.outer.y * outputScale, tile.outer.height * outputScale } });
+                            
+                            tileHdrInput.set_min(0, 0, 0);
+                            tileHdrMask.set_min(0, 0);
+                        }
+                        
+                        cv::Mat tileOutput(tile.outer.height * outputScale, tile.outer.width * outputScale, CV_8UC3);
+                        
+                        Halide::Runtime::Buffer<uint8_t> tileOutputBuffer(
+                            Halide::Runtime::Buffer<uint8_t>::make_interleaved(tileOutput.data, tileOutput.cols, tileOutput.rows, 3));
+                        
+                        runPostProcess(tileInput, tileShadingMap, tileHdrInput, tileHdrMask, tileCoarseTonemap, tileOutputBuffer);
+                        
+                        tileOutputs[i] = tileOutput;
+                    }
+                }
+                catch(...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if(!error)
+                        error = std::current_exception();
+                }
+            };
+            
+            const int numThreads = (std::min)(POSTPROCESS_TILE_THREADS, static_cast<int>(row.size()));
+            std::vector<std::thread> threads;
+            
+            for(int i = 1; i < numThreads; i++)
+                threads.emplace_back(processTiles);
+            
+            processTiles();
+            
+            for(auto& thread : threads)
+                thread.join();
+            
+            if(error)
+                std::rethrow_exception(error);
+            
+            // Stitch in order so each tile blends with the tiles above and to its left
+            for(size_t i = 0; i < row.size(); i++)
+                stitchPostProcessTile(output, outputOrigin, tileOutputs[i], row[i], outputScale, blend);
+        }
         
         return output;
     }
@@ -427,7 +836,8 @@ namespace motioncam {
                                                  const RawCameraMetadata& cameraMetadata,
                                                  const PostProcessSettings& postProcessSettings,
                                                  float& outBlackPoint,
-                                                 float& outWhitePoint)
+                                                 float& outWhitePoint,
+                                                 DecodedFrameStore* frameStore)
     {
         PostProcessSettings settings = postProcessSettings;
             
@@ -436,7 +846,10 @@ namespace motioncam {
         
         Halide::Runtime::Buffer<uint8_t> previewBuffer;
         
-        previewBuffer = createPreview(rawBuffer, 2, cameraMetadata, settings);
+        if(frameStore)
+            previewBuffer = frameStore->preview(rawBuffer, 2, settings);
+        else
+            previewBuffer = createPreview(rawBuffer, 2, cameraMetadata, settings);
 
         cv::Mat preview(previewBuffer.height(), previewBuffer.width(), CV_8UC4, previewBuffer.data());
         cv::Mat histogram;
@@ -587,6 +1000,26 @@ namespace motioncam {
         outSettings.clippedHighs = histogram.at<float>(histogram.cols - 1);
     }
 
+    static ResourceKey colorProfileKey(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& rawImageMetadata) {
+        ResourceKey key;
+
+        // Same selection as the camera profile, matrices in the image metadata take precedence
+        auto select = [](const cv::Mat& image, const cv::Mat& camera) -> const cv::Mat& {
+            return image.empty() ? camera : image;
+        };
+
+        key.add(select(rawImageMetadata.calibrationMatrix1, cameraMetadata.calibrationMatrix1))
+           .add(select(rawImageMetadata.calibrationMatrix2, cameraMetadata.calibrationMatrix2))
+           .add(select(rawImageMetadata.colorMatrix1, cameraMetadata.colorMatrix1))
+           .add(select(rawImageMetadata.colorMatrix2, cameraMetadata.colorMatrix2))
+           .add(select(rawImageMetadata.forwardMatrix1, cameraMetadata.forwardMatrix1))
+           .add(select(rawImageMetadata.forwardMatrix2, cameraMetadata.forwardMatrix2))
+           .add(static_cast<int>(cameraMetadata.colorIlluminant1))
+           .add(static_cast<int>(cameraMetadata.colorIlluminant2));
+
+        return key;
+    }
+
     void ImageProcessor::createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
                                           const RawImageMetadata& rawImageMetadata,
                                           const Temperature& temperature,
@@ -594,16 +1027,26 @@ namespace motioncam {
                                           cv::Mat& outCameraToPcs,
                                           cv::Mat& outPcsToSrgb)
     {
-        cv::Mat pcsToCamera, cameraToPcs;
-        cv::Mat pcsToSrgb, srgbToPcs;
-        
-        CameraProfile cameraProfile(cameraMetadata, rawImageMetadata);
+        ResourceKey key = colorProfileKey(cameraMetadata, rawImageMetadata);
+
+        key.add(0).add(temperature.temperature()).add(temperature.tint());
+
+        auto colorMatrices = ResourceCache::get().colorMatrices(key, [&]() -> ColorMatrices {
+            ColorMatrices result;
+            cv::Mat pcsToCamera, srgbToPcs;
+
+            CameraProfile cameraProfile(cameraMetadata, rawImageMetadata);
+
+            cameraProfile.cameraToPcs(temperature, pcsToCamera, result.cameraToPcs, result.cameraWhite);
+            motioncam::CameraProfile::pcsToSrgb(result.pcsToSrgb, srgbToPcs);
 
-        cameraProfile.cameraToPcs(temperature, pcsToCamera, cameraToPcs, cameraWhite);
-        motioncam::CameraProfile::pcsToSrgb(pcsToSrgb, srgbToPcs);
+            return result;
+        });
 
-        cameraToPcs.copyTo(outCameraToPcs);
-        pcsToSrgb.copyTo(outPcsToSrgb);
+        cameraWhite = colorMatrices.cameraWhite;
+
+        colorMatrices.cameraToPcs.copyTo(outCameraToPcs);
+        colorMatrices.pcsToSrgb.copyTo(outPcsToSrgb);
     }
 
     void ImageProcessor::createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
@@ -613,31 +1056,41 @@ namespace motioncam {
                                           cv::Mat& outCameraToPcs,
                                           cv::Mat& outPcsToSrgb)
     {
-        cv::Mat pcsToCamera, cameraToPcs;
-        cv::Mat pcsToSrgb, srgbToPcs;
-        
-        CameraProfile cameraProfile(cameraMetadata, rawImageMetadata);
-        Temperature temperature;
+        ResourceKey key = colorProfileKey(cameraMetadata, rawImageMetadata);
 
-        cv::Vec3f asShotVector = asShot;
-        float max = (math::max)(asShotVector);
-        
-        if(max > 0) {
-            asShotVector[0] = asShotVector[0] * (1.0f / max);
-            asShotVector[1] = asShotVector[1] * (1.0f / max);
-            asShotVector[2] = asShotVector[2] * (1.0f / max);
-        }
-        else {
-            throw InvalidState("Camera white balance vector is zero");
-        }
+        key.add(1).add(asShot[0]).add(asShot[1]).add(asShot[2]);
+
+        auto colorMatrices = ResourceCache::get().colorMatrices(key, [&]() -> ColorMatrices {
+            ColorMatrices result;
+            cv::Mat pcsToCamera, srgbToPcs;
 
-        cameraProfile.temperatureFromVector(asShotVector, temperature);
+            CameraProfile cameraProfile(cameraMetadata, rawImageMetadata);
+            Temperature temperature;
 
-        cameraProfile.cameraToPcs(temperature, pcsToCamera, cameraToPcs, cameraWhite);
-        motioncam::CameraProfile::pcsToSrgb(pcsToSrgb, srgbToPcs);
+            cv::Vec3f asShotVector = asShot;
+            float max = (math::max)(asShotVector);
 
-        cameraToPcs.copyTo(outCameraToPcs);
-        pcsToSrgb.copyTo(outPcsToSrgb);
+            if(max > 0) {
+                asShotVector[0] = asShotVector[0] * (1.0f / max);
+                asShotVector[1] = asShotVector[1] * (1.0f / max);
+                asShotVector[2] = asShotVector[2] * (1.0f / max);
+            }
+            else {
+                throw InvalidState("Camera white balance vector is zero");
+            }
+
+            cameraProfile.temperatureFromVector(asShotVector, temperature);
+
+            cameraProfile.cameraToPcs(temperature, pcsToCamera, result.cameraToPcs, result.cameraWhite);
+            motioncam::CameraProfile::pcsToSrgb(result.pcsToSrgb, srgbToPcs);
+
+            return result;
+        });
+
+        cameraWhite = colorMatrices.cameraWhite;
+
+        colorMatrices.cameraToPcs.copyTo(outCameraToPcs);
+        colorMatrices.pcsToSrgb.copyTo(outPcsToSrgb);
     }
 
     void ImageProcessor::generateStats(const RawImageBuffer& rawBuffer,
@@ -749,12 +1202,7 @@ namespace motioncam {
         cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
         
         Halide::Runtime::Buffer<float> cameraToSrgbBuffer = ToHalideBuffer<float>(cameraToSrgb);
-        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer;
-
-        const auto& shadingMap = metadata.shadingMap();
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer.push_back(ToHalideBuffer<float>(shadingMap[i]).copy());
-        }
+        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer = ResourceCache::get().shadingMap(metadata);
 
         const int width  = inputBuffers[0].width() / sx;
         const int height = inputBuffers[0].height() / sy;
@@ -817,12 +1265,7 @@ namespace motioncam {
         cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
         
         Halide::Runtime::Buffer<float> cameraToSrgbBuffer = ToHalideBuffer<float>(cameraToSrgb);
-        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer;
-
-        const auto& shadingMap = rawBuffer.metadata.shadingMap();
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer.push_back(ToHalideBuffer<float>(shadingMap[i]).copy());
-        }
+        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer = ResourceCache::get().shadingMap(rawBuffer.metadata);
 
         NativeBufferContext inputBufferContext(*rawBuffer.data, false);
 
@@ -970,6 +1413,54 @@ namespace motioncam {
         return rawData;
     }
 
+    std::shared_ptr<RawData> ImageProcessor::loadRawImage(const RawImageBuffer& rawBuffer,
+                                                          const RawCameraMetadata& cameraMetadata,
+                                                          const cv::Rect& region)
+    {
+        auto whiteLevel = cameraMetadata.getWhiteLevel(rawBuffer.metadata);
+        const auto& blackLevel = cameraMetadata.getBlackLevel(rawBuffer.metadata);
+
+        // Region is in the coordinates of the extended image
+        const int T = pow(2, EXTEND_EDGE_AMOUNT);
+
+        int halfWidth  = rawBuffer.width / 2;
+        int halfHeight = rawBuffer.height / 2;
+
+        int extendX = static_cast<int>(T * ceil(halfWidth / (double) T) - halfWidth);
+        int extendY = static_cast<int>(T * ceil(halfHeight / (double) T) - halfHeight);
+        
+        auto rawData = std::make_shared<RawData>();
+
+        NativeBufferContext inputBufferContext(*rawBuffer.data, false);
+        
+        rawData->previewBuffer  = Halide::Runtime::Buffer<uint8_t>(region.width, region.height);
+        rawData->rawBuffer      = Halide::Runtime::Buffer<uint16_t>(region.width, region.height, 4);
+        rawData->metadata       = rawBuffer.metadata;
+        
+        // Only the region covered by the output buffers is computed
+        rawData->previewBuffer.set_min(region.x, region.y);
+        rawData->rawBuffer.set_min(region.x, region.y, 0);
+        
+        deinterleave_raw(inputBufferContext.getHalideBuffer(),
+                         rawBuffer.rowStride,
+                         static_cast<int>(rawBuffer.pixelFormat),
+                         static_cast<int>(cameraMetadata.sensorArrangment),
+                         rawBuffer.width,
+                         rawBuffer.height,
+                         extendX / 2,
+                         extendY / 2,
+                         whiteLevel,
+                         blackLevel[0],
+                         blackLevel[1],
+                         blackLevel[2],
+                         blackLevel[3],
+                         1.0f,
+                         rawData->rawBuffer,
+                         rawData->previewBuffer);
+                        
+        return rawData;
+    }
+
     void ImageProcessor::measureNoise(const RawCameraMetadata& cameraMetadata,
                                       const RawImageBuffer& rawBuffer,
                                       std::vector<float>& outNoise,
@@ -1115,12 +1606,7 @@ namespace motioncam {
         const int width = buffer.width/2/SCALE;
         const int height = buffer.height/2/SCALE;
 
-        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer;
-
-        const auto& shadingMap = buffer.metadata.shadingMap();
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer.push_back(ToHalideBuffer<float>(shadingMap[i]).copy());
-        }
+        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer = ResourceCache::get().shadingMap(buffer.metadata);
 
         cv::Mat cameraToPcs;
         cv::Mat pcsToSrgb;
@@ -1185,30 +1671,200 @@ namespace motioncam {
         return histogram;
     }
 
-    void ImageProcessor::process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener)
+    //
+    // Finds the region of interest and the region to process around it, both in the coordinates of the extended
+    // bayer channels. Returns false when the whole image should be processed.
+    //
+
+    static bool getProcessRegion(const RawImageBuffer& rawBuffer,
+                                 const PostProcessSettings& settings,
+                                 cv::Rect& outRoi,
+                                 cv::Rect& outProcessRegion)
     {
-        cv::ocl::setUseOpenCL(false);
+        if(settings.roiWidth <= 0 || settings.roiHeight <= 0)
+            return false;
+        
+        const int T = pow(2, EXTEND_EDGE_AMOUNT);
         
+        const int halfWidth  = rawBuffer.width / 2;
+        const int halfHeight = rawBuffer.height / 2;
         
-        // If this is a HDR capture then find the underexposed images.
-        std::vector<std::shared_ptr<RawImageBuffer>> underexposedImages;
+        const int extendX = static_cast<int>(T * ceil(halfWidth / (double) T) - halfWidth);
+        const int extendY = static_cast<int>(T * ceil(halfHeight / (double) T) - halfHeight);
         
-        // Started
-        progressListener.onProgressUpdate(0);
+        const cv::Rect bounds(0, 0, halfWidth + extendX, halfHeight + extendY);
+        const cv::Rect valid(extendX / 2, extendY / 2, halfWidth, halfHeight);
+        
+        cv::Rect roi(valid.x + static_cast<int>(floor(settings.roiX * halfWidth)),
+                     valid.y + static_cast<int>(floor(settings.roiY * halfHeight)),
+                     static_cast<int>(ceil(settings.roiWidth * halfWidth)),
+                     static_cast<int>(ceil(settings.roiHeight * halfHeight)));
+        
+        roi &= valid;
+        
+        if(roi.area() <= 0)
+            return false;
+        
+        // Keep the region aligned so it can be decomposed into wavelet levels
+        const int x0 = T * (roi.x / T) - ROI_HALO;
+        const int y0 = T * (roi.y / T) - ROI_HALO;
+        const int x1 = T * static_cast<int>(ceil((roi.x + roi.width) / (double) T)) + ROI_HALO;
+        const int y1 = T * static_cast<int>(ceil((roi.y + roi.height) / (double) T)) + ROI_HALO;
+        
+        outRoi = roi;
+        outProcessRegion = cv::Rect(x0, y0, x1 - x0, y1 - y0) & bounds;
+        
+        // Nothing to gain when the region covers most of the image
+        return outProcessRegion.area() < bounds.area();
+    }
 
-        // Remove all underexposed images
-        if(rawContainer.isHdr()) {
-            auto refEv = getMinEv(rawContainer);
-            
-            for(const auto& frameName : rawContainer.getFrames()) {
-                auto frame = rawContainer.getFrame(frameName);
-                auto ev = calcEv(rawContainer.getCameraMetadata(), frame->metadata);
-                        
-                if(ev - refEv > 1.0f) {
-                    // Load the frame since we intend to remove it from the container
-                    auto raw = rawContainer.loadFrame(frameName);
-                    if(!raw) {
-                        logger::log("Invalid frame " + frameName);
+    //
+    // Writes the image with its EXIF metadata to a temporary file, then replaces the output with it
+    // so readers never see a partially written file
+    //
+
+    static void writeOutputImage(const cv::Mat& outputImage,
+                                 const std::string& outputPath,
+                                 const RawImageMetadata& metadata,
+                                 const RawCameraMetadata& cameraMetadata,
+                                 const PostProcessSettings& settings)
+    {
+        std::string basePath, filename;
+        
+        util::GetBasePath(outputPath, basePath, filename);
+        
+        std::string tmpPath = basePath.empty() ? "TMP_" + filename : basePath + "/TMP_" + filename;
+        
+        std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, settings.jpegQuality };
+        
+        if(!cv::imwrite(tmpPath, outputImage, writeParams))
+            throw IOException("Failed to write " + tmpPath);
+        
+        // Create thumbnail
+        cv::Mat thumbnail;
+
+        int width = 320;
+        int height = (int) std::lround((outputImage.rows / (double) outputImage.cols) * width);
+
+        cv::resize(outputImage, thumbnail, cv::Size(width, height));
+
+        // Add exif data to the output image
+        ImageProcessor::addExifMetadata(metadata, thumbnail, cameraMetadata, settings, tmpPath);
+        
+        // Replacing an existing file fails on some platforms
+        if(std::rename(tmpPath.c_str(), outputPath.c_str()) != 0) {
+            std::remove(outputPath.c_str());
+            
+            if(std::rename(tmpPath.c_str(), outputPath.c_str()) != 0)
+                throw IOException("Failed to replace " + outputPath);
+        }
+    }
+
+    //
+    // Estimates the peak memory used by process() after the reference has been loaded
+    //
+
+    static size_t estimateProcessMemory(RawImageBuffer& referenceRawBuffer,
+                                        const RawData& referenceBayer,
+                                        const size_t numFrames,
+                                        const bool hdr,
+                                        const bool dng,
+                                        const bool progressive,
+                                        const BurstFuserConfig& fuserConfig)
+    {
+        const size_t frameBytes = referenceRawBuffer.data->len();
+        const size_t pixels = static_cast<size_t>(referenceBayer.rawBuffer.width()) * referenceBayer.rawBuffer.height();
+        const size_t rawDataBytes = pixels * (4 * sizeof(uint16_t) + 1);
+
+        // HDR inputs are always prepared from the whole frame
+        const size_t framePixels = static_cast<size_t>(referenceRawBuffer.width / 2) * (referenceRawBuffer.height / 2);
+
+        // Full resolution 16-bit RGB input and 8-bit mask
+        const size_t hdrBytes = hdr ? 4 * framePixels * (3 * sizeof(uint16_t) + 1) : 0;
+
+        // The reference and underexposed frames, their raw data, ghost map and mask
+        const size_t hdrPrepareBytes = hdr ? frameBytes + 2 * framePixels * (4 * sizeof(uint16_t) + 1) + 2 * framePixels + hdrBytes : 0;
+
+        const size_t denoiseOutputBytes = pixels * 4 * sizeof(uint16_t);
+        const size_t outputBytes = 4 * pixels * 3;
+        const size_t dngBytes = dng ? 4 * pixels * sizeof(uint16_t) : 0;
+
+        // The decoded reference is released before fusing tiles
+        const size_t referenceBytes = fuserConfig.tileSize > 0 ? 0 : rawDataBytes;
+
+        const size_t prepareStage = frameBytes + rawDataBytes + hdrPrepareBytes;
+        const size_t fuseStage = referenceBytes + hdrBytes + BurstFuser::estimateMemory(referenceBayer.rawBuffer.width(),
+                                                                                        referenceBayer.rawBuffer.height(),
+                                                                                        frameBytes,
+                                                                                        numFrames,
+                                                                                        fuserConfig);
+        const size_t postProcessStage = hdrBytes + denoiseOutputBytes + (std::max)(dngBytes, outputBytes);
+
+        // Intermediate results are post processed from a snapshot of the fused output
+        const size_t progressiveStage =
+            progressive ? rawDataBytes + hdrBytes + pixels * 4 * sizeof(float) + denoiseOutputBytes + outputBytes : 0;
+
+        return (std::max)((std::max)(prepareStage, progressiveStage), (std::max)(fuseStage, postProcessStage));
+    }
+
+    void ImageProcessor::process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener)
+    {
+        process(rawContainer, rawContainer.getPostProcessSettings(), outputPath, progressListener);
+    }
+
+    void ImageProcessor::process(RawContainer& rawContainer,
+                                 const PostProcessSettings& postProcessSettings,
+                                 const std::string& outputPath,
+                                 const ImageProcessorProgress& progressListener)
+    {
+        // The output is written before this returns, so the listener doesn't need to be owned
+        std::shared_ptr<const ImageProcessorProgress> listener(&progressListener, [](const ImageProcessorProgress*) {});
+        
+        process(rawContainer, postProcessSettings, outputPath, listener, nullptr);
+    }
+
+    void ImageProcessor::process(RawContainer& rawContainer,
+                                 const PostProcessSettings& postProcessSettings,
+                                 const std::string& outputPath,
+                                 const std::shared_ptr<const ImageProcessorProgress>& listener,
+                                 OutputWriter* outputWriter)
+    {
+        cv::ocl::setUseOpenCL(false);
+        
+        // Wait for the output to be written before returning when there is no writer. Declared first so it is
+        // destroyed last and the output tasks can't outlive anything they use.
+        std::unique_ptr<OutputWriter> localOutputWriter;
+        
+        if(!outputWriter) {
+            localOutputWriter.reset(new OutputWriter());
+            outputWriter = localOutputWriter.get();
+        }
+        
+        const ImageProcessorProgress& progressListener = *listener;
+        
+        // If this is a HDR capture then find the underexposed images.
+        std::vector<std::shared_ptr<RawImageBuffer>> underexposedImages;
+        
+        // Started
+        if(!progressListener.onProgressUpdate(0)) {
+            progressListener.onError("Cancelled");
+            progressListener.onCompleted();
+            return;
+        }
+
+        // Remove all underexposed images
+        if(rawContainer.isHdr()) {
+            auto refEv = getMinEv(rawContainer);
+            
+            for(const auto& frameName : rawContainer.getFrames()) {
+                auto frame = rawContainer.getFrame(frameName);
+                auto ev = calcEv(rawContainer.getCameraMetadata(), frame->metadata);
+                        
+                if(ev - refEv > 1.0f) {
+                    // Load the frame since we intend to remove it from the container
+                    auto raw = rawContainer.loadFrame(frameName);
+                    if(!raw) {
+                        logger::log("Invalid frame " + frameName);
                         continue;
                     }
 
@@ -1239,8 +1895,26 @@ namespace motioncam {
         // Remove the reference
         rawContainer.removeFrame(referenceFrame);
 
-        auto referenceBayer = loadRawImage(*referenceRawBuffer, rawContainer.getCameraMetadata());
-        PostProcessSettings settings = rawContainer.getPostProcessSettings();
+        // Frames and previews are decoded once and shared for the rest of the capture
+        DecodedFrameStore frameStore(rawContainer.getCameraMetadata());
+        
+        PostProcessSettings settings = postProcessSettings;
+        
+        // Only load the part of the reference that is processed when there is a region of interest
+        cv::Rect roi, processRegion;
+        const bool useRoi = getProcessRegion(*referenceRawBuffer, settings, roi, processRegion);
+        
+        std::shared_ptr<RawData> referenceBayer;
+        
+        if(useRoi) {
+            referenceBayer = loadRawImage(*referenceRawBuffer, rawContainer.getCameraMetadata(), processRegion);
+            
+            referenceBayer->rawBuffer.set_min(0, 0, 0);
+            referenceBayer->previewBuffer.set_min(0, 0);
+        }
+        else {
+            referenceBayer = frameStore.rawData(*referenceRawBuffer);
+        }
         
         // Estimate shadows if not set
         if(settings.shadows < 0) {
@@ -1253,9 +1927,86 @@ namespace motioncam {
         }
         
         if(settings.blacks < 0 || settings.whitePoint < 0) {
-            estimateBlackWhitePoint(*referenceRawBuffer, rawContainer.getCameraMetadata(), settings, settings.blacks, settings.whitePoint);
+            estimateBlackWhitePoint(*referenceRawBuffer, rawContainer.getCameraMetadata(), settings, settings.blacks, settings.whitePoint, &frameStore);
+        }
+                
+        //
+        // Fusion settings and memory budget
+        //
+        
+        BurstFuserConfig fuserConfig;
+        
+        // Auto
+        if(settings.spatialDenoiseLevel < 0) {
+            fuserConfig.weights.clear();
+        }
+        // Off
+        else if(settings.spatialDenoiseLevel == 0) {
+            fuserConfig.weights = { 0, 0, 0, 0 };
+        }
+        // Chosen value
+        else {
+            int i = settings.spatialDenoiseLevel;
+            
+            i = (std::min)(i, (int) (WEIGHTS.size() - 1));
+            i = (std::max)(i, 0);
+            
+            // Weights are in reverse order
+            fuserConfig.weights = WEIGHTS[WEIGHTS.size() - i];
         }
+        
+        fuserConfig.framesInFlight = settings.fuseFramesInFlight;
+        fuserConfig.tileSize = settings.fuseTileSize;
+        fuserConfig.tileHalo = settings.fuseTileHalo;
+        fuserConfig.alignmentMode = settings.fuseTileAlignment ? AlignmentMode::TILES : AlignmentMode::DENSE_FLOW;
+        fuserConfig.adaptiveMerge = settings.adaptiveMerge;
+        
+        if(settings.mergeTargetSnr > 0)
+            fuserConfig.targetSnr = settings.mergeTargetSnr;
+        
+        if(useRoi)
+            fuserConfig.region = processRegion;
+        
+        const size_t memoryBudget = static_cast<size_t>((std::max)(0, settings.memoryBudget)) * 1024 * 1024;
+        const bool hdr = !underexposedImages.empty();
+        const size_t numFrames = rawContainer.getFrames().size();
+        
+        size_t peakMemory = estimateProcessMemory(*referenceRawBuffer, *referenceBayer, numFrames, hdr, settings.dng, settings.progressive, fuserConfig);
+        
+        if(memoryBudget > 0 && peakMemory > memoryBudget) {
+            // Fall back to strategies that use less memory until the estimate fits
+            if(fuserConfig.framesInFlight > 1) {
+                fuserConfig.framesInFlight = 1;
+                peakMemory = estimateProcessMemory(*referenceRawBuffer, *referenceBayer, numFrames, hdr, settings.dng, settings.progressive, fuserConfig);
+            }
+            
+            // Frames of in memory captures are already held and can't be loaded again once released, so those
+            // are not tiled
+            if(peakMemory > memoryBudget && fuserConfig.tileSize <= 0 && !rawContainer.isInMemory()) {
+                fuserConfig.tileSize = MEMORY_BUDGET_TILE_SIZE;
+                fuserConfig.tileHalo = (std::min)(fuserConfig.tileHalo, fuserConfig.tileSize / 2);
+                peakMemory = estimateProcessMemory(*referenceRawBuffer, *referenceBayer, numFrames, hdr, settings.dng, settings.progressive, fuserConfig);
+            }
+            
+            while(peakMemory > memoryBudget && fuserConfig.tileSize > MIN_MEMORY_BUDGET_TILE_SIZE) {
+                fuserConfig.tileSize = (std::max)(MIN_MEMORY_BUDGET_TILE_SIZE, fuserConfig.tileSize / 2);
+                fuserConfig.tileHalo = (std::min)(fuserConfig.tileHalo, fuserConfig.tileSize / 2);
                 
+                peakMemory = estimateProcessMemory(*referenceRawBuffer, *referenceBayer, numFrames, hdr, settings.dng, settings.progressive, fuserConfig);
+            }
+            
+            if(peakMemory > memoryBudget)
+                logger::log("Estimated peak memory exceeds budget of " + std::to_string(memoryBudget / (1024 * 1024)) + " MB");
+        }
+        
+        // The estimate does not include the post process intermediates, tile them to keep them bounded
+        if(memoryBudget > 0 && settings.postProcessTileSize <= 0)
+            settings.postProcessTileSize = MEMORY_BUDGET_POSTPROCESS_TILE_SIZE;
+        
+        logger::log("Estimated peak memory " + std::to_string(peakMemory / (1024 * 1024)) + " MB" +
+                    " (frames in flight: " + std::to_string(fuserConfig.framesInFlight) +
+                    ", tile size: " + std::to_string(fuserConfig.tileSize) + ")");
+        
         //
         // Save preview
         //
@@ -1263,7 +2014,7 @@ namespace motioncam {
         Halide::Runtime::Buffer<uint8_t> preview;
         PostProcessSettings previewSettings = settings;
         
-        preview = createPreview(*referenceRawBuffer, 2, rawContainer.getCameraMetadata(), previewSettings);
+        preview = frameStore.preview(*referenceRawBuffer, 2, previewSettings);
         
         std::string basePath, filename;
 
@@ -1278,6 +2029,9 @@ namespace motioncam {
         // Parse the returned metadata
         std::string metadataJson = progressListener.onPreviewSaved(previewPath);
         previewImage.release();
+        preview = Halide::Runtime::Buffer<uint8_t>();
+        
+        frameStore.releasePreviews();
 
         //
         // HDR
@@ -1289,9 +2043,13 @@ namespace motioncam {
             hdrMetadata = prepareHdr(rawContainer.getCameraMetadata(),
                        settings,
                        *referenceRawBuffer,
-                       *underexposedImages[0]);
+                       *underexposedImages[0],
+                       &frameStore);
         }
         
+        for(auto& underexposed : underexposedImages)
+            frameStore.release(*underexposed);
+        
         underexposedImages.clear();
         
         //
@@ -1300,36 +2058,177 @@ namespace motioncam {
         
         ImageProgressHelper progressHelper(progressListener, static_cast<int>(rawContainer.getFrames().size()), 0);
         
+        const int rawWidth  = referenceRawBuffer->width / 2;
+        const int rawHeight = referenceRawBuffer->height / 2;
+
+        const int T = pow(2, EXTEND_EDGE_AMOUNT);
+        
+        int offsetX = static_cast<int>(T * ceil(rawWidth / (double) T) - rawWidth);
+        int offsetY = static_cast<int>(T * ceil(rawHeight / (double) T) - rawHeight);
+        
+        RawImageMetadata outputMetadata = referenceRawBuffer->metadata;
+        cv::Rect outputCrop;
+        
+        // Post process the whole region and crop the halo around the region of interest afterwards
+        if(useRoi) {
+            const cv::Size imageSize(rawWidth + offsetX, rawHeight + offsetY);
+            
+            outputMetadata.updateShadingMap(cropShadingMap(outputMetadata.shadingMap(), imageSize, processRegion));
+            
+            if(hdrMetadata) {
+                auto roiHdrMetadata = std::make_shared<HdrMetadata>(*hdrMetadata);
+                
+                roiHdrMetadata->hdrInput = hdrMetadata->hdrInput.cropped({
+                    { processRegion.x*2, processRegion.width*2 }, { processRegion.y*2, processRegion.height*2 }, { 0, 3 } }).copy();
+                
+                roiHdrMetadata->hdrMask = hdrMetadata->hdrMask.cropped({
+                    { processRegion.x*2, processRegion.width*2 }, { processRegion.y*2, processRegion.height*2 } }).copy();
+                
+                roiHdrMetadata->hdrInput.set_min(0, 0, 0);
+                roiHdrMetadata->hdrMask.set_min(0, 0);
+                
+                hdrMetadata = roiHdrMetadata;
+            }
+            
+            const int outputScale = settings.binnedOutput ? 1 : 2;
+            
+            outputCrop = cv::Rect((roi.x - processRegion.x) * outputScale,
+                                  (roi.y - processRegion.y) * outputScale,
+                                  roi.width * outputScale,
+                                  roi.height * outputScale);
+            
+            offsetX = 0;
+            offsetY = 0;
+        }
+        
+        auto postProcessOutput = [&](std::vector<Halide::Runtime::Buffer<uint16_t>>& input, const float noiseEstimate) -> cv::Mat {
+            cv::Mat output = postProcess(
+                input,
+                hdrMetadata,
+                offsetX,
+                offsetY,
+                noiseEstimate,
+                outputMetadata,
+                rawContainer.getCameraMetadata(),
+                settings);
+            
+            if(outputCrop.area() > 0)
+                return output(outputCrop).clone();
+            
+            return output;
+        };
+        
         std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
         float noise = 0.0f;
         
-        denoiseOutput = denoise(*referenceRawBuffer, *referenceBayer, rawContainer, &noise, progressHelper);
+        // Set when the capture is cancelled so output that is still waiting to be written is skipped
+        auto outputCancelled = std::make_shared<std::atomic<bool>>(false);
+        
+        {
+            BurstFuser fuser(rawContainer.getCameraMetadata(), fuserConfig);
+            ContainerFrameSource frames(rawContainer);
+            
+            fuser.setReference(referenceRawBuffer, referenceBayer);
+            
+            if(fuserConfig.tileSize > 0) {
+                // Tiled fusion loads the reference from the RAW data one band at a time
+                frameStore.release(*referenceRawBuffer);
+                referenceBayer = nullptr;
+            }
+            else {
+                // Release RAW data, the reference is not needed after this point
+                referenceRawBuffer->data.reset();
+            }
+            
+            // Post process what has been fused so far on the writer and replace the output with it. The snapshot is a
+            // copy, so fusing carries on in the meantime.
+            auto writeStage = [&](OutputStage stage) {
+                auto stageInput = fuser.snapshot();
+                auto stageHdrMetadata = hdrMetadata;
+                RawImageMetadata stageMetadata = outputMetadata;
+                RawImageMetadata stageImageMetadata = referenceRawBuffer->metadata;
+                RawCameraMetadata stageCameraMetadata = rawContainer.getCameraMetadata();
+                PostProcessSettings stageSettings = settings;
+                PostProcessSettings stageOutputSettings = postProcessSettings;
+                std::string stagePath = outputPath;
+                
+                outputWriter->submit([stageInput, stageHdrMetadata, offsetX, offsetY, outputCrop, stageMetadata, stageImageMetadata,
+                                      stageCameraMetadata, stageSettings, stageOutputSettings, stagePath, stage, listener, outputCancelled]() mutable {
+                    if(*outputCancelled)
+                        return;
+                    
+                    try {
+                        cv::Mat stageImage = postProcess(
+                            stageInput, stageHdrMetadata, offsetX, offsetY, 0.0f, stageMetadata, stageCameraMetadata, stageSettings);
+                        
+                        if(outputCrop.area() > 0)
+                            stageImage = stageImage(outputCrop).clone();
+                        
+                        writeOutputImage(stageImage, stagePath, stageImageMetadata, stageCameraMetadata, stageOutputSettings);
+                        listener->onStageSaved(stagePath, stage);
+                    }
+                    catch(std::exception& e) {
+                        logger::log("Failed to write " + stagePath + ": " + e.what());
+                    }
+                });
+            };
+            
+            if(settings.progressive)
+                writeStage(OutputStage::REFERENCE);
+            
+            // Tiled fusion finishes each band with every frame, so there is no partial merge to show
+            const int mergeFrames = settings.progressive && fuserConfig.tileSize <= 0 ? settings.progressiveMergeFrames : 0;
+            
+            denoiseOutput = fuser.process(frames, &noise, [&]() -> bool {
+                progressHelper.nextFusedImage();
+                
+                if(progressHelper.cancelled())
+                    return false;
+                
+                if(fuser.fusedFrames() == mergeFrames)
+                    writeStage(OutputStage::PARTIAL_MERGE);
+                
+                return true;
+            },
+            [&]() {
+                progressHelper.fuseCompleted();
+            });
+        }
         
-        // Release RAW data
-        referenceRawBuffer->data.reset();
         referenceBayer = nullptr;
+        referenceRawBuffer->data.reset();
+        frameStore.clear();
 
         progressHelper.denoiseCompleted();
+        
+        if(progressHelper.cancelled()) {
+            *outputCancelled = true;
+            
+            // Notify from the writer so nothing is reported after the listener has been told the capture completed
+            outputWriter->submit([listener]() {
+                listener->onError("Cancelled");
+                listener->onCompleted();
+            });
+            
+            return;
+        }
                 
         //
         // Post process
         //
         
-        const int rawWidth  = referenceRawBuffer->width / 2;
-        const int rawHeight = referenceRawBuffer->height / 2;
-
-        const int T = pow(2, EXTEND_EDGE_AMOUNT);
-        
-        const int offsetX = static_cast<int>(T * ceil(rawWidth / (double) T) - rawWidth);
-        const int offsetY = static_cast<int>(T * ceil(rawHeight / (double) T) - rawHeight);
-
         // Check if we should write a DNG file
-        if(rawContainer.getPostProcessSettings().dng) {
+        if(postProcessSettings.dng) {
             std::vector<cv::Mat> rawChannels;
             rawChannels.reserve(4);
 
             for(int i = 0; i < 4; i++) {
-                rawChannels.emplace_back(denoiseOutput[i].height(), denoiseOutput[i].width(), CV_16U, denoiseOutput[i].data());
+                cv::Mat channel(denoiseOutput[i].height(), denoiseOutput[i].width(), CV_16U, denoiseOutput[i].data());
+                
+                if(useRoi)
+                    channel = channel(roi - processRegion.tl());
+                
+                rawChannels.push_back(channel);
             }
 
             cv::Mat rawImage = util::BuildRawImage(rawChannels, offsetX, offsetY);
@@ -1345,8 +2244,8 @@ namespace motioncam {
             }
             
             // Update the black/white levels before writing DNG
-            auto metadata = rawContainer.getCameraMetadata();
-            auto frameMetadata = referenceRawBuffer->metadata;
+            RawCameraMetadata metadata = rawContainer.getCameraMetadata();
+            RawImageMetadata frameMetadata = referenceRawBuffer->metadata;
             
             metadata.updateBayerOffsets( { 0, 0, 0, 0 }, EXPANDED_RANGE);
             
@@ -1355,47 +2254,67 @@ namespace motioncam {
                         
             std::string dngFile = rawOutputPath + ".dng";
             
-            try {
-                util::WriteDng(rawImage, metadata, frameMetadata, frameMetadata.screenOrientation, true, true, dngFile);
-            }
-            catch(std::runtime_error& e) {
-            }
+            // Written while the image is post processed
+            outputWriter->submit([rawImage, metadata, frameMetadata, dngFile, listener, outputCancelled]() {
+                if(*outputCancelled)
+                    return;
+                
+                try {
+                    util::WriteDng(rawImage, metadata, frameMetadata, frameMetadata.screenOrientation, true, true, dngFile);
+                    listener->onStageSaved(dngFile, OutputStage::DNG);
+                }
+                catch(std::runtime_error& e) {
+                    logger::log("Failed to write " + dngFile + ": " + e.what());
+                }
+            });
         }
         
-        cv::Mat outputImage = postProcess(
-            denoiseOutput,
-            hdrMetadata,
-            offsetX,
-            offsetY,
-            noise,
-            referenceRawBuffer->metadata,
-            rawContainer.getCameraMetadata(),
-            settings);
+        cv::Mat outputImage = postProcessOutput(denoiseOutput, noise);
+        
+        // Release the denoised and HDR buffers before writing the output
+        denoiseOutput.clear();
+        hdrMetadata = nullptr;
         
         progressHelper.postProcessCompleted();
+        
+        if(progressHelper.cancelled()) {
+            *outputCancelled = true;
+            
+            // Notify from the writer so nothing is reported after the listener has been told the capture completed
+            outputWriter->submit([listener]() {
+                listener->onError("Cancelled");
+                listener->onCompleted();
+            });
+            
+            return;
+        }
          
+        // Only the host application can install the allocator before its first pipeline runs
+        if(HalideAllocator::installed()) {
+            auto allocatorStats = HalideAllocator::stats();
+            
+            logger::log("Halide scratch memory peak " + std::to_string(allocatorStats.peakAllocatedBytes / (1024 * 1024)) + " MB" +
+                        " reused " + std::to_string(static_cast<int>(allocatorStats.reuseRate() * 100)) + "%");
+        }
+        
         // Write image
-        std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, rawContainer.getPostProcessSettings().jpegQuality };
-        cv::imwrite(outputPath, outputImage, writeParams);
-
-        // Create thumbnail
-        cv::Mat thumbnail;
-
-        int width = 320;
-        int height = (int) std::lround((outputImage.rows / (double) outputImage.cols) * width);
-
-        cv::resize(outputImage, thumbnail, cv::Size(width, height));
-
-        // Add exif data to the output image
-        auto exifMetadata = referenceRawBuffer->metadata;
-
-        addExifMetadata(exifMetadata,
-                        thumbnail,
-                        rawContainer.getCameraMetadata(),
-                        rawContainer.getPostProcessSettings(),
-                        outputPath);
+        RawImageMetadata outputImageMetadata = referenceRawBuffer->metadata;
+        RawCameraMetadata outputCameraMetadata = rawContainer.getCameraMetadata();
+        PostProcessSettings outputSettings = postProcessSettings;
+        std::string outputImagePath = outputPath;
         
-        progressHelper.imageSaved();
+        outputWriter->submit([outputImage, outputImageMetadata, outputCameraMetadata, outputSettings, outputImagePath, listener]() {
+            try {
+                writeOutputImage(outputImage, outputImagePath, outputImageMetadata, outputCameraMetadata, outputSettings);
+                listener->onStageSaved(outputImagePath, OutputStage::FINAL);
+            }
+            catch(std::exception& e) {
+                listener->onError(e.what());
+            }
+            
+            listener->onProgressUpdate(100);
+            listener->onCompleted();
+        });
     }
 
     void ImageProcessor::process(const std::string& inputPath,
@@ -1560,406 +2479,6 @@ namespace motioncam {
         return m[0];
     }
 
-    std::vector<Halide::Runtime::Buffer<uint16_t>> ImageProcessor::denoise(
-        std::shared_ptr<RawImageBuffer> referenceRawBuffer,
-        std::vector<std::shared_ptr<RawImageBuffer>> buffers,
-        const std::vector<float>& denoiseWeights,
-        const RawCameraMetadata& cameraMetadata)
-    {
-        const int patchSize = 16;
-        std::vector<float> noise, signal;
-
-        // Measure noise in reference
-        measureNoise(cameraMetadata, *referenceRawBuffer, noise, signal, patchSize);
-
-        auto reference = loadRawImage(*referenceRawBuffer, cameraMetadata, true);
-                
-        cv::Mat referenceFlowImage(reference->previewBuffer.height(), reference->previewBuffer.width(), CV_8U, reference->previewBuffer.data());
-        
-        Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
-        Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
-        
-        fuseOutput.fill(0);
-        
-        float w = 1.0f / (2.0f*sqrt(2.0f));
-
-        for(int i = 0; i < buffers.size(); i++) {
-            auto current = loadRawImage(*buffers[i], cameraMetadata, true);
-            
-            cv::Mat flow;
-            cv::Mat currentFlowImage(current->previewBuffer.height(),
-                                     current->previewBuffer.width(),
-                                     CV_8U,
-                                     current->previewBuffer.data());
-            
-            cv::Ptr<cv::DISOpticalFlow> opticalFlow =
-                cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
-                                
-            opticalFlow->setPatchSize(patchSize);
-            opticalFlow->setPatchStride(patchSize/2);
-            opticalFlow->setGradientDescentIterations(16);
-            opticalFlow->setUseMeanNormalization(true);
-            opticalFlow->setUseSpatialPropagation(true);
-            
-            opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
-            
-            Halide::Runtime::Buffer<float> flowBuffer =
-                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
-            
-            auto flowMean = cv::mean(flow);
-            
-            fuse_denoise_7x7(
-                reference->rawBuffer,
-                current->rawBuffer,
-                fuseOutput,
-                flowBuffer,
-                thresholdBuffer,
-                reference->rawBuffer.width(),
-                reference->rawBuffer.height(),
-                w,
-                4.0f,
-                flowMean[0],
-                flowMean[1],
-                fuseOutput);
-        }
-        
-        const int width = reference->rawBuffer.width();
-        const int height = reference->rawBuffer.height();
-
-        Halide::Runtime::Buffer<uint16_t> denoiseInput(width, height, 4);
-        
-        auto whiteLevel = cameraMetadata.getWhiteLevel(reference->metadata);
-        const auto& blackLevel = cameraMetadata.getBlackLevel(reference->metadata);
-
-        if(buffers.empty())
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = reference->rawBuffer(x, y, c) - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) )) ;
-            });
-        else {
-            const float n = static_cast<float>(buffers.size());
-
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = fuseOutput(x, y, c) / n - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) ) ) ;
-            });
-        }
-        
-        // Don't need this anymore
-        reference->rawBuffer = Halide::Runtime::Buffer<uint16_t>();
-
-        //
-        // Spatial denoising
-        //
-
-        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
-        std::vector<float> weights = denoiseWeights;
-        
-        auto wavelet = createWaveletBuffers(denoiseInput.width(), denoiseInput.height());
-        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
-
-        for(int c = 0; c < 4; c++) {
-            forward_transform(denoiseInput,
-                              denoiseInput.width(),
-                              denoiseInput.height(),
-                              c,
-                              wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3]);
-
-            int offset = wavelet[0].stride(2);
-
-            cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
-            
-            float noiseSigma = estimateNoise(hh);
-            
-            Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
-
-            inverse_transform(wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3],
-                              noiseSigma,
-                              false,
-                              weightsBuffer,
-                              outputBuffer);
-
-            denoiseOutput.push_back(outputBuffer);
-        }
-        
-        return denoiseOutput;
-    }
-
-    Halide::Runtime::Buffer<float> ImageProcessor::denoise(
-        std::shared_ptr<RawImageBuffer> referenceRawBuffer,
-        std::vector<std::shared_ptr<RawImageBuffer>> buffers,
-        const RawCameraMetadata& cameraMetadata)
-    {
-        const int patchSize = 16;
-        std::vector<float> noise, signal;
-
-        // Measure noise in reference
-        measureNoise(cameraMetadata, *referenceRawBuffer, noise, signal, patchSize);
-
-        auto reference = loadRawImage(*referenceRawBuffer, cameraMetadata, true);
-                
-        cv::Mat referenceFlowImage(reference->previewBuffer.height(), reference->previewBuffer.width(), CV_8U, reference->previewBuffer.data());
-        
-        Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
-        Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
-        
-        fuseOutput.fill(0);
-        
-        float w = 1.0f / (2.0f*sqrt(2.0f));
-
-        for(int i = 0; i < buffers.size(); i++) {
-            auto current = loadRawImage(*buffers[i], cameraMetadata, true);
-            
-            cv::Mat flow;
-            cv::Mat currentFlowImage(current->previewBuffer.height(),
-                                     current->previewBuffer.width(),
-                                     CV_8U,
-                                     current->previewBuffer.data());
-            
-            cv::Ptr<cv::DISOpticalFlow> opticalFlow =
-                cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
-                                
-            opticalFlow->setPatchSize(patchSize);
-            opticalFlow->setPatchStride(patchSize/2);
-            opticalFlow->setGradientDescentIterations(16);
-            opticalFlow->setUseMeanNormalization(true);
-            opticalFlow->setUseSpatialPropagation(true);
-            
-            opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
-            
-            Halide::Runtime::Buffer<float> flowBuffer =
-                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
-            
-            auto flowMean = cv::mean(flow);
-            
-            fuse_denoise_7x7(
-                reference->rawBuffer,
-                current->rawBuffer,
-                fuseOutput,
-                flowBuffer,
-                thresholdBuffer,
-                reference->rawBuffer.width(),
-                reference->rawBuffer.height(),
-                w,
-                4.0f,
-                flowMean[0],
-                flowMean[1],
-                fuseOutput);
-        }
-        
-        return fuseOutput;
-    }
-
-    std::vector<Halide::Runtime::Buffer<uint16_t>> ImageProcessor::denoise(
-        RawImageBuffer& referenceRawBuffer,
-        RawData& reference,
-        RawContainer& rawContainer,
-        float* outNoise,
-        ImageProgressHelper& progressHelper)
-    {
-        Measure measure("denoise()");
-        
-        auto whiteLevel = rawContainer.getCameraMetadata().getWhiteLevel(reference.metadata);
-        const auto& blackLevel = rawContainer.getCameraMetadata().getBlackLevel(reference.metadata);
-
-        //
-        // Measure noise
-        //
-        
-        int ev = (int) (0.5f + calcEv(rawContainer.getCameraMetadata(), referenceRawBuffer.metadata));
-        int patchSize = ev < 8 ? 16 : 8;
-        
-        std::vector<float> noise, signal;
-        
-        measureNoise(rawContainer.getCameraMetadata(), referenceRawBuffer, noise, signal, patchSize);
-        
-        float signalAverage = std::accumulate(signal.begin(), signal.end(), 0.0f) / signal.size();
-        signalAverage /= whiteLevel;
-        
-        Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
-
-        //
-        // Init
-        //
-                
-        std::vector<Halide::Runtime::Buffer<uint16_t>> result;
-        
-        cv::Mat referenceFlowImage(reference.previewBuffer.height(), reference.previewBuffer.width(), CV_8U, reference.previewBuffer.data());
-        Halide::Runtime::Buffer<float> fuseOutput(reference.rawBuffer.width(), reference.rawBuffer.height(), 4);
-        
-        fuseOutput.fill(0);
-                
-        auto processFrames = rawContainer.getFrames();
-        auto it = processFrames.begin();
-
-        float w = 1.0f/(2.0f*sqrt(2.0f));
-        auto method = &fuse_denoise_3x3;
-        
-        if(signalAverage < 0.02f) {
-            method = &fuse_denoise_7x7;
-        }
-        else if(signalAverage < 0.04f) {
-            method = &fuse_denoise_5x5;
-        }
-        else {
-            method = &fuse_denoise_3x3;
-        }
-        
-        //
-        // Fuse
-        //
-        
-        while(it != processFrames.end()) {
-            auto frame = rawContainer.loadFrame(*it);
-            auto current = loadRawImage(*frame, rawContainer.getCameraMetadata());
-            
-            cv::Mat flow;
-            cv::Mat currentFlowImage(current->previewBuffer.height(),
-                                     current->previewBuffer.width(),
-                                     CV_8U,
-                                     current->previewBuffer.data());
-            
-            cv::Ptr<cv::DISOpticalFlow> opticalFlow =
-                cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
-                                
-            opticalFlow->setPatchSize(patchSize);
-            opticalFlow->setPatchStride(patchSize/2);
-            opticalFlow->setGradientDescentIterations(16);
-            opticalFlow->setUseMeanNormalization(true);
-            opticalFlow->setUseSpatialPropagation(true);
-            
-            opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
-            
-            Halide::Runtime::Buffer<float> flowBuffer =
-                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
-            
-            auto flowMean = cv::mean(flow);
-            
-            method(
-                reference.rawBuffer,
-                current->rawBuffer,
-                fuseOutput,
-                flowBuffer,
-                thresholdBuffer,
-                reference.rawBuffer.width(),
-                reference.rawBuffer.height(),
-                w,
-                4.0f,
-                flowMean[0],
-                flowMean[1],
-                fuseOutput);
-            
-            progressHelper.nextFusedImage();
-
-            frame->data->release();
-            
-            ++it;
-        }
-                
-        const int width = reference.rawBuffer.width();
-        const int height = reference.rawBuffer.height();
-
-        Halide::Runtime::Buffer<uint16_t> denoiseInput(width, height, 4);
-        
-        if(processFrames.size() <= 1)
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = reference.rawBuffer(x, y, c) - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) )) ;
-            });
-        else {
-            const float n = (float) processFrames.size();
-
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = fuseOutput(x, y, c) / n - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) ) ) ;
-            });
-        }
-
-        //
-        // Spatial denoising
-        //
-
-        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
-        
-        auto wavelet = createWaveletBuffers(denoiseInput.width(), denoiseInput.height());
-
-        std::vector<float> normalisedNoise;
-        std::vector<float> weights;
-        
-        // Auto
-        if(rawContainer.getPostProcessSettings().spatialDenoiseLevel < 0) {
-            weights = estimateDenoiseWeights(signalAverage);
-        }
-        // Off
-        else if(rawContainer.getPostProcessSettings().spatialDenoiseLevel == 0) {
-            weights = { 0, 0, 0, 0 };
-        }
-        // Chosen value
-        else {
-            int i = rawContainer.getPostProcessSettings().spatialDenoiseLevel;
-            
-            i = (std::min)(i, (int) (WEIGHTS.size() - 1));
-            i = (std::max)(i, 0);
-            
-            // Weights are in reverse order
-            weights = WEIGHTS[WEIGHTS.size() - i];
-        }
-        
-        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
-
-        for(int c = 0; c < 4; c++) {
-            forward_transform(denoiseInput,
-                              denoiseInput.width(),
-                              denoiseInput.height(),
-                              c,
-                              wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3]);
-
-            int offset = wavelet[0].stride(2);
-
-            cv::Mat ll(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + 4);
-            cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
-            
-            float noiseSigma = estimateNoise(hh);
-            float n = noiseSigma / (1e-5f + cv::mean(ll)[0]);
-        
-            normalisedNoise.push_back(n);
-            
-            Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
-
-            inverse_transform(wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3],
-                              noiseSigma,
-                              false,
-                              weightsBuffer,
-                              outputBuffer);
-
-            denoiseOutput.push_back(outputBuffer);
-        }
-                
-        *outNoise = *std::max_element(normalisedNoise.begin(), normalisedNoise.end());
-        
-        return denoiseOutput;
-    }
-
     float ImageProcessor::testAlignment(std::shared_ptr<RawData> refImage,
                                         std::shared_ptr<RawData> underexposedImage,
                                         const RawCameraMetadata& cameraMetadata,
@@ -1973,7 +2492,8 @@ namespace motioncam {
     std::shared_ptr<HdrMetadata> ImageProcessor::prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                             const PostProcessSettings& settings,
                                                             const RawImageBuffer& reference,
-                                                            const RawImageBuffer& underexposed)
+                                                            const RawImageBuffer& underexposed,
+                                                            DecodedFrameStore* frameStore)
     {
         Measure measure("prepareHdr()");
         
@@ -1994,13 +2514,23 @@ namespace motioncam {
         
         const bool extendEdges = true;
 
-        auto refImage = loadRawImage(reference, cameraMetadata, extendEdges, 1.0);
-        auto underexposedImage = loadRawImage(underexposed, cameraMetadata, extendEdges, exposureScale);
+        std::shared_ptr<RawData> refImage, underexposedImage;
+        
+        if(frameStore) {
+            refImage = frameStore->rawData(reference, extendEdges, 1.0f);
+            underexposedImage = frameStore->rawData(underexposed, extendEdges, exposureScale);
+        }
+        else {
+            refImage = loadRawImage(reference, cameraMetadata, extendEdges, 1.0);
+            underexposedImage = loadRawImage(underexposed, cameraMetadata, extendEdges, exposureScale);
+        }
 
-        // Try to register the image two different ways
-        auto warpMatrix = registerImage2(refImage->previewBuffer, underexposedImage->previewBuffer);
+        ImageRegistration registration;
+        
+        auto registrationResult = registration.align(refImage->previewBuffer, underexposedImage->previewBuffer);
+        auto warpMatrix = registrationResult.warpMatrix;
         
-        if(warpMatrix.empty())
+        if(warpMatrix.empty() || registrationResult.confidence < MIN_HDR_REGISTRATION_CONFIDENCE)
             return nullptr;
 
         warpMatrix = warpMatrix.inv();
@@ -2064,12 +2594,7 @@ namespace motioncam {
         cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
 
         // Get shading map
-        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer;
-
-        const auto& shadingMap = underexposed.metadata.shadingMap();
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer.push_back(ToHalideBuffer<float>(shadingMap[i]).copy());
-        }
+        std::vector<Halide::Runtime::Buffer<float>> shadingMapBuffer = ResourceCache::get().shadingMap(underexposed.metadata);
 
         Halide::Runtime::Buffer<float> colorTransformBuffer = ToHalideBuffer<float>(cameraToSrgb);
         Halide::Runtime::Buffer<uint16_t> outputBuffer(underexposedImage->rawBuffer.width()*2, underexposedImage->rawBuffer.height()*2, 3);
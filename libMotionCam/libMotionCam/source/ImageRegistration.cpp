@@ -0,0 +1,191 @@
+#include "motioncam/ImageRegistration.h"
+#include "motioncam/Measure.h"
+#include "motioncam/Logger.h"
+
+namespace motioncam {
+    const int ECC_PYRAMID_LEVELS = 5;
+
+    RegistrationConfig::RegistrationConfig() :
+        maxDimension(640),
+        maxFeatures(1000),
+        matchRatio(0.75f),
+        ransacThreshold(2.0f),
+        minInliers(16),
+        refine(true),
+        refineResidual(1.5f),
+        refineLevel(2)
+    {
+    }
+
+    // Converts a homography estimated on an image scaled by 'scale' to one for the full size image
+    static cv::Mat scaleHomography(const cv::Mat& warpMatrix, const float scale) {
+        cv::Mat d = cv::Mat::eye(3, 3, CV_64F);
+
+        d.at<double>(0, 0) = scale;
+        d.at<double>(1, 1) = scale;
+
+        cv::Mat m;
+        warpMatrix.convertTo(m, CV_64F);
+
+        cv::Mat result = d.inv() * m * d;
+        result.convertTo(result, CV_32F);
+
+        return result;
+    }
+
+    ImageRegistration::ImageRegistration(const RegistrationConfig& config) : mConfig(config) {
+        mDetector = cv::ORB::create(config.maxFeatures);
+    }
+
+    RegistrationResult ImageRegistration::align(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
+                                                const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
+    {
+        Measure measure("ImageRegistration::align()");
+
+        cv::Mat referenceImage(referenceBuffer.height(), referenceBuffer.width(), CV_8U, (void*) referenceBuffer.data());
+        cv::Mat toAlignImage(toAlignBuffer.height(), toAlignBuffer.width(), CV_8U, (void*) toAlignBuffer.data());
+
+        RegistrationResult result;
+
+        bool estimated = estimateFromKeypoints(referenceImage, toAlignImage, result);
+
+        if(mConfig.refine && (!estimated || result.residual > mConfig.refineResidual)) {
+            if(!refine(referenceImage, toAlignImage, result) && !estimated)
+                result.warpMatrix = cv::Mat();
+        }
+
+        logger::log("Registration confidence: " + std::to_string(result.confidence) +
+                    " residual: " + std::to_string(result.residual) +
+                    " refined: " + std::to_string(result.refined));
+
+        return result;
+    }
+
+    bool ImageRegistration::estimateFromKeypoints(const cv::Mat& referenceImage,
+                                                  const cv::Mat& toAlignImage,
+                                                  RegistrationResult& result)
+    {
+        const float scale =
+            (std::min)(1.0f, mConfig.maxDimension / static_cast<float>((std::max)(referenceImage.cols, referenceImage.rows)));
+
+        cv::Mat reference, toAlign;
+
+        if(scale < 1.0f) {
+            cv::resize(referenceImage, reference, cv::Size(), scale, scale, cv::INTER_AREA);
+            cv::resize(toAlignImage, toAlign, cv::Size(), scale, scale, cv::INTER_AREA);
+        }
+        else {
+            reference = referenceImage;
+            toAlign = toAlignImage;
+        }
+
+        std::vector<cv::KeyPoint> referenceKeypoints, toAlignKeypoints;
+        cv::Mat referenceDescriptors, toAlignDescriptors;
+
+        mDetector->detectAndCompute(reference, cv::noArray(), referenceKeypoints, referenceDescriptors);
+        mDetector->detectAndCompute(toAlign, cv::noArray(), toAlignKeypoints, toAlignDescriptors);
+
+        if(referenceDescriptors.empty() || toAlignDescriptors.empty())
+            return false;
+
+        cv::BFMatcher matcher(cv::NORM_HAMMING, false);
+        std::vector<std::vector<cv::DMatch>> knnMatches;
+
+        matcher.knnMatch(toAlignDescriptors, referenceDescriptors, knnMatches, 2);
+
+        // Filter matches using the Lowe's ratio test
+        std::vector<cv::Point2f> toAlignPoints, referencePoints;
+
+        for(auto& m : knnMatches) {
+            if(m.size() == 2 && m[0].distance < mConfig.matchRatio * m[1].distance) {
+                toAlignPoints.push_back(toAlignKeypoints[m[0].queryIdx].pt);
+                referencePoints.push_back(referenceKeypoints[m[0].trainIdx].pt);
+            }
+        }
+
+        if(toAlignPoints.size() < static_cast<size_t>(mConfig.minInliers))
+            return false;
+
+        std::vector<uchar> inlierMask;
+        cv::Mat warpMatrix = cv::findHomography(toAlignPoints, referencePoints, cv::RANSAC, mConfig.ransacThreshold, inlierMask);
+
+        if(warpMatrix.empty())
+            return false;
+
+        //
+        // Measure how well the inliers fit
+        //
+
+        std::vector<cv::Point2f> projected;
+        cv::perspectiveTransform(toAlignPoints, projected, warpMatrix);
+
+        int inliers = 0;
+        double error = 0;
+
+        for(size_t i = 0; i < inlierMask.size(); i++) {
+            if(!inlierMask[i])
+                continue;
+
+            error += cv::norm(projected[i] - referencePoints[i]);
+            inliers++;
+        }
+
+        if(inliers < mConfig.minInliers)
+            return false;
+
+        const float inlierRatio = inliers / static_cast<float>(toAlignPoints.size());
+
+        result.warpMatrix = scaleHomography(warpMatrix, scale);
+        result.residual = static_cast<float>(error / inliers) / scale;
+        result.confidence = inlierRatio * (std::min)(1.0f, inliers / (4.0f * mConfig.minInliers));
+        result.refined = false;
+
+        return true;
+    }
+
+    bool ImageRegistration::refine(const cv::Mat& referenceImage,
+                                   const cv::Mat& toAlignImage,
+                                   RegistrationResult& result)
+    {
+        Measure measure("ImageRegistration::refine()");
+
+        static const cv::TermCriteria termCriteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 50, 0.001f);
+
+        const int refineLevel = (std::max)(0, (std::min)(mConfig.refineLevel, ECC_PYRAMID_LEVELS));
+
+        std::vector<cv::Mat> refPyramid;
+        std::vector<cv::Mat> curPyramid;
+
+        cv::buildPyramid(referenceImage, refPyramid, ECC_PYRAMID_LEVELS);
+        cv::buildPyramid(toAlignImage, curPyramid, ECC_PYRAMID_LEVELS);
+
+        // Start from the keypoint estimate at the refinement level, otherwise search from the coarsest level
+        int startLevel = ECC_PYRAMID_LEVELS;
+        cv::Mat warpMatrix = cv::Mat::eye(3, 3, CV_32F);
+
+        if(!result.warpMatrix.empty()) {
+            startLevel = refineLevel;
+            warpMatrix = scaleHomography(result.warpMatrix, static_cast<float>(1 << refineLevel));
+        }
+
+        double correlation = 0;
+
+        for(int i = startLevel; i >= refineLevel; i--) {
+            try {
+                correlation = cv::findTransformECC(curPyramid[i], refPyramid[i], warpMatrix, cv::MOTION_HOMOGRAPHY, termCriteria);
+            }
+            catch(cv::Exception& e) {
+                return false;
+            }
+
+            if(i > refineLevel)
+                warpMatrix = scaleHomography(warpMatrix, 0.5f);
+        }
+
+        result.warpMatrix = scaleHomography(warpMatrix, 1.0f / (1 << refineLevel));
+        result.confidence = static_cast<float>((std::max)(0.0, correlation));
+        result.refined = true;
+
+        return true;
+    }
+}
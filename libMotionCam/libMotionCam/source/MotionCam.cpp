@@ -6,6 +6,7 @@
 #include "motioncam/RawImageBuffer.h"
 #include "motioncam/RawCameraMetadata.h"
 #include "motioncam/Measure.h"
+#include "motioncam/BurstFuser.h"
 
 #include "motioncam/RawEncoder.h"
 
@@ -166,6 +167,25 @@ namespace motioncam {
         return Halide::Runtime::Buffer<uint16_t>(width, height);
     }
 
+    std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseFrame(std::shared_ptr<RawImageBuffer> frame,
+                                                                const std::vector<std::shared_ptr<RawImageBuffer>>& nearestBuffers,
+                                                                const std::vector<float>& denoiseWeights,
+                                                                const RawCameraMetadata& cameraMetadata)
+    {
+        BurstFuserConfig config;
+        
+        config.window = 7;
+        config.patchSize = 16;
+        config.weights = denoiseWeights;
+        
+        BurstFuser fuser(cameraMetadata, config);
+        BufferFrameSource frames(nearestBuffers);
+        
+        fuser.setReference(frame, ImageProcessor::loadRawImage(*frame, cameraMetadata));
+        
+        return fuser.process(frames);
+    }
+
     std::shared_ptr<Job> createFrameExportJob(std::vector<std::unique_ptr<RawContainer>>& containers,
                                               DngProcessorProgress& progress,
                                               std::vector<util::ContainerFrame> orderedFrames,
@@ -248,7 +268,7 @@ namespace motioncam {
             }
             
             if(weightSum > 1e-5f) {
-                auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
+                auto denoiseBuffers = denoiseFrame(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
                 bayerBuffer = Halide::Runtime::Buffer<uint16_t>(denoiseBuffers[0].width() * 2, denoiseBuffers[0].height() * 2);
                 
                 build_bayer2(denoiseBuffers[0],
@@ -291,7 +311,7 @@ namespace motioncam {
             // Get number of nearest buffers
             util::GetNearestBuffers(containers, orderedFrames, frameIdx, mergeFrames, nearestBuffers);
             
-            auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
+            auto denoiseBuffers = denoiseFrame(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
             bayerBuffer = Halide::Runtime::Buffer<uint16_t>(denoiseBuffers[0].width() * 2, denoiseBuffers[0].height() * 2);
             
             build_bayer2(denoiseBuffers[0],
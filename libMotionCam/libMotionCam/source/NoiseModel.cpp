@@ -0,0 +1,148 @@
+#include "motioncam/NoiseModel.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/Logger.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace motioncam {
+    // Number of samples per channel used to find the median signal
+    const int SIGNAL_SAMPLES = 65536;
+
+    // Noise above this fraction of the range at the median signal means the profile is not usable
+    const float MAX_RELATIVE_NOISE = 0.25f;
+
+    float NoiseCurves::noise(int channel, float rawValue) const {
+        const float x = (std::max)(0.0f, rawValue - blackLevel[channel]) / range[channel];
+        const float variance = scale[channel] * x + offset[channel];
+
+        return range[channel] * std::sqrt((std::max)(0.0f, variance));
+    }
+
+    namespace {
+        bool isUsable(float scale, float offset) {
+            if(!std::isfinite(scale) || !std::isfinite(offset))
+                return false;
+
+            // Noise has to increase with the signal and be positive over the whole range
+            return scale > 0 && (scale + offset) > 0;
+        }
+
+        // Median of each channel from a sparse sample of the image
+        void measureSignal(const Halide::Runtime::Buffer<uint16_t>& deinterleaved, std::vector<float>& outSignal) {
+            const int width = deinterleaved.dim(0).extent();
+            const int height = deinterleaved.dim(1).extent();
+
+            const double pixels = static_cast<double>(width) * height;
+            const int step = (std::max)(1, static_cast<int>(std::sqrt(pixels / SIGNAL_SAMPLES)));
+
+            std::vector<uint16_t> samples;
+            samples.reserve(static_cast<size_t>((width / step + 1) * (height / step + 1)));
+
+            outSignal.resize(4);
+
+            for(int c = 0; c < 4; c++) {
+                samples.clear();
+
+                for(int y = deinterleaved.dim(1).min(); y <= deinterleaved.dim(1).max(); y += step) {
+                    for(int x = deinterleaved.dim(0).min(); x <= deinterleaved.dim(0).max(); x += step) {
+                        samples.push_back(deinterleaved(x, y, c));
+                    }
+                }
+
+                if(samples.empty()) {
+                    outSignal[c] = 0;
+                    continue;
+                }
+
+                auto median = samples.begin() + samples.size() / 2;
+                std::nth_element(samples.begin(), median, samples.end());
+
+                outSignal[c] = *median;
+            }
+        }
+    }
+
+    bool NoiseModel::getCurves(const RawCameraMetadata& cameraMetadata,
+                               const RawImageMetadata& metadata,
+                               NoiseCurves& outCurves)
+    {
+        const auto& profile = metadata.noiseProfile;
+
+        // One pair of coefficients per channel or a single pair for all of them
+        if(profile.size() != 8 && profile.size() != 2)
+            return false;
+
+        const auto& blackLevel = cameraMetadata.getBlackLevel(metadata);
+        const float whiteLevel = cameraMetadata.getWhiteLevel(metadata);
+
+        if(blackLevel.size() < 4)
+            return false;
+
+        NoiseCurves curves;
+
+        for(int c = 0; c < 4; c++) {
+            const size_t i = profile.size() == 8 ? c*2 : 0;
+
+            curves.scale[c]      = static_cast<float>(profile[i]);
+            curves.offset[c]     = static_cast<float>(profile[i + 1]);
+            curves.blackLevel[c] = blackLevel[c];
+            curves.range[c]      = whiteLevel - blackLevel[c];
+
+            if(!isUsable(curves.scale[c], curves.offset[c]) || curves.range[c] <= 0)
+                return false;
+        }
+
+        outCurves = curves;
+
+        return true;
+    }
+
+    void NoiseModel::estimate(const RawCameraMetadata& cameraMetadata,
+                              const RawImageBuffer& rawBuffer,
+                              const Halide::Runtime::Buffer<uint16_t>& deinterleaved,
+                              const int patchSize,
+                              std::vector<float>& outNoise,
+                              std::vector<float>& outSignal)
+    {
+        outNoise.clear();
+        outSignal.clear();
+
+        NoiseCurves curves;
+        bool useProfile = getCurves(cameraMetadata, rawBuffer.metadata, curves);
+
+        if(useProfile) {
+            std::vector<float> signal;
+
+            measureSignal(deinterleaved, signal);
+
+            // Signal is normalised to ISO 100 like the measured estimate
+            const float isoScale = rawBuffer.metadata.iso > 0 ? rawBuffer.metadata.iso / 100.0f : 1.0f;
+
+            for(int c = 0; c < 4; c++) {
+                const float noise = curves.noise(c, signal[c]);
+
+                // Profile does not match the image
+                if(!std::isfinite(noise) || noise <= 0 || noise > MAX_RELATIVE_NOISE * curves.range[c]) {
+                    useProfile = false;
+                    break;
+                }
+
+                outNoise.push_back(noise);
+                outSignal.push_back(signal[c] / isoScale);
+            }
+        }
+
+        if(!useProfile) {
+            logger::log("Noise profile not usable, measuring noise");
+
+            outNoise.clear();
+            outSignal.clear();
+
+            ImageProcessor::measureNoise(cameraMetadata, rawBuffer, outNoise, outSignal, patchSize);
+        }
+    }
+}
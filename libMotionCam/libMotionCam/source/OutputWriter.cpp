@@ -0,0 +1,86 @@
+#include "motioncam/OutputWriter.h"
+#include "motioncam/Logger.h"
+
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace motioncam {
+    struct OutputWriter::Impl {
+        Impl() : running(true), busy(false) {
+        }
+
+        std::mutex mutex;
+        std::condition_variable taskAvailable;
+        std::condition_variable idle;
+
+        std::queue<std::function<void()>> tasks;
+        std::thread thread;
+        bool running;
+        bool busy;
+    };
+
+    OutputWriter::OutputWriter() : mImpl(new Impl()) {
+        mImpl->thread = std::thread(&OutputWriter::run, this);
+    }
+
+    OutputWriter::~OutputWriter() {
+        {
+            std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+            mImpl->running = false;
+            mImpl->taskAvailable.notify_all();
+        }
+
+        mImpl->thread.join();
+    }
+
+    void OutputWriter::submit(const std::function<void()>& task) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        mImpl->tasks.push(task);
+        mImpl->taskAvailable.notify_one();
+    }
+
+    void OutputWriter::wait() {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        mImpl->idle.wait(lock, [&]() { return mImpl->tasks.empty() && !mImpl->busy; });
+    }
+
+    void OutputWriter::run() {
+        while(true) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+                mImpl->taskAvailable.wait(lock, [&]() { return !mImpl->running || !mImpl->tasks.empty(); });
+
+                // Pending tasks are finished before stopping
+                if(mImpl->tasks.empty())
+                    return;
+
+                task = mImpl->tasks.front();
+                mImpl->tasks.pop();
+                mImpl->busy = true;
+            }
+
+            try {
+                task();
+            }
+            catch(std::exception& e) {
+                logger::log("Output task failed: " + std::string(e.what()));
+            }
+
+            std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+            mImpl->busy = false;
+
+            if(mImpl->tasks.empty())
+                mImpl->idle.notify_all();
+        }
+    }
+}
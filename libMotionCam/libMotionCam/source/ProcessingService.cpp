@@ -0,0 +1,386 @@
+#include "motioncam/ProcessingService.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/Settings.h"
+#include "motioncam/Logger.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/HalideAllocator.h"
+#include "motioncam/OutputWriter.h"
+
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include <HalideRuntime.h>
+#include <opencv2/core.hpp>
+
+namespace motioncam {
+    // Number of finished jobs kept so their state and timing can be queried
+    const size_t MAX_FINISHED_JOBS = 256;
+
+    typedef std::chrono::steady_clock Clock;
+
+    ProcessingJob::ProcessingJob() : priority(JobPriority::NORMAL) {
+    }
+
+    ProcessingServiceConfig::ProcessingServiceConfig() :
+        maxConcurrentJobs(2),
+        threadBudget(0)
+    {
+    }
+
+    struct JobEntry {
+        JobEntry(int64_t id, const ProcessingJob& job) : id(id), job(job), state(JobState::QUEUED), cancelled(false) {
+        }
+
+        const int64_t id;
+        ProcessingJob job;
+        JobState state;
+        std::atomic<bool> cancelled;
+        std::string error;
+
+        Clock::time_point submitted;
+        Clock::time_point started;
+        Clock::time_point finished;
+    };
+
+    //
+    // Forwards progress to the listener of the job and stops processing when the job is cancelled
+    //
+
+    class JobProgress : public ImageProcessorProgress {
+    public:
+        JobProgress(JobEntry& entry) : mEntry(entry) {
+        }
+
+        std::string onPreviewSaved(const std::string& outputPath) const {
+            if(mEntry.job.progressListener)
+                return mEntry.job.progressListener->onPreviewSaved(outputPath);
+
+            return "{}";
+        }
+
+        bool onProgressUpdate(int progress) const {
+            if(mEntry.cancelled)
+                return false;
+
+            if(mEntry.job.progressListener && !mEntry.job.progressListener->onProgressUpdate(progress))
+                mEntry.cancelled = true;
+
+            return !mEntry.cancelled;
+        }
+
+        void onCompleted() const {
+            if(mEntry.job.progressListener)
+                mEntry.job.progressListener->onCompleted();
+        }
+
+        void onError(const std::string& error) const {
+            mEntry.error = error;
+
+            if(mEntry.job.progressListener)
+                mEntry.job.progressListener->onError(error);
+        }
+
+        void onStageSaved(const std::string& outputPath, OutputStage stage) const {
+            if(mEntry.job.progressListener)
+                mEntry.job.progressListener->onStageSaved(outputPath, stage);
+        }
+
+    private:
+        JobEntry& mEntry;
+    };
+
+    struct ProcessingService::Impl {
+        Impl() : nextJobId(1), running(true), activeJobs(0) {
+        }
+
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        std::condition_variable jobFinished;
+
+        // Ordered by highest priority, then by submission order
+        std::map<std::pair<int, int64_t>, std::shared_ptr<JobEntry>> queue;
+        std::map<int64_t, std::shared_ptr<JobEntry>> jobs;
+        std::vector<int64_t> finishedJobs;
+
+        std::vector<std::thread> workers;
+        int64_t nextJobId;
+        bool running;
+        int activeJobs;
+        
+        // Writes the output of all jobs so workers can start the next job straight away.
+        // Last so it is destroyed first, its tasks use the rest of the state.
+        OutputWriter outputWriter;
+    };
+
+    static bool isFinished(JobState state) {
+        return state == JobState::COMPLETED || state == JobState::CANCELLED || state == JobState::FAILED;
+    }
+
+    static double elapsedMs(const Clock::time_point& start, const Clock::time_point& end) {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    ProcessingService::ProcessingService(const ProcessingServiceConfig& config) : mImpl(new Impl()) {
+        int threads = config.threadBudget;
+        if(threads <= 0)
+            threads = (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+        // The Halide and OpenCV thread pools are process wide, all jobs share them
+        halide_set_num_threads(threads);
+        cv::setNumThreads(threads);
+
+        // Jobs running concurrently share the pooled Halide scratch memory
+        HalideAllocator::install();
+
+        const int numWorkers = (std::max)(1, config.maxConcurrentJobs);
+
+        for(int i = 0; i < numWorkers; i++)
+            mImpl->workers.emplace_back(&ProcessingService::run, this);
+    }
+
+    ProcessingService::~ProcessingService() {
+        shutdown();
+    }
+
+    int64_t ProcessingService::submit(const ProcessingJob& job) {
+        if(!job.container && job.containerPath.empty())
+            throw InvalidState("Job has no container");
+
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        if(!mImpl->running)
+            throw InvalidState("Processing service has been shut down");
+
+        const int64_t jobId = mImpl->nextJobId++;
+
+        auto entry = std::make_shared<JobEntry>(jobId, job);
+        entry->submitted = Clock::now();
+
+        mImpl->jobs[jobId] = entry;
+        mImpl->queue[std::make_pair(-static_cast<int>(job.priority), jobId)] = entry;
+
+        mImpl->jobAvailable.notify_one();
+
+        return jobId;
+    }
+
+    bool ProcessingService::cancel(int64_t jobId) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        auto it = mImpl->jobs.find(jobId);
+        if(it == mImpl->jobs.end())
+            return false;
+
+        auto entry = it->second;
+
+        if(isFinished(entry->state))
+            return false;
+
+        entry->cancelled = true;
+
+        // Remove from queue if not started yet
+        if(entry->state == JobState::QUEUED &&
+           mImpl->queue.erase(std::make_pair(-static_cast<int>(entry->job.priority), jobId)) > 0)
+        {
+            cancelQueuedJob(entry);
+        }
+
+        return true;
+    }
+
+    JobState ProcessingService::state(int64_t jobId) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        auto it = mImpl->jobs.find(jobId);
+        if(it == mImpl->jobs.end())
+            return JobState::UNKNOWN;
+
+        return it->second->state;
+    }
+
+    bool ProcessingService::timing(int64_t jobId, JobTiming& outTiming) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        auto it = mImpl->jobs.find(jobId);
+        if(it == mImpl->jobs.end())
+            return false;
+
+        auto& entry = *it->second;
+        auto now = Clock::now();
+
+        switch(entry.state) {
+            case JobState::QUEUED:
+                outTiming.queuedMs = elapsedMs(entry.submitted, now);
+                outTiming.processingMs = 0;
+                break;
+
+            case JobState::RUNNING:
+                outTiming.queuedMs = elapsedMs(entry.submitted, entry.started);
+                outTiming.processingMs = elapsedMs(entry.started, now);
+                break;
+
+            default:
+                // Jobs cancelled while queued never started
+                if(entry.started == Clock::time_point()) {
+                    outTiming.queuedMs = elapsedMs(entry.submitted, entry.finished);
+                    outTiming.processingMs = 0;
+                }
+                else {
+                    outTiming.queuedMs = elapsedMs(entry.submitted, entry.started);
+                    outTiming.processingMs = elapsedMs(entry.started, entry.finished);
+                }
+                break;
+        }
+
+        return true;
+    }
+
+    void ProcessingService::wait(int64_t jobId) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        mImpl->jobFinished.wait(lock, [&]() {
+            auto it = mImpl->jobs.find(jobId);
+            return it == mImpl->jobs.end() || isFinished(it->second->state);
+        });
+    }
+
+    void ProcessingService::waitForAll() {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        mImpl->jobFinished.wait(lock, [&]() {
+            return mImpl->queue.empty() && mImpl->activeJobs == 0;
+        });
+    }
+
+    void ProcessingService::shutdown() {
+        {
+            std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+            if(!mImpl->running && mImpl->workers.empty())
+                return;
+
+            mImpl->running = false;
+
+            // Cancel everything that has not started
+            for(auto& queued : mImpl->queue)
+                cancelQueuedJob(queued.second);
+
+            mImpl->queue.clear();
+
+            mImpl->jobAvailable.notify_all();
+            mImpl->jobFinished.notify_all();
+        }
+
+        for(auto& worker : mImpl->workers)
+            worker.join();
+
+        mImpl->workers.clear();
+        
+        // Finish writing the output of running jobs and reporting the cancelled ones
+        mImpl->outputWriter.wait();
+    }
+
+    void ProcessingService::run() {
+        while(true) {
+            std::shared_ptr<JobEntry> entry;
+
+            {
+                std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+                mImpl->jobAvailable.wait(lock, [&]() { return !mImpl->running || !mImpl->queue.empty(); });
+
+                if(mImpl->queue.empty())
+                    return;
+
+                entry = mImpl->queue.begin()->second;
+                mImpl->queue.erase(mImpl->queue.begin());
+
+                entry->state = JobState::RUNNING;
+                entry->started = Clock::now();
+
+                ++mImpl->activeJobs;
+            }
+
+            // Used by the output tasks of the job after processing returns
+            auto progress = std::make_shared<JobProgress>(*entry);
+
+            try {
+                std::shared_ptr<RawContainer> container = entry->job.container;
+                if(!container)
+                    container = RawContainer::Open(entry->job.containerPath);
+
+                const PostProcessSettings& settings =
+                    entry->job.settings ? *entry->job.settings : container->getPostProcessSettings();
+
+                ImageProcessor::process(*container, settings, entry->job.outputPath, progress, &mImpl->outputWriter);
+            }
+            catch(std::exception& e) {
+                progress->onError(e.what());
+                progress->onCompleted();
+            }
+
+            // Output tasks run in order, the job is finished once the ones it submitted are done
+            mImpl->outputWriter.submit([this, entry, progress]() {
+                finishJob(entry);
+            });
+        }
+    }
+
+    void ProcessingService::cancelQueuedJob(const std::shared_ptr<JobEntry>& entry) {
+        entry->cancelled = true;
+
+        // Counted as active until it is finished like a running job, after the output tasks submitted before it
+        ++mImpl->activeJobs;
+
+        mImpl->outputWriter.submit([this, entry]() {
+            JobProgress progress(*entry);
+
+            progress.onError("Cancelled");
+            progress.onCompleted();
+
+            finishJob(entry);
+        });
+    }
+
+    void ProcessingService::finishJob(const std::shared_ptr<JobEntry>& entry) {
+        std::unique_lock<std::mutex> lock(mImpl->mutex);
+
+        entry->finished = Clock::now();
+
+        if(entry->cancelled)
+            entry->state = JobState::CANCELLED;
+        else if(!entry->error.empty())
+            entry->state = JobState::FAILED;
+        else
+            entry->state = JobState::COMPLETED;
+
+        // Jobs cancelled while queued never started
+        if(entry->started == Clock::time_point()) {
+            logger::log("Job " + std::to_string(entry->id) +
+                        " cancelled after queued " + std::to_string(elapsedMs(entry->submitted, entry->finished)) + "ms");
+        }
+        else {
+            logger::log("Job " + std::to_string(entry->id) +
+                        " queued " + std::to_string(elapsedMs(entry->submitted, entry->started)) + "ms" +
+                        " processed " + std::to_string(elapsedMs(entry->started, entry->finished)) + "ms");
+        }
+
+        // Forget the oldest finished jobs
+        mImpl->finishedJobs.push_back(entry->id);
+
+        while(mImpl->finishedJobs.size() > MAX_FINISHED_JOBS) {
+            mImpl->jobs.erase(mImpl->finishedJobs.front());
+            mImpl->finishedJobs.erase(mImpl->finishedJobs.begin());
+        }
+
+        --mImpl->activeJobs;
+
+        mImpl->jobFinished.notify_all();
+    }
+}
@@ -0,0 +1,248 @@
+#include "motioncam/ResourceCache.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/BlueNoiseLUT.h"
+#include "motioncam/Lock.h"
+
+#include <list>
+#include <map>
+
+namespace motioncam {
+    const size_t DEFAULT_COLOR_MATRICES_BYTES   = 1024 * 1024;
+    const size_t DEFAULT_SHADING_MAP_BYTES      = 16 * 1024 * 1024;
+
+    // FNV-1a
+    const uint64_t HASH_OFFSET_BASIS    = 14695981039346656037ULL;
+    const uint64_t HASH_PRIME           = 1099511628211ULL;
+
+    ResourceKey::ResourceKey() : mHash(HASH_OFFSET_BASIS) {
+    }
+
+    ResourceKey& ResourceKey::add(const void* data, size_t len) {
+        auto bytes = static_cast<const uint8_t*>(data);
+
+        for(size_t i = 0; i < len; i++) {
+            mHash ^= bytes[i];
+            mHash *= HASH_PRIME;
+        }
+
+        return *this;
+    }
+
+    ResourceKey& ResourceKey::add(const cv::Mat& m) {
+        add(m.rows);
+        add(m.cols);
+        add(m.type());
+
+        if(m.empty())
+            return *this;
+
+        if(m.isContinuous()) {
+            add(m.data, m.total() * m.elemSize());
+        }
+        else {
+            for(int y = 0; y < m.rows; y++)
+                add(m.ptr(y), m.cols * m.elemSize());
+        }
+
+        return *this;
+    }
+
+    ResourceKey& ResourceKey::add(double v) {
+        return add(&v, sizeof(v));
+    }
+
+    ResourceKey& ResourceKey::add(int v) {
+        return add(&v, sizeof(v));
+    }
+
+    //
+    // Least recently used cache with a memory limit
+    //
+
+    template<typename T>
+    class LruCache {
+    public:
+        LruCache(size_t maxBytes) : mMaxBytes(maxBytes), mBytes(0) {
+        }
+
+        bool get(uint64_t key, T& outValue) {
+            auto it = mIndex.find(key);
+            if(it == mIndex.end())
+                return false;
+
+            // Move to front
+            mEntries.splice(mEntries.begin(), mEntries, it->second);
+            outValue = it->second->value;
+
+            return true;
+        }
+
+        void put(uint64_t key, const T& value, size_t bytes) {
+            auto it = mIndex.find(key);
+            if(it != mIndex.end()) {
+                mBytes -= it->second->bytes;
+                mEntries.erase(it->second);
+                mIndex.erase(it);
+            }
+
+            // Don't cache anything larger than the limit
+            if(bytes > mMaxBytes)
+                return;
+
+            mEntries.push_front(Entry{ key, value, bytes });
+            mIndex[key] = mEntries.begin();
+            mBytes += bytes;
+
+            evict();
+        }
+
+        void setMaxBytes(size_t maxBytes) {
+            mMaxBytes = maxBytes;
+            evict();
+        }
+
+        size_t bytes() const {
+            return mBytes;
+        }
+
+        void clear() {
+            mEntries.clear();
+            mIndex.clear();
+            mBytes = 0;
+        }
+
+    private:
+        struct Entry {
+            uint64_t key;
+            T value;
+            size_t bytes;
+        };
+
+        void evict() {
+            while(mBytes > mMaxBytes && !mEntries.empty()) {
+                auto& last = mEntries.back();
+
+                mBytes -= last.bytes;
+                mIndex.erase(last.key);
+                mEntries.pop_back();
+            }
+        }
+
+        size_t mMaxBytes;
+        size_t mBytes;
+        std::list<Entry> mEntries;
+        std::map<uint64_t, typename std::list<Entry>::iterator> mIndex;
+    };
+
+    struct ResourceCache::Impl {
+        Impl() :
+            colorMatrices(DEFAULT_COLOR_MATRICES_BYTES),
+            shadingMaps(DEFAULT_SHADING_MAP_BYTES)
+        {
+        }
+
+        std::recursive_mutex mutex;
+
+        cv::Mat blueNoise;
+        LruCache<ColorMatrices> colorMatrices;
+        LruCache<std::vector<Halide::Runtime::Buffer<float>>> shadingMaps;
+    };
+
+    ResourceCache& ResourceCache::get() {
+        static ResourceCache instance;
+        return instance;
+    }
+
+    ResourceCache::ResourceCache() : mImpl(new Impl()) {
+    }
+
+    ResourceCache::~ResourceCache() {
+    }
+
+    void ResourceCache::setLimits(size_t colorMatricesBytes, size_t shadingMapBytes) {
+        Lock lock(mImpl->mutex, "ResourceCache::setLimits()");
+
+        mImpl->colorMatrices.setMaxBytes(colorMatricesBytes);
+        mImpl->shadingMaps.setMaxBytes(shadingMapBytes);
+    }
+
+    size_t ResourceCache::memoryUsage() {
+        Lock lock(mImpl->mutex, "ResourceCache::memoryUsage()");
+
+        return mImpl->blueNoise.total() * mImpl->blueNoise.elemSize() +
+               mImpl->colorMatrices.bytes() +
+               mImpl->shadingMaps.bytes();
+    }
+
+    void ResourceCache::clear() {
+        Lock lock(mImpl->mutex, "ResourceCache::clear()");
+
+        mImpl->blueNoise.release();
+        mImpl->colorMatrices.clear();
+        mImpl->shadingMaps.clear();
+    }
+
+    cv::Mat ResourceCache::blueNoise() {
+        Lock lock(mImpl->mutex, "ResourceCache::blueNoise()");
+
+        if(mImpl->blueNoise.empty())
+            mImpl->blueNoise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
+
+        return mImpl->blueNoise;
+    }
+
+    ColorMatrices ResourceCache::colorMatrices(const ResourceKey& key, const std::function<ColorMatrices()>& create) {
+        ColorMatrices result;
+
+        {
+            Lock lock(mImpl->mutex, "ResourceCache::colorMatrices()");
+
+            if(mImpl->colorMatrices.get(key.value(), result))
+                return result;
+        }
+
+        result = create();
+
+        size_t bytes = sizeof(ColorMatrices) +
+            result.cameraToPcs.total() * result.cameraToPcs.elemSize() +
+            result.pcsToSrgb.total() * result.pcsToSrgb.elemSize();
+
+        Lock lock(mImpl->mutex, "ResourceCache::colorMatrices()");
+
+        mImpl->colorMatrices.put(key.value(), result, bytes);
+
+        return result;
+    }
+
+    std::vector<Halide::Runtime::Buffer<float>> ResourceCache::shadingMap(const RawImageMetadata& metadata) {
+        const auto& shadingMap = metadata.shadingMap();
+
+        ResourceKey key;
+        for(const auto& m : shadingMap)
+            key.add(m);
+
+        std::vector<Halide::Runtime::Buffer<float>> result;
+
+        {
+            Lock lock(mImpl->mutex, "ResourceCache::shadingMap()");
+
+            if(mImpl->shadingMaps.get(key.value(), result))
+                return result;
+        }
+
+        size_t bytes = 0;
+
+        for(const auto& m : shadingMap) {
+            cv::Mat c = m.isContinuous() ? m : m.clone();
+
+            result.push_back(Halide::Runtime::Buffer<float>((float*) c.data, c.cols, c.rows).copy());
+            bytes += c.total() * c.elemSize();
+        }
+
+        Lock lock(mImpl->mutex, "ResourceCache::shadingMap()");
+
+        mImpl->shadingMaps.put(key.value(), result, bytes);
+
+        return result;
+    }
+}
@@ -41,6 +41,21 @@ namespace motioncam {
 
     PostProcessSettings::PostProcessSettings() :
         spatialDenoiseLevel(-1),
+        fuseFramesInFlight(2),
+        fuseTileSize(0),
+        fuseTileHalo(64),
+        fuseTileAlignment(false),
+        adaptiveMerge(false),
+        mergeTargetSnr(150.0f),
+        memoryBudget(0),
+        progressive(false),
+        progressiveMergeFrames(0),
+        roiX(0.0f),
+        roiY(0.0f),
+        roiWidth(0.0f),
+        roiHeight(0.0f),
+        binnedOutput(false),
+        postProcessTileSize(0),
         temperature(-1),
         tint(-1),
         gamma(2.2f),
@@ -72,6 +87,21 @@ namespace motioncam {
 
     PostProcessSettings::PostProcessSettings(const json11::Json& json) : PostProcessSettings() {
         spatialDenoiseLevel             = getSetting(json, "spatialDenoiseLevel",  spatialDenoiseLevel);
+        fuseFramesInFlight              = getSetting(json, "fuseFramesInFlight",   fuseFramesInFlight);
+        fuseTileSize                    = getSetting(json, "fuseTileSize",         fuseTileSize);
+        fuseTileHalo                    = getSetting(json, "fuseTileHalo",         fuseTileHalo);
+        fuseTileAlignment               = getSetting(json, "fuseTileAlignment",    fuseTileAlignment);
+        adaptiveMerge                   = getSetting(json, "adaptiveMerge",        adaptiveMerge);
+        mergeTargetSnr                  = getSetting(json, "mergeTargetSnr",       mergeTargetSnr);
+        memoryBudget                    = getSetting(json, "memoryBudget",         memoryBudget);
+        progressive                     = getSetting(json, "progressive",          progressive);
+        progressiveMergeFrames          = getSetting(json, "progressiveMergeFrames", progressiveMergeFrames);
+        roiX                            = getSetting(json, "roiX",                 roiX);
+        roiY                            = getSetting(json, "roiY",                 roiY);
+        roiWidth                        = getSetting(json, "roiWidth",             roiWidth);
+        roiHeight                       = getSetting(json, "roiHeight",            roiHeight);
+        binnedOutput                    = getSetting(json, "binnedOutput",         binnedOutput);
+        postProcessTileSize             = getSetting(json, "postProcessTileSize",  postProcessTileSize);
         
         tonemapVariance                 = getSetting(json, "tonemapVariance",   tonemapVariance);
 
@@ -112,6 +142,21 @@ namespace motioncam {
 
     void PostProcessSettings::toJson(std::map<std::string, json11::Json>& json) const {
         json["spatialDenoiseLevel"]             = spatialDenoiseLevel;
+        json["fuseFramesInFlight"]              = fuseFramesInFlight;
+        json["fuseTileSize"]                    = fuseTileSize;
+        json["fuseTileHalo"]                    = fuseTileHalo;
+        json["fuseTileAlignment"]               = fuseTileAlignment;
+        json["adaptiveMerge"]                   = adaptiveMerge;
+        json["mergeTargetSnr"]                  = mergeTargetSnr;
+        json["memoryBudget"]                    = memoryBudget;
+        json["progressive"]                     = progressive;
+        json["progressiveMergeFrames"]          = progressiveMergeFrames;
+        json["roiX"]                            = roiX;
+        json["roiY"]                            = roiY;
+        json["roiWidth"]                        = roiWidth;
+        json["roiHeight"]                       = roiHeight;
+        json["binnedOutput"]                    = binnedOutput;
+        json["postProcessTileSize"]             = postProcessTileSize;
         json["gamma"]                           = gamma;
         json["tonemapVariance"]                 = tonemapVariance;
         json["shadows"]                         = shadows;